@@ -339,7 +339,7 @@ uart_recvTask(os_event_t *events)
                             {
                                 uint32_t buff[BC_FLASH_WALLET_SZ32];
                                 uint8_t *p = (uint8_t *)buff;
-                                for (int lp = 0; lp < sizeof(buff); lp++) {
+                                for (int lp = 0; lp < BC_FLASH_WALLET_RXLEN; lp++) {
                                     p[lp] = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
                                 }
                                 int ret = bc_flash_save_bcaddr(buff);
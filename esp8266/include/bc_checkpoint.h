@@ -0,0 +1,81 @@
+/**
+ * @file    bc_checkpoint.h
+ * @brief   checkpoint管理ヘッダ
+ *
+ * 検証済みのblock(checkpoint)の表をコンパイル時に組み込む。
+ * 表はtools/gen_checkpoint.pyでbc_checkpoint_tbl.hを生成して更新する。
+ */
+#ifndef BC_CHECKPOINT_H__
+#define BC_CHECKPOINT_H__
+
+#include "bc_misc.h"
+
+
+/**************************************************************************
+ * types
+ **************************************************************************/
+
+/** @struct bc_checkpoint_t
+ * 
+ * checkpoint
+ */
+struct bc_checkpoint_t {
+    uint32_t    height;                         ///< block高さ
+    uint8_t     bhash[BC_SZ_HASH256];           ///< Block Hash(内部のbyte順)
+    uint32_t    bits;                           ///< 難易度(0:不明)
+    uint32_t    timestamp;                      ///< block作成時間(0:不明)
+};
+
+
+/**************************************************************************
+ * prototypes
+ **************************************************************************/
+
+/** @brief  checkpointの高さ取得
+ * 
+ * @param[in]   pBhash      Block Hash
+ * @return      block高さ(0:checkpointではない)
+ */
+uint32_t ICACHE_FLASH_ATTR bc_checkpoint_get_height(const uint8_t *pBhash);
+
+
+/** @brief  checkpoint検索
+ * 
+ * @param[in]   pBhash      Block Hash
+ * @param[out]  pCp         checkpoint
+ * @retval      1           見つかった
+ * @retval      0           checkpointではない
+ */
+int ICACHE_FLASH_ATTR bc_checkpoint_find(const uint8_t *pBhash, struct bc_checkpoint_t *pCp);
+
+
+/** @brief  checkpoint照合
+ * 
+ * @param[in]   Height      block高さ(0:不明)
+ * @param[in]   pBhash      Block Hash
+ * @retval      1           一致した、あるいはcheckpointの高さではない
+ * @retval      0           checkpointの高さでBlock Hashが異なる
+ */
+int ICACHE_FLASH_ATTR bc_checkpoint_verify(uint32_t Height, const uint8_t *pBhash);
+
+
+/** @brief  次のcheckpointの高さ取得
+ * 
+ * Heightからこの高さまでのheaderは、checkpointまでつながることでPoWを確認できる。
+ * 
+ * @param[in]   Height      block高さ
+ * @return      Height以上で最も低いcheckpointの高さ(0:なし)
+ */
+uint32_t ICACHE_FLASH_ATTR bc_checkpoint_next(uint32_t Height);
+
+
+/** @brief  同期開始位置のcheckpoint取得
+ * 
+ * @param[in]   Time        この時間(epoch time)より前に作成されたblockから探す
+ * @param[out]  pCp         checkpoint(timestampが不明なものは対象外)
+ * @retval      1           見つかった
+ * @retval      0           見つからない
+ */
+int ICACHE_FLASH_ATTR bc_checkpoint_start(uint32_t Time, struct bc_checkpoint_t *pCp);
+
+#endif /* BC_CHECKPOINT_H__ */
@@ -0,0 +1,34 @@
+/**
+ * @file    bc_checkpoint_tbl.h
+ * @brief   checkpointの表(bc_checkpoint.cでincludeする)
+ *
+ * tools/gen_checkpoint.pyで生成するため、手で編集しないこと。
+ *      - heightの昇順に並べること
+ *      - Block Hashはエンディアンを逆順にしておくこと
+ * 初期値は、これまでコードに埋め込んでいたBlock#1とkBlockHashStartなど。
+ * 値を控えていなかった項目(bits, timestamp)は0(不明)にしている。
+ * kBlockHashStartより上のcheckpointがまだないため、この表ではPoWの検査を省く範囲はない。
+ */
+
+//      height, bhash, bits, timestamp
+//00000000b873e79784647a6c82962c70d228557d24a747ea4d1b8bbe878e1206
+{ 1, {
+    0x06, 0x12, 0x8e, 0x87, 0xbe, 0x8b, 0x1b, 0x4d, 
+    0xea, 0x47, 0xa7, 0x24, 0x7d, 0x55, 0x28, 0xd2, 
+    0x70, 0x2c, 0x96, 0x82, 0x6c, 0x7a, 0x64, 0x84, 
+    0x97, 0xe7, 0x73, 0xb8, 0x00, 0x00, 0x00, 0x00, 
+}, 0x1d00ffff, 0 },
+//000000002a936ca763904c3c35fce2f3556c559c0214345d31b1bcebf76acb70
+{ 546, {
+    0x70, 0xcb, 0x6a, 0xf7, 0xeb, 0xbc, 0xb1, 0x31, 
+    0x5d, 0x34, 0x14, 0x02, 0x9c, 0x55, 0x6c, 0x55, 
+    0xf3, 0xe2, 0xfc, 0x35, 0x3c, 0x4c, 0x90, 0x63, 
+    0xa7, 0x6c, 0x93, 0x2a, 0x00, 0x00, 0x00, 0x00, 
+}, 0x1d00ffff, 0 },
+//000000000079667b6264c468a4f8b12549815994583be1398d4682d9c3f83535
+{ 685351, {
+    0x35, 0x35, 0xf8, 0xc3, 0xd9, 0x82, 0x46, 0x8d, 
+    0x39, 0xe1, 0x3b, 0x58, 0x94, 0x59, 0x81, 0x49, 
+    0x25, 0xb1, 0xf8, 0xa4, 0x68, 0xc4, 0x64, 0x62, 
+    0x7b, 0x66, 0x79, 0x00, 0x00, 0x00, 0x00, 0x00, 
+}, 0x00000000, 0 },
@@ -0,0 +1,177 @@
+/**************************************************************************
+ * @file    bc_codec.h
+ * @brief   Bitcoinメッセージのデコーダ
+ *
+ * メッセージのpayloadをフィールドの並び(#bc_codec_field_t)として記述し、
+ * どのように分割されて受信しても、1つのデコーダで解析する。
+ * 解析したフィールドや配列要素ごとに、コールバック関数を呼び出す。
+ * payloadは受信しながらHASH256を計算し、完了時にプロトコルヘッダのchecksumと照合する。
+ **************************************************************************/
+#ifndef BC_CODEC_H__
+#define BC_CODEC_H__
+
+#include "bc_misc.h"
+
+
+/**************************************************************************
+ * macros
+ **************************************************************************/
+
+#define BC_CODEC_FIN        (0)         ///< payload解析完了
+#define BC_CODEC_CONT       (-1)        ///< payload解析継続
+
+#define BC_CODEC_OK         (0)         ///< [コールバック戻り値]解析継続
+#define BC_CODEC_ABORT      (1)         ///< [コールバック戻り値]残りのpayloadを読み捨てる
+
+#define BC_CODEC_SZ_BUF     (84)        ///< 再構築領域サイズ(固定長フィールドの最大長以上にすること)
+
+
+/**************************************************************************
+ * types
+ **************************************************************************/
+
+/** @enum   bc_codec_type_t
+ *
+ * フィールド種別
+ */
+enum bc_codec_type_t {
+    BC_CODEC_U8,                ///< 1byte整数
+    BC_CODEC_U32,               ///< 4byte整数
+    BC_CODEC_U64,               ///< 8byte整数
+    BC_CODEC_VARINT,            ///< varint
+    BC_CODEC_HASH256,           ///< 32byte
+    BC_CODEC_FIXED,             ///< 固定長データ(サイズはsizeで指定)
+    BC_CODEC_VARARRAY,          ///< varint(要素数) + 固定長要素(サイズはsizeで指定)の配列
+    BC_CODEC_VARBYTES,          ///< varint(データ長) + バイト列
+    BC_CODEC_REST,              ///< payloadの残り全部(バイト列)
+    BC_CODEC_PAYLOAD,           ///< payloadの残り全部(連続した領域にまとめてから通知する)
+};
+
+
+/** @struct bc_codec_elem_t
+ *
+ * コールバックへの通知内容
+ *
+ * |種別                    |pData              |len        |val            |idx            |
+ * |:--                     |:--                |:--        |:--            |:--            |
+ * |U8/U32/U64              |データ             |データ長   |値             |0              |
+ * |VARINT                  |NULL               |0          |値             |0              |
+ * |HASH256/FIXED           |データ             |データ長   |0              |0              |
+ * |VARARRAY(開始)          |NULL               |0          |要素数         |0              |
+ * |VARARRAY(要素)          |要素               |要素長     |要素数         |要素番号       |
+ * |VARBYTES/REST(開始)     |NULL               |0          |データ長       |0              |
+ * |VARBYTES/REST(データ)   |受信した分のデータ |データ長   |データ長       |offset         |
+ * |PAYLOAD                 |payload残り全部    |データ長   |データ長       |0              |
+ *
+ * pDataは受信データ内か再構築領域を指すため、コールバックから戻ったあとは使用しないこと。
+ * また、アラインメントされていない可能性がある。
+ */
+struct bc_codec_elem_t {
+    uint8_t         field;              ///< フィールド番号
+    const uint8_t   *pData;             ///< データ
+    int             len;                ///< pData長
+    uint64_t        val;                ///< 値
+    uint32_t        idx;                ///< 要素番号 or offset
+};
+
+
+/** フィールド解析コールバック
+ *
+ * @param[in]   pArg        #bc_codec_start()で渡した引数
+ * @param[in]   pElem       解析結果
+ * @retval      BC_CODEC_OK     解析継続
+ * @retval      BC_CODEC_ABORT  解析中止(残りのpayloadは読み捨て、完了コールバックも呼ばない)
+ */
+typedef int (*bc_codec_func_t)(void *pArg, const struct bc_codec_elem_t *pElem);
+
+
+/** payload解析完了コールバック
+ *
+ * @param[in]   pArg        #bc_codec_start()で渡した引数
+ * @note
+ *      - checksum不一致の場合、pFinではなくpBadを呼び出す
+ */
+typedef void (*bc_codec_fin_t)(void *pArg);
+
+
+/** @struct bc_codec_field_t
+ *
+ * フィールド定義
+ */
+struct bc_codec_field_t {
+    uint8_t             type;           ///< #bc_codec_type_t
+    uint8_t             size;           ///< FIXED, VARARRAYの要素長
+    bc_codec_func_t     pFunc;          ///< 解析コールバック(NULL:読み捨て)
+};
+
+
+/** @struct bc_codec_msg_t
+ *
+ * メッセージ定義
+ *
+ * payloadがフィールド定義より長い場合、残りは読み捨てる。
+ * payloadがフィールド定義より短い場合、足りないフィールドは通知しない。
+ *
+ * checksumはpayloadを全部受信するまで判定できないため、フィールドのコールバックは
+ * 照合前に呼ばれる(PAYLOADだけは照合してから呼ぶ)。
+ * 不一致だった場合、それまでに反映した内容はpBadで取り消すこと。
+ */
+struct bc_codec_msg_t {
+    const struct bc_codec_field_t   *pFields;   ///< フィールド定義
+    uint8_t                         num;        ///< pFields数
+    bc_codec_fin_t                  pFin;       ///< 解析完了コールバック(NULL:通知しない)
+    bc_codec_fin_t                  pBad;       ///< checksum不一致コールバック(NULL:通知しない)
+};
+
+
+/** @struct bc_codec_t
+ *
+ * デコーダ状態
+ */
+struct bc_codec_t {
+    const struct bc_codec_msg_t *pMsg;          ///< 解析中のメッセージ定義
+    void            *pArg;                      ///< コールバック引数
+    uint32_t        rest;                       ///< payload残り
+    uint8_t         field;                      ///< 解析中のフィールド番号
+    uint8_t         stage;                      ///< フィールド内の解析状態
+    uint8_t         abort;                      ///< 1:解析中止
+    uint8_t         bytes;                      ///< buf[]にためたデータ長
+    uint64_t        count;                      ///< 要素数 or データ長
+    uint32_t        idx;                        ///< 要素番号 or offset
+    uint8_t         *pPayload;                  ///< PAYLOAD用の一時領域
+    uint8_t         checksum[4];                ///< プロトコルヘッダのchecksum
+    uint8_t         bad;                        ///< 1:checksum不一致
+    struct bc_misc_hash256_t    hash;           ///< 受信済みpayloadのHASH256
+    uint8_t         hash256[BC_SZ_HASH256];     ///< payloadのHASH256(完了コールバックから参照できる)
+    uint8_t         buf[BC_CODEC_SZ_BUF];       ///< 受信データ境界をまたいだフィールドの再構築領域
+};
+
+
+/**************************************************************************
+ * prototypes
+ **************************************************************************/
+
+/** 解析開始
+ *
+ * @param[out]  pCodec      デコーダ状態
+ * @param[in]   pMsg        メッセージ定義
+ * @param[in]   Length      payload長
+ * @param[in]   pChecksum   プロトコルヘッダのchecksum(4byte)
+ * @param[in]   pArg        コールバック引数
+ */
+void ICACHE_FLASH_ATTR bc_codec_start(struct bc_codec_t *pCodec, const struct bc_codec_msg_t *pMsg, uint32_t Length, const uint8_t *pChecksum, void *pArg);
+
+
+/** 受信データ解析
+ *
+ * 受信データのうち、payloadの範囲を解析できるところまで解析する。
+ *
+ * @param[in,out]   pCodec      デコーダ状態
+ * @param[in]       pData       受信データ
+ * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
+ * @retval          BC_CODEC_FIN    payload解析完了(checksum不一致はpCodec->badで判定する)
+ * @retval          BC_CODEC_CONT   payload解析継続
+ */
+int ICACHE_FLASH_ATTR bc_codec_decode(struct bc_codec_t *pCodec, const uint8_t *pData, int *pLen);
+
+#endif /* BC_CODEC_H__ */
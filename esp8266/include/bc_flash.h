@@ -14,11 +14,9 @@
  *  500 | bc_flash_blk_t                          |
  *  501 | bc_flash_blk_t                          |
  *      +-----------------------------------------+
- *  502 | 退避セクタ                              |
- *  503 | 退避セクタ番号                          |
- *      +-----------------------------------------+
- *      | 空き                                    |
- *      |                                         |
+ *  502 | bc_flash_hdr_t[640](リングバッファ)     |
+ *      =                                         =
+ *  506 |                                         |
  *      +-----------------------------------------+
  *  507 | bc_wallet_t                             |
  *      +-----------------------------------------+
@@ -36,7 +34,12 @@
 
 #define BC_FLASH_START          (0x200)             ///< ユーザ用FLASH開始セクタ番号
 #define BC_FLASH_END            (0x3fb)             ///< ユーザ用FLASH終了セクタ番号
-#define BC_FLASH_WALLET_SZ32    (14)                ///< 4byte alignでメモリ確保する時のサイズ
+#define BC_FLASH_WALLET_SZ32    (15)                ///< 4byte alignでメモリ確保する時のサイズ
+#define BC_FLASH_WALLET_RXLEN   (BC_SZ_HASH160 + BC_SZ_PUBKEY + 3)  ///< mbedから受信するbc_flash_wlt_tのサイズ(birthdayを含まない)
+#define BC_FLASH_BIRTHDAY_MARGIN    (24 * 60 * 60)  ///< ウォレット作成時刻より前のblockも対象にする時間(sec)
+#define BC_FLASH_LOCATOR_NUM    (16)                ///< 保存するblock locatorの件数(最後に取得したBlock Hashを含む)
+#define BC_FLASH_HDR_HASHLEN    (16)                ///< bc_flash_hdr_tに残すBlock Hashの長さ
+#define BC_FLASH_HDR_BATCH      (16)                ///< bc_flash_hdr_tをまとめて書き込む件数
 
 #define BC_FLASH_WRT_IGNORE     (1)                 ///< FLASH書込み未実施
 #define BC_FLASH_WRT_DONE       (0)                 ///< FLASH書込み正常
@@ -75,14 +78,49 @@ struct bc_flash_tx_t {
 };
 
 
+/** @struct bc_flash_loc_t
+ * 
+ * block locatorの履歴
+ */
+struct bc_flash_loc_t {
+    uint32_t    seq;                            ///< 保存したときのbc_flash_blk_t.seq
+    uint8_t     bhash[BC_SZ_HASH256];           ///< block hash
+};
+
+
 /** @struct bc_flash_blk_t
+ * 
+ * 最後に受信したblock hashと、それより前に保存したblock hashの履歴(block locator)。
+ * 履歴は新しいものほど密に、古いものほど保存回数の間隔が倍々に空くように間引く。
  * 
  * @attention
  *      - 実装簡略のため、構造体サイズを4byte alignに調整すること
+ *      - bhashとupdate_timeは履歴追加前と同じ位置(履歴追加前の形式はnumが0xffffffff)
  */
 struct bc_flash_blk_t {
     uint8_t     bhash[BC_SZ_HASH256];           ///< 最後に受信したblock hash
     uint32_t    update_time;                    ///< 更新時間(epoch time)
+    uint32_t    seq;                            ///< 保存回数
+    uint32_t    num;                            ///< history[]の件数
+    struct bc_flash_loc_t   history[BC_FLASH_LOCATOR_NUM - 1];  ///< bhashより前に保存したblock hash(新しい順)
+};
+
+
+/** @struct bc_flash_hdr_t
+ * 
+ * 受信したheaderの記録(header index)
+ * 
+ * Block Hashは末尾(上位byte)がPoWで0になるため、先頭BC_FLASH_HDR_HASHLEN byteだけ残す。
+ * 
+ * @attention
+ *      - 実装簡略のため、構造体サイズを32byteに調整すること
+ */
+struct bc_flash_hdr_t {
+    uint32_t    seq;                            ///< 書込み順(0xffffffff:空き)
+    uint32_t    height;                         ///< block高さ
+    uint8_t     bhash[BC_FLASH_HDR_HASHLEN];    ///< Block Hash(先頭BC_FLASH_HDR_HASHLEN byte)
+    uint32_t    bits;                           ///< 難易度
+    uint32_t    timestamp;                      ///< block作成時間(epoch time)
 };
 
 
@@ -95,6 +133,7 @@ struct bc_flash_wlt_t {
     uint8_t     bcaddr[BC_SZ_HASH160];          ///< プラグBitcoinアドレス(HASH160)
     uint8_t     pubkey[BC_SZ_PUBKEY];           ///< 所有者公開鍵
     uint8_t     reserved[3];                    ///< padding(4byteアラインメント用)
+    uint32_t    birthday;                       ///< ウォレット作成時刻(epoch time, 保存時に設定。0xffffffff:不明)
 };
 
 #pragma pack()
@@ -112,6 +151,7 @@ struct bc_flash_wlt_t {
  * @retval      BC_FLASH_WRT_FAIL       エラー
  * @note
  *      - pDataはFLASH APIにあわせてuint32_t型で確保すること
+ *      - birthdayには保存時の現在時刻を設定する(pDataの値は使わない)
  */
 int ICACHE_FLASH_ATTR bc_flash_save_bcaddr(const uint32_t *pData);
 
@@ -123,6 +163,16 @@ int ICACHE_FLASH_ATTR bc_flash_save_bcaddr(const uint32_t *pData);
 void ICACHE_FLASH_ATTR bc_flash_get_bcaddr(struct bc_flash_wlt_t *pAddr);
 
 
+/** ウォレット誕生日取得
+ * 
+ * これより前のblockには、保存しているBitcoinアドレスへのTXが含まれない。
+ * 
+ * @return      ウォレット作成時刻からBC_FLASH_BIRTHDAY_MARGINを引いた時刻(epoch time)
+ *              0:不明(全blockを対象にする)
+ */
+uint32_t ICACHE_FLASH_ATTR bc_flash_get_birthday(void);
+
+
 /** @brief  TX情報消去
  * 
  * Bitcoinアドレスと公開鍵以外消去
@@ -152,12 +202,75 @@ void ICACHE_FLASH_ATTR bc_flash_save_last_bhash(const uint8_t *pHash);
 void ICACHE_FLASH_ATTR bc_flash_get_last_bhash(uint8_t *pHash);
 
 
-/** @brief  有効なBlock Hash消去
+/** @brief  block locator取得
+ * 
+ * 最後に取得したBlock Hashを先頭に、保存している履歴を新しい順に返す。
+ * 
+ * @param[out]  pHashes     [戻り値]Block Hash(BC_SZ_HASH256 * Max, alignment不要)
+ * @param[in]   Max         最大件数
+ * @return      件数(1以上)
+ */
+int ICACHE_FLASH_ATTR bc_flash_get_locator(uint8_t *pHashes, int Max);
+
+
+/** @brief  block locator照合
  * 
- * @retval  0       消去未実施(Block Hashが初期値)
- * @retval  -1      消去実施
+ * #bc_flash_get_locator()で返すBlock Hashのいずれかと一致するか(getheadersで送信したか)を返す。
+ * 
+ * @param[in]   pBhash      Block Hash
+ * @retval      1           block locatorにある
+ * @retval      0           block locatorにない
+ */
+int ICACHE_FLASH_ATTR bc_flash_is_locator(const uint8_t *pBhash);
+
+
+/** @brief  header記録
+ * 
+ * BC_FLASH_HDR_BATCH件たまるまではRAMに置き、まとめてリングバッファの続きに書き込む。
+ * セクタを消去するのは、書込み位置が次のセクタに進んだときだけ。
+ * 
+ * @param[in]   Height      block高さ
+ * @param[in]   pBhash      Block Hash
+ * @param[in]   Bits        難易度
+ * @param[in]   Timestamp   block作成時間
+ */
+void ICACHE_FLASH_ATTR bc_flash_hdr_add(uint32_t Height, const uint8_t *pBhash, uint32_t Bits, uint32_t Timestamp);
+
+
+/** @brief  header記録の書込み
+ * 
+ * #bc_flash_hdr_add()でRAMに置いている分を書き込む。
+ */
+void ICACHE_FLASH_ATTR bc_flash_hdr_flush(void);
+
+
+/** @brief  header記録の検索
+ * 
+ * 同じBlock Hashが複数ある場合は、最後に記録したものを返す。
+ * 
+ * @param[out]  pHdr        [戻り値]header記録
+ * @param[in]   pBhash      Block Hash(NULL:最後に記録したheader)
+ * @retval      1           見つかった
+ * @retval      0           見つからない
+ */
+int ICACHE_FLASH_ATTR bc_flash_hdr_find(struct bc_flash_hdr_t *pHdr, const uint8_t *pBhash);
+
+
+/** @brief  block高さ取得
+ * 
+ * @param[in]   pBhash      Block Hash
+ * @return      block高さ(0:不明)
+ */
+uint32_t ICACHE_FLASH_ATTR bc_flash_get_height(const uint8_t *pBhash);
+
+
+/** @brief  初回起動時のBlock Hash取得
+ * 
+ * 保存したBlock Hashがない場合に同期を開始するcheckpointのBlock Hashを返す。
+ * 
+ * @param[out]  pHash       [戻り値]Block Hash
  */
-int ICACHE_FLASH_ATTR bc_flash_erase_last_bhash(void);
+void ICACHE_FLASH_ATTR bc_flash_get_first_bhash(uint8_t *pHash);
 
 
 #endif /* BC_FLASH_H__ */
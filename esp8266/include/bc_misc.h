@@ -101,9 +101,11 @@ int ICACHE_FLASH_ATTR bc_misc_powon(const struct bc_flash_tx_t *pProtoTx);
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <memory.h>
 #include <unistd.h>
+#include <openssl/sha.h>
 
 
 /**************************************************************************
@@ -125,10 +127,14 @@ int ICACHE_FLASH_ATTR bc_misc_powon(const struct bc_flash_tx_t *pProtoTx);
 #define STRCPY      strcpy
 #define STRCMP      strcmp
 #define STRLEN      strlen
+#ifndef DBG_PRINTF
 #define DBG_PRINTF  printf
+#endif
 
 #define CMD_MBED_SEND(b,l)  //none
 
+#define ESPCONN_MAXNUM      (-7)        ///< espconn_send()の送信バッファあふれ(ESP8266と同じ値)
+
 /**************************************************************************
  * [linux]types
  **************************************************************************/
@@ -147,6 +153,7 @@ struct espconn {
 
 int espconn_send(struct espconn *pConn, uint8_t *psent, uint16_t length);
 void system_soft_wdt_feed(void);
+uint32_t bc_misc_time_get(void);
 
 #endif  //__XTENSA__
 
@@ -158,6 +165,7 @@ void system_soft_wdt_feed(void);
 #define BC_SZ_HASH256       (32)            ///< HASH256サイズ
 #define BC_SZ_HASH160       (20)            ///< HASH160サイズ
 #define BC_SZ_PUBKEY        (33)            ///< 公開鍵サイズ
+#define BC_SZ_BLOCK_HEADER  (80)            ///< block headerサイズ(txn_countを含まない)
 #define BC_TIME_INVALID     ((uint32)-1)    ///< #bc_misc_time_get()の時間が有効では無い
 
 #define BC_MBED_CMD_STARTED         "NaYuTaCo" "\x01" "A"   ///< 起動完了
@@ -171,10 +179,29 @@ void system_soft_wdt_feed(void);
 #define DBG_FUNCNAME()      DBG_PRINTF("[[ %s ]]\n", __func__)
 #define ARRAY_SIZE(a)       (sizeof(a) / sizeof(a[0]))
 #define GET_BE16(p)         ((uint16_t)((p[0] << 8) | p[1]))
-#define GET_BE32(p)         ((uint32_t)((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]))
+#define GET_BE32(p)         (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3])
 #define HALT()              while (1) { system_soft_wdt_feed(); }
 
 
+/**************************************************************************
+ * [common]types
+ **************************************************************************/
+
+/** @struct bc_misc_hash256_t
+ *
+ * HASH256(HASH256(data))の途中経過(#bc_misc_hash256_init())
+ */
+struct bc_misc_hash256_t {
+#ifdef __XTENSA__
+    uint32_t    state[8];                   ///< 中間ハッシュ値
+    uint32_t    total;                      ///< 入力済みデータ長
+    uint8_t     buf[64];                    ///< 1ブロックに満たない入力データ
+#else
+    SHA256_CTX  ctx;
+#endif
+};
+
+
 /**************************************************************************
  * [common]prototypes
  **************************************************************************/
@@ -188,6 +215,80 @@ void system_soft_wdt_feed(void);
 void ICACHE_FLASH_ATTR bc_misc_hash256(uint8_t *pHash, const uint8_t *pData, size_t Size);
 
 
+/** HASH256(HASH256(data))の逐次計算開始
+ * 
+ * データを分割して#bc_misc_hash256_update()で渡し、#bc_misc_hash256_final()で結果を得る。
+ * データ全体を連続した領域に置けない場合に使う。
+ * 
+ * @param[out]      pCtx        計算状態
+ */
+void ICACHE_FLASH_ATTR bc_misc_hash256_init(struct bc_misc_hash256_t *pCtx);
+
+
+/** HASH256(HASH256(data))の逐次計算
+ * 
+ * @param[in,out]   pCtx        計算状態
+ * @param[in]       pData       計算元データ(続き)
+ * @param[in]       Size        データサイズ
+ */
+void ICACHE_FLASH_ATTR bc_misc_hash256_update(struct bc_misc_hash256_t *pCtx, const uint8_t *pData, size_t Size);
+
+
+/** HASH256(HASH256(data))の逐次計算完了
+ * 
+ * @param[in,out]   pCtx        計算状態(再利用する場合は#bc_misc_hash256_init()から行う)
+ * @param[out]      pHash       計算結果(32byte)
+ */
+void ICACHE_FLASH_ATTR bc_misc_hash256_final(struct bc_misc_hash256_t *pCtx, uint8_t *pHash);
+
+
+/** HASH256(HASH256(block header))の取得
+ * 
+ * block hash計算用。ESP8266版は#bc_misc_hash256_header_c()で計算する。
+ * Linux版は#bc_misc_hash256()と同じバックエンドで計算する(tools/bc_bench.cのhashで計測できる)。
+ * 
+ * @param[out]      pHash       計算結果(32byte)
+ * @param[in]       pHeader     block header(80byte)
+ */
+void ICACHE_FLASH_ATTR bc_misc_hash256_header(uint8_t *pHash, const uint8_t *pHeader);
+
+
+/** HASH256(HASH256(block header))の取得(80byte専用のC実装)
+ * 
+ * 80byte固定なので、paddingと2回目の入力を組み立て済みのメッセージとして圧縮関数に渡し、
+ * 汎用の#bc_misc_hash256()より処理を省いている(ESP8266での速度は実機で計測していない)。
+ * Linux版でもビルドし、tools/bc_bench.cのhashで#bc_misc_hash256()と結果を照合する。
+ * 
+ * @param[out]      pHash       計算結果(32byte)
+ * @param[in]       pHeader     block header(80byte)
+ */
+void ICACHE_FLASH_ATTR bc_misc_hash256_header_c(uint8_t *pHash, const uint8_t *pHeader);
+
+
+/** HASH256(HASH256(data))の一括取得
+ * 
+ * 同じ長さのデータをまとめて計算する(headersのblock hashなど)。
+ * Linux版はCPUが対応していれば、複数件を並列計算する。
+ * 
+ * @param[out]      pHash       計算結果(32byte * Num)
+ * @param[in]       pData       計算元データ(先頭からStride間隔でNum件)
+ * @param[in]       Size        1件のデータサイズ
+ * @param[in]       Stride      データの間隔(Size以上。headersならsizeof(struct headers_t))
+ * @param[in]       Num         件数
+ */
+void ICACHE_FLASH_ATTR bc_misc_hash256_batch(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num);
+
+
+/** 経過時間取得
+ * 
+ * @return      起動してからの時間(usec)
+ * 
+ * @note
+ *      - 約71分で一周するので、差分を取って使うこと
+ */
+uint32_t ICACHE_FLASH_ATTR bc_misc_tick(void);
+
+
 /** データ設定(1byte～8byteの整数)
  * 
  * @param[in,out]   pp      設定先バッファ
@@ -220,16 +321,36 @@ static inline void bc_misc_add(uint8_t **pp, uint64_t val, size_t sz)
 //}
 
 
-/** varint長取得
+/** varintのデータ長取得
+ * 
+ * @param[in]   prefix      varintの先頭byte
+ * @return      varint全体のデータ長(1, 3, 5, 9)
+ */
+static inline int bc_misc_varint_len(uint8_t prefix)
+{
+    //0xfd:2byte, 0xfe:4byte, 0xff:8byte
+    return (prefix < 0xfd) ? 1 : 1 + (2 << (prefix - 0xfd));
+}
+
+
+/** varint取得
  * 
- * @param[in]   p           受信データ
- * @param[out]  pLen        verint長
+ * @param[in]   p           受信データ(#bc_misc_varint_len()分そろっていること)
+ * @param[out]  pVal        値
  * @return      解析データ長
+ */
+int ICACHE_FLASH_ATTR bc_misc_get_varint(const uint8_t *p, uint64_t *pVal);
+
+
+/** データ設定(varint)
+ * 
+ * @param[in,out]   pp      設定先バッファ
+ * @param[in]       val     設定値
  * 
  * @note
- *      - 16bitデータまでしか対応しない
+ *      - ポインタを進める
  */
-int ICACHE_FLASH_ATTR bc_misc_get_varint(const uint8_t *p, int *pLen);
+void ICACHE_FLASH_ATTR bc_misc_add_varint(uint8_t **pp, uint64_t val);
 
 
 #endif /* BC_MISC_H__ */
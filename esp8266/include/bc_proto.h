@@ -6,6 +6,7 @@
 #define BC_PROTO_H__
 
 #include "bc_misc.h"
+#include "bc_codec.h"
 
 
 /**************************************************************************
@@ -15,21 +16,264 @@
 #define BC_PROTO_FIN    (0)         ///< パケット解析完了
 #define BC_PROTO_CONT   (-1)        ///< パケット解析継続
 
+#define BC_PROTO_SZ_SEND_BUF    (3096)          ///< 送信バッファサイズ
+#define BC_PROTO_PEER_MAX       (4)             ///< 並列同期できる最大接続数
+#ifndef BC_PROTO_SYNC_ROUNDS
+#define BC_PROTO_SYNC_ROUNDS    (2)             ///< 同時に要求するround数(1:roundごとに応答を待つ。tools/bc_bench.cの比較はビルド時に指定する)
+#endif
+#define BC_PROTO_HDRCHK_TIMES   (11)            ///< headersの検査で残す直近のtimestamp数(median time past)
+#define BC_PROTO_HDRSTOP_NUM    (3)             ///< pHashQ[]に入らなかったheadersから残す区切りの数(getheadersのhash_stop)
+
+#define BC_CMD_LEN              (12)
+#define BC_CHKSUM_LEN           (4)
+
 
 /**************************************************************************
  * types
  **************************************************************************/
 
+#pragma pack(1)
+/** @struct bc_proto_t
+ *
+ *
+ */
+struct bc_proto_t {
+    uint32_t    magic;
+    char        command[BC_CMD_LEN];
+    uint32_t    length;
+    uint8_t     checksum[BC_CHKSUM_LEN];
+    uint8_t     payload[0];
+};
+#pragma pack()
+
+
+struct bc_proto_peer_t;
+
+/** @struct bc_proto_sync_round_t
+ *
+ * 要求中のround
+ */
+struct bc_proto_sync_round_t {
+    uint8_t                 bhash[BC_SZ_HASH256] __attribute__ ((aligned (4)));    ///< roundの最後のBlock Hash
+    uint16_t                rest[BC_PROTO_PEER_MAX];        ///< 接続(pPeers[]の位置)ごとの未受信merkleblock数
+};
+
+
+/** @struct bc_proto_hdrq_t
+ *
+ * pHashQ[]と同じ位置のheaderの記録内容
+ * headersのchecksumを照合してから(#fin_headers())、FLASHに記録する。
+ */
+struct bc_proto_hdrq_t {
+    uint32_t                bits;                           ///< 難易度
+    uint32_t                timestamp;                      ///< block作成時間
+};
+
+
+/** @struct bc_proto_hdrchk_t
+ *
+ * headersの検査状態(#read_headers())
+ *
+ * 直近のheaderの情報だけをリングバッファに残し、次のheaderを検査する。
+ * getheadersのblock locatorがprevBhashと異なる場合(開始時, やり直し)は、timestampを取り直す。
+ */
+struct bc_proto_hdrchk_t {
+    uint32_t                time[BC_PROTO_HDRCHK_TIMES];    ///< 直近のheaderのtimestamp(リングバッファ)
+    uint8_t                 timeTop;                        ///< time[]の次の書込み位置
+    uint8_t                 timeNum;                        ///< time[]の件数
+    uint32_t                refBits;                        ///< 直近の最低難易度以外のbits(0:未取得)
+    uint8_t                 prevBhash[BC_SZ_HASH256];       ///< 次のheaderのprev_blockになるBlock Hash
+};
+
+
+/** @struct bc_proto_sync_t
+ *
+ * 並列同期の管理データ
+ *
+ * 初回同期中、headersは1接続(headers担当 : 最初にverackを返した接続)からだけ取得し、
+ * batchのBlock HashをpHashQ[]にためる。
+ * pHashQ[]からroundごとに参加している全接続へmerkleblockを分けてgetdataする。
+ * roundはBC_PROTO_SYNC_ROUNDS個まで応答を待たずに要求し、pHashQ[]を全部要求し、getdataを送信し終わったら
+ * merkleblockの受信を待たずに次のgetheadersを送信する。
+ * 保存するBlock Hash(bhash)は、先頭から全merkleblockがそろったroundまでしか進めない。
+ * ウォレット作成前(birthday)のheaderはgetdataせずに進め、bhashもそこまで進める。
+ * 受信したheaderは高さを数え、checksumを照合してからFLASHに記録する(ウォレット作成前は、進めた最後の1件だけ)。
+ * 初回同期後は、sendheaders(BIP130)で通知された新しいblockのheadersを同じようにgetdataする。
+ */
+struct bc_proto_sync_t {
+    struct bc_proto_peer_t  *pPeers[BC_PROTO_PEER_MAX];     ///< 参加している接続
+    struct bc_proto_peer_t  *pHeaderPeer;                   ///< headers担当
+    uint8_t                 *pHashQ;                        ///< headersで受信したBlock Hashのキュー(MALLOC)
+    struct bc_proto_hdrq_t  *pHdrQ;                         ///< pHashQ[]と同じ位置のheaderの記録内容(pHashQと一緒に確保する)
+    uint16_t                hashQCap;                       ///< pHashQ[]の確保件数
+    uint16_t                hashQNum;                       ///< pHashQ[]の件数(headers受信完了時に確定)
+    uint16_t                hashQPos;                       ///< 次にgetdataするpHashQ[]の位置
+    uint16_t                hashQFill;                      ///< headers受信中にpHashQ[]にためた件数
+    uint16_t                skipNum;                        ///< headers受信中にgetdataせずに進めた件数
+    uint32_t                birthday;                       ///< これより前のblockはgetdataしない(epoch time, 0:全部getdataする)
+    uint8_t                 skipBhash[BC_SZ_HASH256];       ///< getdataせずに進めた最後のBlock Hash
+    uint32_t                skipBits;                       ///< skipBhashのheaderのbits
+    uint32_t                skipTime;                       ///< skipBhashのheaderのtimestamp
+    uint32_t                height;                         ///< hdrchk.prevBhashのblock高さ(0:不明)
+    uint32_t                batchNum;                       ///< 受信中のheadersの件数
+    uint32_t                batchHeight;                    ///< 受信中のheadersの先頭のblock高さ(0:不明)
+    uint8_t                 batchFork;                      ///< 1:受信中のheadersはblock locatorの途中から続いている(分岐点から記録し直す)
+    uint8_t                 hdrState;                       ///< 受信中のheadersの扱い(#fin_headers()で処理する)
+    uint32_t                hdrTop;                         ///< FLASHに記録したheaderの最大高さ(これ以下は記録しない)
+    struct bc_proto_sync_round_t    rounds[BC_PROTO_SYNC_ROUNDS];   ///< 要求中のround(リングバッファ)
+    uint8_t                 roundTop;                       ///< rounds[]の先頭(最も古いround)
+    uint8_t                 roundNum;                       ///< 要求中のround数
+    uint8_t                 headersWait;                    ///< 応答待ちのgetheaders数
+    uint8_t                 fin;                            ///< 1:headersが0件だった, あるいは通知されたheadersを全部要求した(要求中のroundがそろったら完了)
+    uint8_t                 announced;                      ///< 1:pHashQ[]はsendheadersで通知されたheaders(続きのgetheadersはしない)
+    uint8_t                 retry;                          ///< 1:roundが欠けたので、そろっているところからやり直す
+    uint8_t                 headersLater;                   ///< 1:送信バッファの空き待ちで、getheadersを送信していない
+    uint8_t                 fromFirst;                      ///< 1:block locatorが通じず、初回起動時のBlock Hashからgetheadersした
+    uint8_t                 laterBhash[BC_SZ_HASH256];      ///< 送信していないgetheadersのBlock Hash
+    uint8_t                 laterStop;                      ///< 1:送信していないgetheadersはstopBhash[stopPos - 1]まで要求する
+    uint8_t                 stopNum;                        ///< stopBhash[]の件数
+    uint8_t                 stopPos;                        ///< 次のgetheadersで使うstopBhash[]の位置
+    uint8_t                 stopBhash[BC_PROTO_HDRSTOP_NUM][BC_SZ_HASH256]; ///< pHashQ[]に入らなかったheadersのhashQCap件ごとのBlock Hash
+    struct bc_proto_hdrchk_t    hdrchk;                     ///< headersの検査状態
+    uint8_t                 bhash[BC_SZ_HASH256] __attribute__ ((aligned (4)));    /**< merkleblockが全部そろったroundの最後のBlock Hash
+                                                                                     *      未更新の場合は、最後の要素を0xffにしておく。
+                                                                                     */
+};
+
+
+/** @struct bc_proto_txparse_t
+ *
+ * txの逐次解析状態(read_tx())
+ *
+ * txはためずに受信した分だけ解析し、FLASH保存に必要なデータだけ残す。
+ * scriptは解析に必要な範囲だけbuf[]にためる。
+ */
+struct bc_proto_txparse_t {
+    uint8_t             stage;                  ///< 解析中のフィールド
+    uint8_t             bytes;                  ///< buf[]にためたデータ長
+    uint8_t             capLen;                 ///< buf[]にためるscriptの長さ
+    uint8_t             flgPubkey;              ///< 1:inputの公開鍵が一致
+    uint8_t             flgBcaddr;              ///< 1:output1のBitcoinアドレスが一致
+    uint8_t             flgOpret;               ///< 1:output2がOP_RETURN
+    uint16_t            scrLen;                 ///< script長
+    uint16_t            scrPos;                 ///< scriptの解析位置
+    uint16_t            capPos;                 ///< buf[]にためるscriptの位置
+    uint32_t            inCount;                ///< input数
+    uint32_t            count;                  ///< 解析中のinput数 or output数
+    uint32_t            idx;                    ///< 解析中のinput番号 or output番号
+    uint8_t             buf[BC_SZ_HASH256 + 4]; ///< 固定長フィールド, varint, scriptの一部(最大はprevious_output)
+    uint8_t             prevOutput[BC_SZ_HASH256];  ///< 最後のinputのprevious_output(hash)
+    uint8_t             opReturn[1 + 11];       ///< output2のOP_RETURN以降(length+data)
+};
+
+
+/** @struct bc_proto_peer_t
+ *
+ * 接続ごとの管理データ
+ * 内容はbc_proto.cが管理するので、呼び出し元は領域を確保して#bc_start()に渡すだけにすること。
+ */
+struct bc_proto_peer_t {
+    struct espconn      *pConn;                 ///< 接続
+    struct bc_proto_sync_t  *pSync;             ///< 並列同期の管理データ(単独接続の場合はsingle)
+    struct bc_proto_sync_t  single;             ///< 単独接続用の並列同期管理データ
+
+    //受信
+    struct bc_proto_t   proto __attribute__ ((aligned (4)));    ///< 現在処理中のプロトコルヘッダ
+    uint8_t             stage;                  ///< 受信解析状態
+    uint8_t             protoLen;               ///< protoに詰めたデータ長(Stage0の受信不足かStage1のMAGIC不正)
+    uint8_t             resync;                 ///< 1:MAGIC不正のため、MAGICを探している
+    uint32_t            resyncSkip;             ///< MAGICを探すために読み捨てたデータ長
+    uint32_t            resyncCnt;              ///< MAGIC不正の回数
+    uint8_t             currentProto;           ///< 現在処理中の受信メッセージ(解析定義の位置)
+    struct bc_codec_t   codec;                  ///< 受信payloadのデコーダ
+    struct bc_proto_txparse_t   tx;             ///< txの逐次解析状態
+    int32_t             version;                ///< 接続先のプロトコルバージョン(versionで受信)
+
+    //送信
+    uint8_t             bufferCnt;              ///< 送信要求数
+    uint8_t             *pBufferWPnt;           ///< 送信データ書込みポイント
+    uint8_t             *pBufferRPnt;           ///< 送信データ読込みポイント
+    uint8_t             *pBufferEnd;            ///< 先頭に折り返す前の送信データ末尾(NULL:折り返していない)
+    uint8_t             *pPayload;              /**< getdataメッセージのペイロード(pBufferWPnt内)
+                                                 *      read_inv(), read_headers()用
+                                                 */
+    uint8_t             buffer[BC_PROTO_SZ_SEND_BUF];   /**< 送信バッファ
+                                                 *      espconn_send()は送信バッファにためていき、
+                                                 *      送信は非同期で行われる。
+                                                 *      しかし、送信完了コールバックが来るまでは
+                                                 *      espconn_send()を呼び出してもうまく動かない(エラーにはならない)。
+                                                 *      そのため、送信完了コールバックが来るまでの送信を
+                                                 *      このバッファにためる。
+                                                 *      メッセージは分割しないリングバッファとして使い、
+                                                 *      空きがなければ送信側で後回しにする(send_reserve())。
+                                                 */
+
+    //同期状態
+    int8_t              status;                 /**< TODO:用途を決め切れてないフラグ */
+                                                //0: 送信完了時にgetheadersを投げ、1にする
+                                                //1: getheaders中。全部投げてmempool投げると同時に2にする
+                                                //2: 初回同期済み。新しいblockはsendheadersで通知されたheadersから取得する
+    uint16_t            merkleCnt;              ///< getheaders-->headers-->getdata後のmerkleblock数(カウントダウン)
+    uint16_t            wnd;                    ///< 1roundで要求するmerkleblock数(受信速度と送信バッファで増減する)
+    uint16_t            ssthresh;               ///< wndを倍々で増やす上限
+    uint16_t            wndRecv;                ///< 前回の評価から受信したmerkleblock数
+    uint8_t             wndCut;                 ///< 1:送信バッファあふれでwndを縮小済み(次の評価までは縮小しない)
+    uint32_t            wndTick;                ///< 前回の評価時間(#bc_misc_tick())
+    uint32_t            rate;                   ///< merkleblock受信速度の平均(block/s)
+    uint32_t            merkleTotal;            ///< 受信したmerkleblock数
+    uint32_t            checksumErr;            ///< checksum不一致で読み捨てたメッセージ数
+    uint32_t            headersBad;             ///< 検査に失敗して読み捨てたheadersのbatch数
+    uint32_t            sendLaterCnt;           ///< 送信バッファに空きがなく、送信を後回しにした回数
+    uint32_t            sendCalls;              ///< espconn_send()の回数
+    uint32_t            sendFrames;             ///< espconn_send()で送信したメッセージ数(まとめて送信した分を含む)
+    uint16_t            getdataRest;            ///< 未送信のgetdata件数(#bc_sent()で続きを送信する)
+    const uint8_t       *pGetdataHash;          ///< 未送信のgetdataのBlock Hash(pSync->pHashQ内)
+    uint8_t             lastHeadersBhash[BC_SZ_HASH256] __attribute__ ((aligned (4)));  ///< headersで最後に読んだBlock Hash
+    uint8_t             lastInvBhash[BC_SZ_HASH256] __attribute__ ((aligned (4)));      /**< invで最後に読んだBlock Hash
+                                                                                         *      初回同期後、MSG_BLOCKがあればgetheadersする。
+                                                                                         *      MSG_BLOCKで更新したか判定するため、
+                                                                                         *      最後の要素を0xffにしておく。
+                                                                                         */
+    int8_t              hasVerack;              ///< 1:verack未送信(送信バッファの空き待ち)
+    int8_t              hasFilterload;          ///< 1:filterload未送信(送信バッファの空き待ち, 送信するまでgetdataしない)
+    int8_t              hasPing;                ///< 1:ping受信あり(pong未送信)
+    int8_t              hasMempool;             ///< 1:mempool未送信(送信バッファの空き待ち)
+    int8_t              hasSendheaders;         ///< 1:sendheaders未送信(送信バッファの空き待ち)
+    uint64_t            pingNonce;              ///< 最後に受信したpingのnonce
+    uint64_t            pingRecv;               ///< 受信中のpingのnonce(checksumを照合してからpingNonceにする)
+};
+
+
 /** @struct bc_proto_tx
  * 
  * 受信したtxのうち、FLASH保存に必要なデータを集約する
- * ポインタは、受信バッファ内を指しているので、壊さないこと
+ * ポインタは、管理データ内を指しているので、壊さないこと
  */
 struct bc_proto_tx {
-    const uint8_t       *pTx;                   ///< TX全体
+    const uint8_t       *pTxHash;               ///< TX全体のHASH256(txid。受信しながら#bc_misc_hash256_update()で計算したpayloadのHASH256)
     const uint8_t       *pPrevOutput;           ///< prev_output
     const uint8_t       *pOpReturn;             ///< [TxOut]output2のpk_script(length+script)
-    uint16_t            Len;                    ///< pTx長
+};
+
+
+/** @struct bc_proto_stats_t
+ *
+ * 統計情報(#bc_proto_get_stats())
+ */
+struct bc_proto_stats_t {
+    uint16_t            window;                 ///< 1roundで要求するmerkleblock数
+    uint16_t            ssthresh;               ///< windowを倍々で増やす上限
+    uint32_t            blocksPerSec;           ///< merkleblock受信速度の平均(block/s)
+    uint32_t            blocks;                 ///< 受信したmerkleblock数
+    uint32_t            checksumErrors;         ///< checksum不一致で読み捨てたメッセージ数
+    uint32_t            resyncs;                ///< MAGIC不正で読み捨てた回数
+    uint32_t            headersRejected;        ///< 検査(PoW, prev_block, 難易度, timestamp)に失敗して読み捨てたheadersのbatch数
+    uint32_t            height;                 ///< headersで受信したblock高さ(0:不明)
+    uint32_t            sendDeferred;           ///< 送信バッファに空きがなく、送信を後回しにした回数
+    uint32_t            sendCalls;              ///< espconn_send()の回数
+    uint32_t            sendFrames;             /**< 送信したメッセージ数
+                                                 *      sendFrames / sendCallsが1回の送信でまとめたメッセージ数の平均
+                                                 */
 };
 
 
@@ -39,33 +283,66 @@ struct bc_proto_tx {
 
 /** 開始
  * 
- * @param[in]   pConn       管理データ
- * @return      開始結果
+ * 管理データを初期化して、versionを送信する。
+ * 以降、同じ接続に対しては同じ管理データを渡すこと。
+ * 
+ * pSyncを指定すると、同じpSyncで開始した接続同士で初回同期を分担する。
+ * pSyncは最初の#bc_start()前にゼロクリアしておくこと。
+ * 
+ * @param[out]      pPeer       管理データ
+ * @param[in]       pConn       接続
+ * @param[in,out]   pSync       並列同期の管理データ(NULL:単独で同期する)
+ * @retval          0           成功
+ * @retval          -1          pSyncに参加できない(BC_PROTO_PEER_MAX超過)
+ * @retval          それ以外    送信結果
  */
-int ICACHE_FLASH_ATTR bc_start(struct espconn *pConn);
+int ICACHE_FLASH_ATTR bc_start(struct bc_proto_peer_t *pPeer, struct espconn *pConn, struct bc_proto_sync_t *pSync);
 
 
 /** 受信データ処理
  * 
- * @param[in]       pConn       管理データ
+ * @param[in,out]   pPeer       管理データ
  * @param[in]       pBuffer     受信データ
  * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
  */
-void ICACHE_FLASH_ATTR bc_read_message(struct espconn *pConn, const uint8_t *pBuffer, int *pLen);
+void ICACHE_FLASH_ATTR bc_read_message(struct bc_proto_peer_t *pPeer, const uint8_t *pBuffer, int *pLen);
 
 
 /** 送信完了処理
  * 
- * @param[in]   pConn       管理データ
- * @param[in]   sent_length 送信済みサイズ
+ * @param[in,out]   pPeer       管理データ
+ * @param[in]       sent_length 送信済みサイズ
  */
-void ICACHE_FLASH_ATTR bc_sent(struct espconn *pConn, uint16_t sent_length);
+void ICACHE_FLASH_ATTR bc_sent(struct bc_proto_peer_t *pPeer, uint16_t sent_length);
 
 
 /** 終了処理
  * 再起動前に呼ばれることを想定
  * 
+ * @param[in,out]   pPeer       管理データ
+ */
+void ICACHE_FLASH_ATTR bc_finish(struct bc_proto_peer_t *pPeer);
+
+
+/** 受信メッセージ登録
+ * 
+ * commandを受信したときに、pMsgの定義でpayloadを解析する。
+ * 登録済みのcommandを指定した場合は置き換える。
+ * コールバックの引数(pArg)は#bc_proto_peer_tになる。
+ * 
+ * @param[in]       pCmd        command(12文字以下)
+ * @param[in]       pMsg        payload定義(登録後も参照するので、静的な領域に置くこと)
+ * @retval          0           成功
+ * @retval          -1          登録数超過
+ */
+int ICACHE_FLASH_ATTR bc_proto_register(const char *pCmd, const struct bc_codec_msg_t *pMsg);
+
+
+/** 統計情報取得
+ * 
+ * @param[in]       pPeer       管理データ
+ * @param[out]      pStats      統計情報
  */
-void ICACHE_FLASH_ATTR bc_finish(void);
+void ICACHE_FLASH_ATTR bc_proto_get_stats(const struct bc_proto_peer_t *pPeer, struct bc_proto_stats_t *pStats);
 
 #endif /* BC_PROTO_H__ */
@@ -0,0 +1,54 @@
+/**************************************************************************
+ * @file    bc_sha256.h
+ * @brief   [Linux]HASH256のバックエンド
+ *
+ * 実行しているCPUが対応しているものを初回に計測し、一番速いHASH256の計算方法を使う。
+ *      - shani+avx2 : 単発はSHA拡張命令、一括計算はAVX2
+ *      - shani      : SHA拡張命令(1メッセージずつ)
+ *      - avx2       : AVX2で8メッセージを並列計算(一括計算のみ。単発はopenssl)
+ *      - openssl    : OpenSSLのSHA256_Init()/Update()/Final()
+ * 環境変数BC_SHA256_BACKENDにバックエンド名を設定すると、選択を固定できる(検証用)。
+ *
+ * ESP8266版では使用しない(#bc_misc_hash256()などを使うこと)。
+ **************************************************************************/
+#ifndef BC_SHA256_H__
+#define BC_SHA256_H__
+
+#ifndef __XTENSA__
+
+#include "bc_misc.h"
+
+
+/**************************************************************************
+ * prototypes
+ **************************************************************************/
+
+/** HASH256(HASH256(data))の取得
+ *
+ * @param[out]      pHash       計算結果(32byte)
+ * @param[in]       pData       計算元データ
+ * @param[in]       Size        データサイズ
+ */
+void bc_sha256_hash256(uint8_t *pHash, const uint8_t *pData, size_t Size);
+
+
+/** HASH256(HASH256(data))の一括取得
+ *
+ * @param[out]      pHash       計算結果(32byte * Num)
+ * @param[in]       pData       計算元データ(先頭からStride間隔でNum件)
+ * @param[in]       Size        1件のデータサイズ
+ * @param[in]       Stride      データの間隔(Size以上)
+ * @param[in]       Num         件数
+ */
+void bc_sha256_hash256_batch(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num);
+
+
+/** 選択したバックエンド名
+ *
+ * @return      "shani+avx2", "shani", "avx2", "openssl"のいずれか
+ */
+const char *bc_sha256_backend(void);
+
+#endif  //__XTENSA__
+
+#endif /* BC_SHA256_H__ */
@@ -0,0 +1,846 @@
+/**************************************************************************
+ * @file    bc_bench.c
+ * @brief   [Linux]ホストでの性能計測
+ * @note
+ *          - 時間は#bc_misc_tick()(usec)で計る
+ *          - ビルド(esp8266ディレクトリで実行)
+ *              gcc -O2 -std=gnu99 -fcommon -Iinclude -Iuser '-DDBG_PRINTF(...)=' -DBITS_POW_LIMIT=0x207fffff -o bc_bench \
+ *                  tools/bc_bench.c user/bc_proto.c user/bc_flash.c user/bc_codec.c user/bc_checkpoint.c \
+ *                  user/bloom.c user/cstr.c user/bc_misc.c user/bc_sha256.c -lcrypto -lm
+ *          - 使い方
+ *              ./bc_bench hash [件数]
+ *                  block header(80byte)のHASH256を1秒あたり何件計算できるか(ESP8266版の80byte専用の計算も含む)。
+ *                  バックエンドは環境変数BC_SHA256_BACKENDで固定できる(#bc_sha256_backend())。
+ *              ./bc_bench dispatch [件数]
+ *                  受信メッセージ1件を#bc_read_message()で処理する時間。
+ *                  #bc_proto_register()で登録数を上限まで増やしても変わらないか。
+ *              ./bc_bench sync [接続数] [block数] [RTT(ms)] [回線速度(kB/s)] [retarget]
+ *                  擬似的なpeerから初回同期(headersとmerkleblock)を終えるまでの時間。
+ *                  peerは接続ごとに往復遅延と回線速度を持ち、実時間で待って応答する。
+ *                  headersはregtestの最低難易度で作るため、BITS_POW_LIMITを0x207fffffにしてビルドする。
+ *                  retargetを1にすると、retargetの高さごとにbitsのexponentが変わるheadersを作る(kBitsRetarget[])。
+ *                  -DBC_PROTO_SYNC_ROUNDS=1でビルドすると、roundごとに応答を待つ場合と比べられる。
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+#include "bc_misc.h"
+#include "bc_sha256.h"
+#include "bc_proto.h"
+#include "bc_flash.h"
+
+
+/**************************************************************************
+ * macros
+ **************************************************************************/
+
+#define HASH_NUM            (200000)        ///< hashで計算する件数(デフォルト)
+#define HASH_BATCH          (2000)          ///< 一括計算の件数(Linux版のHASHQ_NUMと同じ)
+#define SZ_HEADERS_ENTRY    (BC_SZ_BLOCK_HEADER + 1)    ///< headersメッセージの1件(block header + txn_count)
+
+#define DISPATCH_NUM        (200000)        ///< dispatchで処理するメッセージ数(デフォルト)
+#define DISPATCH_EXTRA      (16)            ///< dispatchで追加登録を試みるcommand数
+#define SZ_RECV             (1460)          ///< 1回で渡す受信データ長(ESP8266の受信バッファ)
+
+#define SYNC_PEERS          (1)             ///< syncの接続数(デフォルト)
+#define SYNC_BLOCKS         (4000)          ///< syncで作るblock数(デフォルト)
+#define SYNC_RTT            (100)           ///< syncの往復遅延(msec, デフォルト)
+#define SYNC_RATE           (100)           ///< syncの接続ごとの回線速度(kB/s, デフォルト)
+#define SYNC_TIMEOUT        (600)           ///< syncを打ち切る時間(sec)
+#define SYNC_SPACING        (1300)          ///< 作るblockのtimestamp間隔(sec, 最低難易度はPOW_LIMIT_SPACINGより空ける)
+#define SYNC_TIME_START     (1500000000)    ///< 作るblockの最初のtimestamp
+
+#define MAGIC_TESTNET3      ((uint32_t)0x0709110B)  ///< testnet3のmagic
+#define BITS_REGTEST        (0x207fffff)            ///< regtestの最低難易度のbits
+#define RETARGET_INTERVAL   (2016)                  ///< retargetするblock高さの間隔(bc_proto.cと同じ)
+#define INV_FILTERED_BLOCK  (3)                     ///< inv : MSG_FILTERED_BLOCK
+#define SZ_MERKLEBLOCK      (BC_SZ_BLOCK_HEADER + 4 + 1 + 1)    ///< txもhashもないmerkleblockのpayload長
+#define SZ_VERSION          (86)                    ///< 返すversionのpayload長
+#define PROTOCOL_VERSION    (70012)                 ///< 返すversionのprotocol version
+
+
+/**************************************************************************
+ * types
+ **************************************************************************/
+
+/** @struct bench_msg_t
+ *
+ * sync : peerからの受信待ちメッセージ
+ */
+struct bench_msg_t {
+    struct bench_msg_t  *pNext;             ///< 次のメッセージ
+    uint32_t            due;                ///< 受信する時刻(#bc_misc_tick())
+    int                 len;                ///< メッセージ長
+    uint8_t             data[0];            ///< メッセージ
+};
+
+
+/** @struct bench_peer_t
+ *
+ * sync : 擬似的なpeer
+ */
+struct bench_peer_t {
+    struct bc_proto_peer_t  peer;           ///< 管理データ
+    struct espconn          conn;           ///< 接続(socketにmpPeers[]の位置を入れる)
+    struct bench_msg_t      *pHead;         ///< 受信待ちの先頭
+    struct bench_msg_t      *pTail;         ///< 受信待ちの末尾
+    uint32_t                linkFree;       ///< peerの回線が空く時刻(#bc_misc_tick())
+    uint8_t                 sent;           ///< 1:送信完了(#bc_sent())を通知する
+    int                     pos;            ///< getdataで最後に見つけたblockの位置(次の探索開始位置)
+    uint32_t                blocks;         ///< 返したmerkleblock数
+};
+
+
+/**************************************************************************
+ * prototypes
+ **************************************************************************/
+
+static void bench_hash(int Num);
+static void bench_dispatch(int Num);
+static uint32_t dispatch_run(struct bc_proto_peer_t *pPeer, const char *pCmd, const uint8_t *pPayload, uint32_t Len, int Num);
+static int make_message(uint8_t *pBuf, const char *pCmd, const uint8_t *pPayload, uint32_t Len);
+static void feed(struct bc_proto_peer_t *pPeer, const uint8_t *pData, int Len);
+static void bench_sync(int Peers, int Blocks, int Rtt, int Rate, int Retarget);
+static int sync_mine(int Blocks, int Retarget);
+static int sync_pow(const uint8_t *pBhash, uint32_t Bits);
+static int sync_find(const uint8_t *pBhash, int Pos);
+static void sync_reply(struct bench_peer_t *pBp, const struct bc_proto_t *pProto);
+static void sync_queue(struct bench_peer_t *pBp, const char *pCmd, const uint8_t *pPayload, uint32_t Len);
+static void print_rate(const char *pName, uint32_t Num, uint32_t Usec);
+
+
+/**************************************************************************
+ * const variables
+ **************************************************************************/
+
+/** dispatchで追加登録するメッセージ(payloadは読み捨てる) */
+static const struct bc_codec_msg_t kMsgNop = { NULL, 0, NULL, NULL };
+
+/** 変更前のkReplyFunc[]の並び(dispatchで比較するSTRCMPの線形探索用) */
+static const char *kReplyOrder[] = {
+    "ping", "headers", "merkleblock", "inv", "tx", "block", "pong", "version", "verack",
+};
+
+/** sync(retarget) : retargetの高さごとに順に使うbits
+ *
+ * 隣どうしはRETARGET_FACTOR倍以内で、exponentをまたぐ変更を含む。
+ *      - 0x20008000 --> 0x1f7fffff : 同じくらいのtargetで、exponentが1減る
+ *      - 0x1f7fffff --> 0x2001ffff : targetが4倍弱になり、exponentが1増える
+ *      - 0x2001ffff --> 0x20008000 : targetが1/4強になる(exponentは同じ)
+ */
+static const uint32_t kBitsRetarget[] = {
+    0x20008000, 0x1f7fffff, 0x2001ffff,
+};
+
+
+/**************************************************************************
+ * private variables
+ **************************************************************************/
+
+static struct bench_peer_t  *mpPeers;       ///< sync : 擬似的なpeer(NULL:sync以外)
+static int                  mPeerNum;       ///< sync : mpPeers[]数
+static uint8_t              *mpChain;       ///< sync : 作ったblock header(80byte * mChainNum)
+static uint8_t              *mpBhash;       ///< sync : 作ったblockのBlock Hash(32byte * mChainNum)
+static int                  mChainNum;      ///< sync : 作ったblock数
+static uint8_t              mStartBhash[BC_SZ_HASH256];     ///< sync : 作ったblockの前(#bc_flash_get_last_bhash())
+static uint32_t             mRtt;           ///< sync : 往復遅延(usec)
+static uint32_t             mRate;          ///< sync : 回線速度(byte/s)
+static int                  mDone;          ///< sync : 1:mempoolを受信した(初回同期完了)
+
+
+/**************************************************************************
+ * public functions
+ **************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    if ((argc >= 2) && (strcmp(argv[1], "hash") == 0)) {
+        bench_hash((argc >= 3) ? atoi(argv[2]) : HASH_NUM);
+    }
+    else if ((argc >= 2) && (strcmp(argv[1], "dispatch") == 0)) {
+        bench_dispatch((argc >= 3) ? atoi(argv[2]) : DISPATCH_NUM);
+    }
+    else if ((argc >= 2) && (strcmp(argv[1], "sync") == 0)) {
+        bench_sync((argc >= 3) ? atoi(argv[2]) : SYNC_PEERS,
+                    (argc >= 4) ? atoi(argv[3]) : SYNC_BLOCKS,
+                    (argc >= 5) ? atoi(argv[4]) : SYNC_RTT,
+                    (argc >= 6) ? atoi(argv[5]) : SYNC_RATE,
+                    (argc >= 7) ? atoi(argv[6]) : 0);
+    }
+    else {
+        fprintf(stderr, "usage: %s hash [num]\n", argv[0]);
+        fprintf(stderr, "       %s dispatch [num]\n", argv[0]);
+        fprintf(stderr, "       %s sync [peers] [blocks] [rtt_ms] [kB/s] [retarget]\n", argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**************************************************************************
+ * Linux版で外部に用意する関数
+ **************************************************************************/
+
+/** 送信
+ *
+ * syncのときは、送信したメッセージへの応答をpeerの受信待ちに入れ、送信完了を通知する。
+ * Linux版の#bc_proto_t送信は同期なので、常に成功を返す。
+ */
+int espconn_send(struct espconn *pConn, uint8_t *psent, uint16_t length)
+{
+    if (mpPeers == NULL) {
+        return 0;
+    }
+
+    struct bench_peer_t *p_bp = &mpPeers[pConn->socket];
+    while (length >= sizeof(struct bc_proto_t)) {
+        const struct bc_proto_t *p_proto = (const struct bc_proto_t *)psent;
+        int len = (int)(sizeof(struct bc_proto_t) + p_proto->length);
+
+        sync_reply(p_bp, p_proto);
+        psent += len;
+        length -= len;
+    }
+    p_bp->sent = 1;
+    return 0;
+}
+
+
+void system_soft_wdt_feed(void)
+{
+}
+
+
+uint32_t bc_misc_time_get(void)
+{
+    return bc_misc_tick() / 1000000;
+}
+
+
+/**************************************************************************
+ * private functions
+ **************************************************************************/
+
+/** hash : HASH256(block header)の計算速度
+ *
+ * 同じ80byteを次の方法で計算し、1秒あたりの件数を出力する。
+ *      - #bc_misc_hash256()
+ *      - #bc_misc_hash256_init() / update() / final()
+ *      - #bc_misc_hash256_header()
+ *      - #bc_misc_hash256_header_c() (ESP8266版が使う80byte専用のC実装)
+ *      - #bc_misc_hash256_batch() (headersと同じ81byte間隔でHASH_BATCH件ずつ)
+ *      - OpenSSLのSHA256()を2回(比較用。OpenSSL 3ではEVP経由になる)
+ * 一括計算と80byte専用の結果は、#bc_misc_hash256()と一致することを確認する。
+ *
+ * @param[in]       Num         計算する件数
+ */
+static void bench_hash(int Num)
+{
+    uint8_t *p_data = (uint8_t *)MALLOC(SZ_HEADERS_ENTRY * HASH_BATCH);
+    uint8_t *p_hash = (uint8_t *)MALLOC(BC_SZ_HASH256 * HASH_BATCH);
+    uint8_t hash[BC_SZ_HASH256];
+    uint8_t hash1[BC_SZ_HASH256];
+    uint32_t sum = 0;
+    uint32_t start;
+    int lp;
+
+    if ((p_data == NULL) || (p_hash == NULL)) {
+        fprintf(stderr, "malloc fail\n");
+        exit(1);
+    }
+    for (lp = 0; lp < SZ_HEADERS_ENTRY * HASH_BATCH; lp++) {
+        p_data[lp] = (uint8_t)rand();
+    }
+    Num = (Num + HASH_BATCH - 1) / HASH_BATCH * HASH_BATCH;
+
+    fprintf(stderr, "backend: %s\n", bc_sha256_backend());
+
+    start = bc_misc_tick();
+    for (lp = 0; lp < Num; lp++) {
+        bc_misc_hash256(hash, p_data + SZ_HEADERS_ENTRY * (lp % HASH_BATCH), BC_SZ_BLOCK_HEADER);
+        sum += hash[0];
+    }
+    print_rate("bc_misc_hash256", Num, bc_misc_tick() - start);
+
+    start = bc_misc_tick();
+    for (lp = 0; lp < Num; lp++) {
+        struct bc_misc_hash256_t ctx;
+
+        bc_misc_hash256_init(&ctx);
+        bc_misc_hash256_update(&ctx, p_data + SZ_HEADERS_ENTRY * (lp % HASH_BATCH), BC_SZ_BLOCK_HEADER);
+        bc_misc_hash256_final(&ctx, hash);
+        sum += hash[0];
+    }
+    print_rate("bc_misc_hash256_init/update/final", Num, bc_misc_tick() - start);
+
+    start = bc_misc_tick();
+    for (lp = 0; lp < Num; lp++) {
+        bc_misc_hash256_header(hash, p_data + SZ_HEADERS_ENTRY * (lp % HASH_BATCH));
+        sum += hash[0];
+    }
+    print_rate("bc_misc_hash256_header", Num, bc_misc_tick() - start);
+
+    start = bc_misc_tick();
+    for (lp = 0; lp < Num; lp++) {
+        bc_misc_hash256_header_c(hash, p_data + SZ_HEADERS_ENTRY * (lp % HASH_BATCH));
+        sum += hash[0];
+    }
+    print_rate("bc_misc_hash256_header_c", Num, bc_misc_tick() - start);
+
+    start = bc_misc_tick();
+    for (lp = 0; lp < Num; lp += HASH_BATCH) {
+        bc_misc_hash256_batch(p_hash, p_data, BC_SZ_BLOCK_HEADER, SZ_HEADERS_ENTRY, HASH_BATCH);
+        sum += p_hash[0];
+    }
+    print_rate("bc_misc_hash256_batch", Num, bc_misc_tick() - start);
+
+    start = bc_misc_tick();
+    for (lp = 0; lp < Num; lp++) {
+        SHA256(p_data + SZ_HEADERS_ENTRY * (lp % HASH_BATCH), BC_SZ_BLOCK_HEADER, hash1);
+        SHA256(hash1, sizeof(hash1), hash);
+        sum += hash[0];
+    }
+    print_rate("OpenSSL SHA256() x2", Num, bc_misc_tick() - start);
+
+    //一括計算, 80byte専用と単発の結果が一致すること
+    for (lp = 0; lp < HASH_BATCH; lp++) {
+        bc_misc_hash256(hash, p_data + SZ_HEADERS_ENTRY * lp, BC_SZ_BLOCK_HEADER);
+        if (MEMCMP(hash, p_hash + BC_SZ_HASH256 * lp, BC_SZ_HASH256) != 0) {
+            fprintf(stderr, "batch mismatch(%d)\n", lp);
+            exit(1);
+        }
+        bc_misc_hash256_header_c(hash1, p_data + SZ_HEADERS_ENTRY * lp);
+        if (MEMCMP(hash, hash1, BC_SZ_HASH256) != 0) {
+            fprintf(stderr, "header_c mismatch(%d)\n", lp);
+            exit(1);
+        }
+    }
+    fprintf(stderr, "(sum=%u)\n", sum);
+
+    FREE(p_hash);
+    FREE(p_data);
+}
+
+
+/** dispatch : 受信メッセージの振り分け
+ *
+ * 次のメッセージをNum件ずつ#bc_read_message()に渡し、1件あたりの時間を出力する。
+ *      - pong(8byte) : 登録済みで、payloadを解析する
+ *      - 未登録のcommand(payloadなし)
+ * #bc_proto_register()で登録数を上限まで増やしてからもう一度計り、追加したcommandも計る。
+ * 比較用に、変更前と同じSTRCMPの線形探索で同じ数のcommandから探す時間も出力する。
+ *
+ * @param[in]       Num         処理するメッセージ数
+ */
+static void bench_dispatch(int Num)
+{
+    static struct bc_proto_peer_t peer;
+    static struct espconn conn;
+    static char extra[DISPATCH_EXTRA][BC_CMD_LEN + 1];
+    const char *p_names[ARRAY_SIZE(kReplyOrder) + DISPATCH_EXTRA];
+    uint8_t nonce[8] = { 0 };
+    int reg = 0;
+    int names = 0;
+    int lp;
+
+    bc_start(&peer, &conn, NULL);
+
+    fprintf(stderr, "registered %d (kReplyFunc[])\n", (int)ARRAY_SIZE(kReplyOrder));
+    print_rate("pong", Num, dispatch_run(&peer, "pong", nonce, sizeof(nonce), Num));
+    print_rate("unknown", Num, dispatch_run(&peer, "bench", NULL, 0, Num));
+
+    for (lp = 0; lp < DISPATCH_EXTRA; lp++) {
+        sprintf(extra[lp], "bench%02d", lp);
+        if (bc_proto_register(extra[lp], &kMsgNop) != 0) {
+            break;
+        }
+        reg++;
+    }
+    fprintf(stderr, "registered %d (+%d bc_proto_register())\n", (int)ARRAY_SIZE(kReplyOrder) + reg, reg);
+    print_rate("pong", Num, dispatch_run(&peer, "pong", nonce, sizeof(nonce), Num));
+    print_rate("unknown", Num, dispatch_run(&peer, "bench", NULL, 0, Num));
+    if (reg > 0) {
+        print_rate(extra[reg - 1], Num, dispatch_run(&peer, extra[reg - 1], NULL, 0, Num));
+    }
+
+    //変更前の探索 : 全commandを順に探す
+    for (lp = 0; lp < (int)ARRAY_SIZE(kReplyOrder); lp++) {
+        p_names[names++] = kReplyOrder[lp];
+    }
+    for (lp = 0; lp < reg; lp++) {
+        p_names[names++] = extra[lp];
+    }
+    uint32_t found = 0;
+    uint32_t start = bc_misc_tick();
+    for (int cnt = 0; cnt < Num; cnt++) {
+        const char *p_cmd = p_names[cnt % names];
+        for (lp = 0; lp < names; lp++) {
+            if (STRCMP(p_cmd, p_names[lp]) == 0) {
+                break;
+            }
+        }
+        found += lp;
+    }
+    print_rate("STRCMP scan only (before user-011)", Num, bc_misc_tick() - start);
+    fprintf(stderr, "(found=%u)\n", found);
+
+    struct bc_proto_stats_t stats;
+    bc_proto_get_stats(&peer, &stats);
+    if ((stats.checksumErrors != 0) || (stats.resyncs != 0)) {
+        fprintf(stderr, "checksum errors %u, resyncs %u\n", stats.checksumErrors, stats.resyncs);
+        exit(1);
+    }
+    bc_finish(&peer);
+}
+
+
+/** dispatch : 同じメッセージをNum件処理する時間
+ *
+ * @param[in,out]   pPeer       管理データ
+ * @param[in]       pCmd        command
+ * @param[in]       pPayload    payload
+ * @param[in]       Len         payload長
+ * @param[in]       Num         メッセージ数
+ * @return          処理時間(usec)
+ */
+static uint32_t dispatch_run(struct bc_proto_peer_t *pPeer, const char *pCmd, const uint8_t *pPayload, uint32_t Len, int Num)
+{
+    int sz = (int)(sizeof(struct bc_proto_t) + Len);
+    uint8_t *p_buf = (uint8_t *)MALLOC(sz * Num);
+    uint32_t start;
+
+    if (p_buf == NULL) {
+        fprintf(stderr, "malloc fail\n");
+        exit(1);
+    }
+    make_message(p_buf, pCmd, pPayload, Len);
+    for (int lp = 1; lp < Num; lp++) {
+        MEMCPY(p_buf + sz * lp, p_buf, sz);
+    }
+
+    start = bc_misc_tick();
+    feed(pPeer, p_buf, sz * Num);
+    start = bc_misc_tick() - start;
+
+    FREE(p_buf);
+    return start;
+}
+
+
+/** 受信メッセージ作成
+ *
+ * @param[out]      pBuf        メッセージ(24byte + Len)
+ * @param[in]       pCmd        command
+ * @param[in]       pPayload    payload
+ * @param[in]       Len         payload長
+ * @return          メッセージ長
+ */
+static int make_message(uint8_t *pBuf, const char *pCmd, const uint8_t *pPayload, uint32_t Len)
+{
+    struct bc_proto_t *p_proto = (struct bc_proto_t *)pBuf;
+    uint8_t hash[BC_SZ_HASH256];
+
+    MEMSET(p_proto, 0, sizeof(struct bc_proto_t));
+    p_proto->magic = MAGIC_TESTNET3;
+    strncpy(p_proto->command, pCmd, BC_CMD_LEN);
+    p_proto->length = Len;
+    if (Len > 0) {
+        MEMCPY(p_proto->payload, pPayload, Len);
+    }
+    bc_misc_hash256(hash, p_proto->payload, Len);
+    MEMCPY(p_proto->checksum, hash, BC_CHKSUM_LEN);
+
+    return (int)(sizeof(struct bc_proto_t) + Len);
+}
+
+
+/** 受信データをSZ_RECVずつ#bc_read_message()に渡す
+ *
+ * @param[in,out]   pPeer       管理データ
+ * @param[in]       pData       受信データ
+ * @param[in]       Len         受信データ長
+ */
+static void feed(struct bc_proto_peer_t *pPeer, const uint8_t *pData, int Len)
+{
+    while (Len > 0) {
+        int sz = (Len > SZ_RECV) ? SZ_RECV : Len;
+
+        Len -= sz;
+        while (sz > 0) {
+            int prev = sz;
+            bc_read_message(pPeer, pData, &sz);
+            pData += prev - sz;
+        }
+    }
+}
+
+
+/** sync : 初回同期の時間
+ *
+ * Blocks件のblockを作り、Peers個の擬似的なpeerと#bc_start()で同じ#bc_proto_sync_tを共有して同期する。
+ * headers担当がmempoolを送信したら完了とし、かかった時間と受信速度を出力する。
+ *
+ * @param[in]       Peers       接続数(1～BC_PROTO_PEER_MAX)
+ * @param[in]       Blocks      block数
+ * @param[in]       Rtt         往復遅延(msec)
+ * @param[in]       Rate        接続ごとの回線速度(kB/s)
+ * @param[in]       Retarget    1:retargetの高さでbitsを変える(#sync_mine())
+ */
+static void bench_sync(int Peers, int Blocks, int Rtt, int Rate, int Retarget)
+{
+    static struct bc_proto_sync_t sync;
+    uint32_t start;
+    uint32_t now;
+    int retargets;
+    int lp;
+
+    if ((Peers < 1) || (Peers > BC_PROTO_PEER_MAX) || (Blocks < 1) || (Rate < 1)) {
+        fprintf(stderr, "bad parameter\n");
+        exit(1);
+    }
+    mRtt = (uint32_t)Rtt * 1000;
+    mRate = (uint32_t)Rate * 1000;
+    bc_flash_get_last_bhash(mStartBhash);
+    retargets = sync_mine(Blocks, Retarget);
+
+    mPeerNum = Peers;
+    mpPeers = (struct bench_peer_t *)CALLOC(Peers, sizeof(struct bench_peer_t));
+    if (mpPeers == NULL) {
+        fprintf(stderr, "malloc fail\n");
+        exit(1);
+    }
+    fprintf(stderr, "peers %d, blocks %d, rtt %d ms, %d kB/s per peer, rounds %d, retarget %d\n",
+                Peers, Blocks, Rtt, Rate, BC_PROTO_SYNC_ROUNDS, retargets);
+
+    start = bc_misc_tick();
+    for (lp = 0; lp < Peers; lp++) {
+        mpPeers[lp].conn.socket = lp;
+        mpPeers[lp].linkFree = start;
+        if (bc_start(&mpPeers[lp].peer, &mpPeers[lp].conn, &sync) != 0) {
+            fprintf(stderr, "bc_start fail(%d)\n", lp);
+            exit(1);
+        }
+    }
+
+    while (!mDone) {
+        //送信完了
+        int sent = 0;
+        for (lp = 0; lp < Peers; lp++) {
+            if (mpPeers[lp].sent) {
+                mpPeers[lp].sent = 0;
+                bc_sent(&mpPeers[lp].peer, 0);
+                sent = 1;
+            }
+        }
+        if (sent) {
+            continue;
+        }
+
+        //一番早く届くメッセージ
+        struct bench_peer_t *p_bp = NULL;
+        for (lp = 0; lp < Peers; lp++) {
+            struct bench_msg_t *p = mpPeers[lp].pHead;
+            if ((p != NULL) && ((p_bp == NULL) || ((int32_t)(p->due - p_bp->pHead->due) < 0))) {
+                p_bp = &mpPeers[lp];
+            }
+        }
+        now = bc_misc_tick();
+        if (p_bp == NULL) {
+            fprintf(stderr, "stalled\n");
+            exit(1);
+        }
+        if (now - start > SYNC_TIMEOUT * 1000000UL) {
+            fprintf(stderr, "timeout\n");
+            exit(1);
+        }
+        if ((int32_t)(p_bp->pHead->due - now) > 0) {
+            usleep(p_bp->pHead->due - now);
+        }
+
+        struct bench_msg_t *p_msg = p_bp->pHead;
+        p_bp->pHead = p_msg->pNext;
+        if (p_bp->pHead == NULL) {
+            p_bp->pTail = NULL;
+        }
+        feed(&p_bp->peer, p_msg->data, p_msg->len);
+        FREE(p_msg);
+    }
+    now = bc_misc_tick() - start;
+
+    uint32_t blocks = 0;
+    for (lp = 0; lp < Peers; lp++) {
+        struct bc_proto_stats_t stats;
+
+        bc_proto_get_stats(&mpPeers[lp].peer, &stats);
+        fprintf(stderr, "  peer %d : merkleblock %u, window %u, %u block/s\n",
+                    lp, mpPeers[lp].blocks, stats.window, stats.blocksPerSec);
+        blocks += mpPeers[lp].blocks;
+    }
+    fprintf(stderr, "  synced %u blocks in %u ms : %.0f block/s\n", blocks, now / 1000, (double)blocks * 1000000.0 / now);
+    if (blocks != (uint32_t)Blocks) {
+        fprintf(stderr, "merkleblock count mismatch\n");
+        exit(1);
+    }
+}
+
+
+/** sync : blockを作る
+ *
+ * mStartBhashからつながるBlocks件のblock headerを、regtestの最低難易度で作る。
+ * Retargetが1の場合は、最初のretargetの高さまでkBitsRetarget[0]で作り、
+ * retargetの高さごとに次のbitsへ変える(最低難易度は使わない)。
+ *
+ * @param[in]       Blocks      block数
+ * @param[in]       Retarget    1:retargetの高さでbitsを変える
+ * @return          bitsを変えたretargetの回数
+ */
+static int sync_mine(int Blocks, int Retarget)
+{
+    uint8_t prev[BC_SZ_HASH256];
+    uint32_t height = bc_flash_get_height(mStartBhash) + 1;
+    uint32_t bits = (Retarget) ? kBitsRetarget[0] : BITS_REGTEST;
+    int retargets = 0;
+
+    mpChain = (uint8_t *)MALLOC(BC_SZ_BLOCK_HEADER * Blocks);
+    mpBhash = (uint8_t *)MALLOC(BC_SZ_HASH256 * Blocks);
+    if ((mpChain == NULL) || (mpBhash == NULL)) {
+        fprintf(stderr, "malloc fail\n");
+        exit(1);
+    }
+    MEMCPY(prev, mStartBhash, BC_SZ_HASH256);
+    for (int lp = 0; lp < Blocks; lp++) {
+        uint8_t *p = mpChain + BC_SZ_BLOCK_HEADER * lp;
+        uint8_t *p_hash = mpBhash + BC_SZ_HASH256 * lp;
+        uint32_t val;
+
+        //version, prev_block, merkle_root, timestamp, bits, nonce
+        MEMSET(p, 0, BC_SZ_BLOCK_HEADER);
+        p[0] = 1;
+        MEMCPY(p + 4, prev, BC_SZ_HASH256);
+        MEMCPY(p + 36, &lp, sizeof(lp));
+        val = SYNC_TIME_START + SYNC_SPACING * lp;
+        MEMCPY(p + 68, &val, sizeof(val));
+        if (Retarget && ((height + lp) % RETARGET_INTERVAL == 0)) {
+            retargets++;
+            bits = kBitsRetarget[retargets % (sizeof(kBitsRetarget) / sizeof(kBitsRetarget[0]))];
+        }
+        MEMCPY(p + 72, &bits, sizeof(bits));
+        for (val = 0; ; val++) {
+            MEMCPY(p + 76, &val, sizeof(val));
+            bc_misc_hash256_header(p_hash, p);
+            if (sync_pow(p_hash, bits)) {
+                break;
+            }
+        }
+        MEMCPY(prev, p_hash, BC_SZ_HASH256);
+    }
+    mChainNum = Blocks;
+    return retargets;
+}
+
+
+/** sync : Block Hashがbitsのtarget未満か
+ *
+ * @param[in]       pBhash      Block Hash(little endian)
+ * @param[in]       Bits        bits(mantissaは正の値)
+ * @retval          1           target未満
+ * @retval          0           target以上
+ */
+static int sync_pow(const uint8_t *pBhash, uint32_t Bits)
+{
+    uint8_t target[BC_SZ_HASH256];
+    int exp = (int)(Bits >> 24);
+
+    MEMSET(target, 0, sizeof(target));
+    for (int lp = 0; lp < 3; lp++) {
+        int pos = exp - 3 + lp;
+        if ((pos >= 0) && (pos < BC_SZ_HASH256)) {
+            target[pos] = (uint8_t)(Bits >> (8 * lp));
+        }
+    }
+    for (int lp = BC_SZ_HASH256 - 1; lp >= 0; lp--) {
+        if (pBhash[lp] != target[lp]) {
+            return pBhash[lp] < target[lp];
+        }
+    }
+    return 0;
+}
+
+
+/** sync : Block Hashの位置
+ *
+ * @param[in]       pBhash      Block Hash
+ * @param[in]       Pos         探し始める位置
+ * @retval          0以上       mpBhash[]の位置
+ * @retval          -1          mStartBhash
+ * @retval          -2          見つからない
+ */
+static int sync_find(const uint8_t *pBhash, int Pos)
+{
+    if (MEMCMP(pBhash, mStartBhash, BC_SZ_HASH256) == 0) {
+        return -1;
+    }
+    for (int lp = 0; lp < mChainNum; lp++) {
+        int idx = (Pos + lp) % mChainNum;
+        if (MEMCMP(pBhash, mpBhash + BC_SZ_HASH256 * idx, BC_SZ_HASH256) == 0) {
+            return idx;
+        }
+    }
+    return -2;
+}
+
+
+/** sync : 受信したメッセージへの応答
+ *
+ *      - version     : versionとverack
+ *      - getheaders  : locatorの次から最大2000件(hash_stopまで)のheaders
+ *      - getdata     : MSG_FILTERED_BLOCKごとにtxのないmerkleblock
+ *      - mempool     : 初回同期の完了
+ *
+ * @param[in,out]   pBp         peer
+ * @param[in]       pProto      peerが受信したメッセージ
+ */
+static void sync_reply(struct bench_peer_t *pBp, const struct bc_proto_t *pProto)
+{
+    const uint8_t *p = pProto->payload;
+
+    if (STRCMP(pProto->command, "version") == 0) {
+        uint8_t ver[SZ_VERSION];
+        int32_t val = PROTOCOL_VERSION;
+
+        MEMSET(ver, 0, sizeof(ver));
+        MEMCPY(ver, &val, sizeof(val));
+        sync_queue(pBp, "version", ver, sizeof(ver));
+        sync_queue(pBp, "verack", NULL, 0);
+    }
+    else if (STRCMP(pProto->command, "getheaders") == 0) {
+        //version(4) + count(1) + locator(32 * count) + hash_stop(32)
+        int num = p[4];
+        int top = -2;
+        int end = mChainNum;
+
+        for (int lp = 0; (lp < num) && (top == -2); lp++) {
+            top = sync_find(p + 5 + BC_SZ_HASH256 * lp, 0);
+        }
+        if (top == -2) {
+            fprintf(stderr, "unknown locator\n");
+            exit(1);
+        }
+        top++;
+        int stop = sync_find(p + 5 + BC_SZ_HASH256 * num, 0);
+        if ((stop >= 0) && (stop + 1 < end)) {
+            end = stop + 1;
+        }
+        if (end - top > 2000) {
+            end = top + 2000;
+        }
+        if (end < top) {
+            end = top;
+        }
+
+        int cnt = end - top;
+        uint8_t *p_headers = (uint8_t *)MALLOC(3 + SZ_HEADERS_ENTRY * cnt);
+        int len = 0;
+        if (cnt < 0xfd) {
+            p_headers[len++] = (uint8_t)cnt;
+        }
+        else {
+            p_headers[len++] = 0xfd;
+            p_headers[len++] = (uint8_t)cnt;
+            p_headers[len++] = (uint8_t)(cnt >> 8);
+        }
+        for (int lp = top; lp < end; lp++) {
+            MEMCPY(p_headers + len, mpChain + BC_SZ_BLOCK_HEADER * lp, BC_SZ_BLOCK_HEADER);
+            p_headers[len + BC_SZ_BLOCK_HEADER] = 0;        //txn_count
+            len += SZ_HEADERS_ENTRY;
+        }
+        sync_queue(pBp, "headers", p_headers, len);
+        FREE(p_headers);
+    }
+    else if (STRCMP(pProto->command, "getdata") == 0) {
+        //count(1) + (type(4) + hash(32)) * count
+        int num = p[0];
+
+        for (int lp = 0; lp < num; lp++) {
+            const uint8_t *p_inv = p + 1 + (4 + BC_SZ_HASH256) * lp;
+            uint32_t type;
+
+            MEMCPY(&type, p_inv, sizeof(type));
+            if (type != INV_FILTERED_BLOCK) {
+                continue;
+            }
+            int idx = sync_find(p_inv + 4, pBp->pos);
+            if (idx < 0) {
+                fprintf(stderr, "unknown block\n");
+                exit(1);
+            }
+            pBp->pos = idx + 1;
+
+            uint8_t merkle[SZ_MERKLEBLOCK];
+            MEMSET(merkle, 0, sizeof(merkle));
+            MEMCPY(merkle, mpChain + BC_SZ_BLOCK_HEADER * idx, BC_SZ_BLOCK_HEADER);
+            sync_queue(pBp, "merkleblock", merkle, sizeof(merkle));
+            pBp->blocks++;
+        }
+    }
+    else if (STRCMP(pProto->command, "mempool") == 0) {
+        mDone = 1;
+    }
+}
+
+
+/** sync : peerから送るメッセージを受信待ちに入れる
+ *
+ * 要求がpeerに届くまで片道(RTT/2)、peerの回線が空いてから送り終わるまで(長さ/回線速度)、
+ * 届くまで片道(RTT/2)かかるとして受信時刻を決める。
+ *
+ * @param[in,out]   pBp         peer
+ * @param[in]       pCmd        command
+ * @param[in]       pPayload    payload
+ * @param[in]       Len         payload長
+ */
+static void sync_queue(struct bench_peer_t *pBp, const char *pCmd, const uint8_t *pPayload, uint32_t Len)
+{
+    struct bench_msg_t *p_msg = (struct bench_msg_t *)MALLOC(sizeof(struct bench_msg_t) + sizeof(struct bc_proto_t) + Len);
+    uint32_t arrive = bc_misc_tick() + mRtt / 2;
+
+    if (p_msg == NULL) {
+        fprintf(stderr, "malloc fail\n");
+        exit(1);
+    }
+    p_msg->pNext = NULL;
+    p_msg->len = make_message(p_msg->data, pCmd, pPayload, Len);
+    if ((int32_t)(arrive - pBp->linkFree) > 0) {
+        pBp->linkFree = arrive;
+    }
+    pBp->linkFree += (uint32_t)((uint64_t)p_msg->len * 1000000 / mRate);
+    p_msg->due = pBp->linkFree + mRtt / 2;
+
+    if (pBp->pTail != NULL) {
+        pBp->pTail->pNext = p_msg;
+    }
+    else {
+        pBp->pHead = p_msg;
+    }
+    pBp->pTail = p_msg;
+}
+
+
+/** 1秒あたりの件数を出力
+ *
+ * @param[in]       pName       計測した処理
+ * @param[in]       Num         件数
+ * @param[in]       Usec        かかった時間(usec)
+ */
+static void print_rate(const char *pName, uint32_t Num, uint32_t Usec)
+{
+    if (Usec == 0) {
+        Usec = 1;
+    }
+    fprintf(stderr, "  %-36s %8u in %7u us : %10.0f /s\n", pName, Num, Usec, (double)Num * 1000000.0 / Usec);
+}
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""checkpointの表(include/bc_checkpoint_tbl.h)を生成する
+
+bitcoind(testnet3)のJSON-RPCから、指定した高さのBlock Hash, bits, timestampを取得する。
+
+    $ ./gen_checkpoint.py --cookie ~/.bitcoin/testnet3/.cookie --interval 20160
+
+    --heights   : 必ず入れる高さ(カンマ区切り。既定はBlock#1, 546, kBlockHashStart)
+    --interval  : --fromより上で、この間隔の高さも入れる(0:入れない)
+    --from      : --intervalで入れ始める高さ(既定はkBlockHashStart。これより下は同期しない)
+    --depth     : 最新blockからこの深さより浅いblockは入れない(reorg対策)
+
+PoWの検査を省けるのは、1回のheadersでpHashQ[]に入る範囲(ESP8266ではHASHQ_NUM=500件)で
+checkpointまで届くheaderだけになる。--intervalをHASHQ_NUM以下にすると同期中ずっと省けるが、
+表はRAMに置くため1件あたり44byte増える。
+"""
+
+import argparse
+import base64
+import json
+import os
+import sys
+import urllib.request
+
+DEFAULT_HEIGHTS = '1,546,685351'
+DEFAULT_FROM = 685351
+DEFAULT_OUT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'include', 'bc_checkpoint_tbl.h')
+
+
+class Rpc:
+    def __init__(self, url, user, password):
+        self.url = url
+        self.auth = base64.b64encode('{}:{}'.format(user, password).encode()).decode()
+        self.id = 0
+
+    def call(self, method, *params):
+        self.id += 1
+        body = json.dumps({'jsonrpc': '1.0', 'id': self.id, 'method': method, 'params': list(params)}).encode()
+        req = urllib.request.Request(self.url, body, {
+            'Content-Type': 'application/json',
+            'Authorization': 'Basic ' + self.auth})
+        with urllib.request.urlopen(req) as res:
+            ret = json.loads(res.read().decode())
+        if ret.get('error'):
+            raise RuntimeError('{} : {}'.format(method, ret['error']))
+        return ret['result']
+
+
+def c_row(height, bhash, bits, timestamp):
+    #エンディアンを逆順にする
+    b = bytes.fromhex(bhash)[::-1]
+    lines = ['//' + bhash, '{{ {}, {{'.format(height)]
+    for i in range(0, len(b), 8):
+        lines.append('    ' + ''.join('0x{:02x}, '.format(c) for c in b[i:i + 8]))
+    lines.append('}}, 0x{:08x}, {} }},'.format(bits, timestamp))
+    return '\n'.join(lines) + '\n'
+
+
+def main():
+    ap = argparse.ArgumentParser(description='generate bc_checkpoint_tbl.h')
+    ap.add_argument('--rpc', default='http://127.0.0.1:18332', help='bitcoind JSON-RPC URL')
+    ap.add_argument('--user', default='', help='rpcuser')
+    ap.add_argument('--password', default='', help='rpcpassword')
+    ap.add_argument('--cookie', help='.cookie file(--user/--passwordの代わり)')
+    ap.add_argument('--heights', default=DEFAULT_HEIGHTS, help='heights(comma separated)')
+    ap.add_argument('--interval', type=int, default=0, help='add every N blocks')
+    ap.add_argument('--from', dest='start', type=int, default=DEFAULT_FROM, help='add every N blocks from this height')
+    ap.add_argument('--depth', type=int, default=100, help='skip blocks shallower than this')
+    ap.add_argument('--out', default=DEFAULT_OUT, help='output file')
+    args = ap.parse_args()
+
+    user, password = args.user, args.password
+    if args.cookie:
+        with open(os.path.expanduser(args.cookie)) as fp:
+            user, password = fp.read().strip().split(':', 1)
+    rpc = Rpc(args.rpc, user, password)
+
+    top = rpc.call('getblockcount') - args.depth
+    heights = set(int(h) for h in args.heights.split(',') if h)
+    if args.interval > 0:
+        heights.update(range(args.start + args.interval, top + 1, args.interval))
+    heights = sorted(h for h in heights if 0 < h <= top)
+    if not heights:
+        sys.exit('no checkpoint')
+    if heights[-1] <= args.start:
+        print('warning: no checkpoint above {} (PoW is checked for every header)'.format(args.start), file=sys.stderr)
+
+    rows = []
+    for height in heights:
+        bhash = rpc.call('getblockhash', height)
+        hdr = rpc.call('getblockheader', bhash)
+        rows.append(c_row(height, bhash, int(hdr['bits'], 16), hdr['time']))
+        print('{} {}'.format(height, bhash))
+
+    with open(args.out, 'w') as fp:
+        fp.write('/**\n'
+                 ' * @file    bc_checkpoint_tbl.h\n'
+                 ' * @brief   checkpointの表(bc_checkpoint.cでincludeする)\n'
+                 ' *\n'
+                 ' * tools/gen_checkpoint.pyで生成するため、手で編集しないこと。\n'
+                 ' *      - heightの昇順に並べること\n'
+                 ' *      - Block Hashはエンディアンを逆順にしておくこと\n'
+                 ' */\n'
+                 '\n'
+                 '//      height, bhash, bits, timestamp\n')
+        fp.write(''.join(rows))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,124 @@
+/**
+ * @file    bc_checkpoint.c
+ * @brief   checkpoint管理
+ */
+
+#include "bc_checkpoint.h"
+
+
+/**************************************************************************
+ * const variables
+ **************************************************************************/
+
+static const struct bc_checkpoint_t kCheckpoints[] __attribute__ ((aligned (4))) = {
+#include "bc_checkpoint_tbl.h"
+};
+
+
+/**************************************************************************
+ * prototypes
+ **************************************************************************/
+
+static int ICACHE_FLASH_ATTR cp_search(uint32_t Height);
+
+
+/**************************************************************************
+ * public functions
+ **************************************************************************/
+
+uint32_t ICACHE_FLASH_ATTR bc_checkpoint_get_height(const uint8_t *pBhash)
+{
+    struct bc_checkpoint_t cp;
+
+    if (bc_checkpoint_find(pBhash, &cp)) {
+        return cp.height;
+    }
+    return 0;
+}
+
+
+int ICACHE_FLASH_ATTR bc_checkpoint_find(const uint8_t *pBhash, struct bc_checkpoint_t *pCp)
+{
+    for (int lp = 0; lp < (int)ARRAY_SIZE(kCheckpoints); lp++) {
+        if (MEMCMP(pBhash, kCheckpoints[lp].bhash, BC_SZ_HASH256) == 0) {
+            MEMCPY(pCp, &kCheckpoints[lp], sizeof(struct bc_checkpoint_t));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int ICACHE_FLASH_ATTR bc_checkpoint_verify(uint32_t Height, const uint8_t *pBhash)
+{
+    if (Height == 0) {
+        return 1;
+    }
+    int idx = cp_search(Height);
+    if ((idx < 0) || (MEMCMP(pBhash, kCheckpoints[idx].bhash, BC_SZ_HASH256) == 0)) {
+        return 1;
+    }
+
+    DBG_PRINTF("[%s()]checkpoint mismatch(height=%u)\n", __func__, Height);
+    return 0;
+}
+
+
+uint32_t ICACHE_FLASH_ATTR bc_checkpoint_next(uint32_t Height)
+{
+    //heightの昇順に並んでいるので二分探索
+    int lo = 0;
+    int hi = (int)ARRAY_SIZE(kCheckpoints) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (kCheckpoints[mid].height < Height) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return (lo < (int)ARRAY_SIZE(kCheckpoints)) ? kCheckpoints[lo].height : 0;
+}
+
+
+int ICACHE_FLASH_ATTR bc_checkpoint_start(uint32_t Time, struct bc_checkpoint_t *pCp)
+{
+    for (int lp = (int)ARRAY_SIZE(kCheckpoints) - 1; lp >= 0; lp--) {
+        if ((kCheckpoints[lp].timestamp != 0) && (kCheckpoints[lp].timestamp < Time)) {
+            MEMCPY(pCp, &kCheckpoints[lp], sizeof(struct bc_checkpoint_t));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**************************************************************************
+ * private functions
+ **************************************************************************/
+
+/** 高さからcheckpoint検索
+ *
+ * @param[in]       Height      block高さ
+ * @return          kCheckpoints[]の位置(-1:checkpointの高さではない)
+ */
+static int ICACHE_FLASH_ATTR cp_search(uint32_t Height)
+{
+    //heightの昇順に並んでいるので二分探索
+    int lo = 0;
+    int hi = (int)ARRAY_SIZE(kCheckpoints) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (kCheckpoints[mid].height == Height) {
+            return mid;
+        }
+        if (kCheckpoints[mid].height < Height) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,396 @@
+/**************************************************************************
+ * @file    bc_codec.c
+ * @brief   Bitcoinメッセージのデコーダ
+ * @note
+ *          - 受信データはどこで分割されていてもよい
+ *          - 受信データ内に揃っているフィールドは、コピーせずにそのまま通知する
+ *          - 受信データの境界をまたぐフィールドだけ、再構築領域にためてから通知する
+ *          - MALLOC()するのはBC_CODEC_PAYLOADだけ
+ *          - checksumは読み進めた分だけHASH256を更新して照合するため、payloadはためない
+ **************************************************************************/
+
+#include "bc_codec.h"
+
+
+/**************************************************************************
+ * macros
+ **************************************************************************/
+
+/** @enum   stage_t
+ *
+ * フィールド内の解析状態
+ */
+enum stage_t {
+    ST_START,           ///< フィールド開始
+    ST_FIXED,           ///< 固定長データ
+    ST_VARINT,          ///< varint
+    ST_ELEM,            ///< 配列要素
+    ST_BYTES,           ///< バイト列
+    ST_PAYLOAD,         ///< payload残り全部
+};
+
+
+/**************************************************************************
+ * prototypes
+ **************************************************************************/
+
+static int ICACHE_FLASH_ATTR decode_field(struct bc_codec_t *pCodec, const struct bc_codec_field_t *pField, const uint8_t **pp, int *pLen);
+static const uint8_t *ICACHE_FLASH_ATTR gather(struct bc_codec_t *pCodec, const uint8_t **pp, int *pLen, int nByte);
+static int ICACHE_FLASH_ATTR get_varint(struct bc_codec_t *pCodec, const uint8_t **pp, int *pLen, uint64_t *pVal);
+static inline void ICACHE_FLASH_ATTR consume(struct bc_codec_t *pCodec, const uint8_t **pp, int *pLen, int nByte);
+static void ICACHE_FLASH_ATTR notify(struct bc_codec_t *pCodec, const struct bc_codec_field_t *pField, const uint8_t *pData, int Len, uint64_t Val);
+static void ICACHE_FLASH_ATTR verify(struct bc_codec_t *pCodec);
+
+
+/**************************************************************************
+ * public functions
+ **************************************************************************/
+
+void ICACHE_FLASH_ATTR bc_codec_start(struct bc_codec_t *pCodec, const struct bc_codec_msg_t *pMsg, uint32_t Length, const uint8_t *pChecksum, void *pArg)
+{
+    if (pCodec->pPayload != NULL) {
+        //前回の解析が途中で終わっている
+        FREE(pCodec->pPayload);
+    }
+
+    pCodec->pMsg = pMsg;
+    pCodec->pArg = pArg;
+    pCodec->rest = Length;
+    pCodec->field = 0;
+    pCodec->stage = ST_START;
+    pCodec->abort = 0;
+    pCodec->bytes = 0;
+    pCodec->count = 0;
+    pCodec->idx = 0;
+    pCodec->pPayload = NULL;
+    MEMCPY(pCodec->checksum, pChecksum, sizeof(pCodec->checksum));
+    pCodec->bad = 0;
+    bc_misc_hash256_init(&pCodec->hash);
+    if (Length == 0) {
+        //読み進めないので、ここで照合する
+        verify(pCodec);
+    }
+}
+
+
+int ICACHE_FLASH_ATTR bc_codec_decode(struct bc_codec_t *pCodec, const uint8_t *pData, int *pLen)
+{
+    const struct bc_codec_msg_t *pMsg = pCodec->pMsg;
+    const uint8_t *p = pData;
+
+    //payloadの範囲だけ解析する
+    int len = ((uint32_t)*pLen < pCodec->rest) ? *pLen : (int)pCodec->rest;
+    int avail = len;
+
+    while ((pCodec->field < pMsg->num) && !pCodec->abort) {
+        if (!decode_field(pCodec, &pMsg->pFields[pCodec->field], &p, &len)) {
+            //受信データ不足
+            break;
+        }
+        pCodec->field++;
+        pCodec->stage = ST_START;
+    }
+    if ((pCodec->field >= pMsg->num) || pCodec->abort) {
+        //フィールド定義より後ろ、あるいは解析中止 --> 読み捨て
+        consume(pCodec, &p, &len, len);
+    }
+    *pLen -= avail - len;
+
+    if (pCodec->rest > 0) {
+        return BC_CODEC_CONT;
+    }
+
+    //payload完了
+    if (pCodec->bad) {
+        DBG_PRINTF("[%s()]checksum mismatch\n", __func__);
+        if (pMsg->pBad != NULL) {
+            (*pMsg->pBad)(pCodec->pArg);
+        }
+    }
+    else if (!pCodec->abort && (pMsg->pFin != NULL)) {
+        (*pMsg->pFin)(pCodec->pArg);
+    }
+    return BC_CODEC_FIN;
+}
+
+
+/**************************************************************************
+ * private functions
+ **************************************************************************/
+
+/** フィールド解析
+ *
+ * @param[in,out]   pCodec      デコーダ状態
+ * @param[in]       pField      解析中のフィールド定義
+ * @param[in,out]   pp          受信データ(処理した分進める)
+ * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
+ * @retval          1           フィールド解析完了
+ * @retval          0           受信データ不足
+ */
+static int ICACHE_FLASH_ATTR decode_field(struct bc_codec_t *pCodec, const struct bc_codec_field_t *pField, const uint8_t **pp, int *pLen)
+{
+    const uint8_t *p;
+    uint64_t val;
+    int sz;
+
+    if (pCodec->stage == ST_START) {
+        pCodec->idx = 0;
+        switch (pField->type) {
+        case BC_CODEC_VARINT:
+        case BC_CODEC_VARARRAY:
+        case BC_CODEC_VARBYTES:
+            pCodec->stage = ST_VARINT;
+            break;
+        case BC_CODEC_REST:
+            pCodec->count = pCodec->rest;
+            notify(pCodec, pField, NULL, 0, pCodec->count);
+            pCodec->stage = ST_BYTES;
+            break;
+        case BC_CODEC_PAYLOAD:
+            pCodec->count = pCodec->rest;
+            pCodec->stage = ST_PAYLOAD;
+            break;
+        default:
+            pCodec->stage = ST_FIXED;
+            break;
+        }
+    }
+
+    switch (pCodec->stage) {
+    case ST_FIXED:
+        switch (pField->type) {
+        case BC_CODEC_U8:
+            sz = sizeof(uint8_t);
+            break;
+        case BC_CODEC_U32:
+            sz = sizeof(uint32_t);
+            break;
+        case BC_CODEC_U64:
+            sz = sizeof(uint64_t);
+            break;
+        case BC_CODEC_HASH256:
+            sz = BC_SZ_HASH256;
+            break;
+        default:
+            sz = pField->size;
+            break;
+        }
+        p = gather(pCodec, pp, pLen, sz);
+        if (p == NULL) {
+            return 0;
+        }
+        val = 0;
+        if ((pField->type == BC_CODEC_U8) || (pField->type == BC_CODEC_U32) || (pField->type == BC_CODEC_U64)) {
+            MEMCPY(&val, p, sz);            //Little Endian
+        }
+        notify(pCodec, pField, p, sz, val);
+        return 1;
+
+    case ST_VARINT:
+        if (!get_varint(pCodec, pp, pLen, &val)) {
+            return 0;
+        }
+        if (pField->type == BC_CODEC_VARINT) {
+            notify(pCodec, pField, NULL, 0, val);
+            return 1;
+        }
+        //要素数 or データ長
+        pCodec->count = val;
+        notify(pCodec, pField, NULL, 0, val);
+        if (val == 0) {
+            return 1;
+        }
+        pCodec->stage = (pField->type == BC_CODEC_VARARRAY) ? ST_ELEM : ST_BYTES;
+        return decode_field(pCodec, pField, pp, pLen);
+
+    case ST_ELEM:
+        while ((pCodec->idx < pCodec->count) && !pCodec->abort) {
+            p = gather(pCodec, pp, pLen, pField->size);
+            if (p == NULL) {
+                return 0;
+            }
+            notify(pCodec, pField, p, pField->size, pCodec->count);
+            pCodec->idx++;
+        }
+        return 1;
+
+    case ST_BYTES:
+        while ((pCodec->idx < pCodec->count) && !pCodec->abort) {
+            if (*pLen == 0) {
+                return 0;
+            }
+            sz = (pCodec->count - pCodec->idx < (uint64_t)*pLen) ? (int)(pCodec->count - pCodec->idx) : *pLen;
+            notify(pCodec, pField, *pp, sz, pCodec->count);
+            consume(pCodec, pp, pLen, sz);
+            pCodec->idx += sz;
+        }
+        return 1;
+
+    case ST_PAYLOAD:
+        if ((pCodec->pPayload == NULL) && (pCodec->idx == 0) && ((uint64_t)*pLen >= pCodec->count)) {
+            //受信データ内に揃っている(照合してから通知する)
+            const uint8_t *p_payload = *pp;
+            consume(pCodec, pp, pLen, (int)pCodec->count);
+            if (!pCodec->bad) {
+                notify(pCodec, pField, p_payload, (int)pCodec->count, pCodec->count);
+            }
+            return 1;
+        }
+        if (pCodec->pPayload == NULL) {
+            pCodec->pPayload = (uint8_t *)MALLOC(pCodec->count);
+            if (pCodec->pPayload == NULL) {
+                DBG_PRINTF("[%s()]malloc fail(%u)\n", __func__, (uint32_t)pCodec->count);
+                pCodec->abort = 1;
+                return 1;
+            }
+            DBG_PRINTF("[%s()]payload buffering(%u)\n", __func__, (uint32_t)pCodec->count);
+        }
+        sz = (pCodec->count - pCodec->idx < (uint64_t)*pLen) ? (int)(pCodec->count - pCodec->idx) : *pLen;
+        MEMCPY(pCodec->pPayload + pCodec->idx, *pp, sz);
+        consume(pCodec, pp, pLen, sz);
+        pCodec->idx += sz;
+        if (pCodec->idx < pCodec->count) {
+            return 0;
+        }
+        if (!pCodec->bad) {
+            notify(pCodec, pField, pCodec->pPayload, (int)pCodec->count, pCodec->count);
+        }
+        FREE(pCodec->pPayload);
+        pCodec->pPayload = NULL;
+        return 1;
+
+    default:
+        DBG_PRINTF("[%s()]invalid stage : %d\n", __func__, pCodec->stage);
+        HALT();
+        return 1;
+    }
+}
+
+
+/** 固定長データ取得
+ *
+ * 受信データ内に揃っていれば受信データ内を、そうでなければ再構築領域にためて返す。
+ *
+ * @param[in,out]   pCodec      デコーダ状態
+ * @param[in,out]   pp          受信データ(処理した分進める)
+ * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
+ * @param[in]       nByte       データ長
+ * @retval          NULL        受信データ不足、あるいはnByteがBC_CODEC_SZ_BUFを超える(解析中止)
+ * @retval          それ以外    データの先頭
+ */
+static const uint8_t *ICACHE_FLASH_ATTR gather(struct bc_codec_t *pCodec, const uint8_t **pp, int *pLen, int nByte)
+{
+    const uint8_t *pRet = NULL;
+
+    if (nByte > BC_CODEC_SZ_BUF) {
+        //再構築領域に入らない定義 --> 以降は読み捨て
+        DBG_PRINTF("[%s()]too large field : %d\n", __func__, nByte);
+        pCodec->abort = 1;
+        return NULL;
+    }
+    if ((pCodec->bytes == 0) && (*pLen >= nByte)) {
+        //受信データ内に揃っている --> そのまま使う
+        pRet = *pp;
+        consume(pCodec, pp, pLen, nByte);
+    }
+    else {
+        int sz = nByte - pCodec->bytes;
+        if (sz > *pLen) {
+            sz = *pLen;
+        }
+        MEMCPY(pCodec->buf + pCodec->bytes, *pp, sz);
+        pCodec->bytes += sz;
+        consume(pCodec, pp, pLen, sz);
+        if (pCodec->bytes == nByte) {
+            pRet = pCodec->buf;
+            pCodec->bytes = 0;
+        }
+    }
+
+    return pRet;
+}
+
+
+/** varint取得
+ *
+ * @param[in,out]   pCodec      デコーダ状態
+ * @param[in,out]   pp          受信データ(処理した分進める)
+ * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
+ * @param[out]      pVal        変換結果
+ * @retval          1           取得完了
+ * @retval          0           受信データ不足
+ */
+static int ICACHE_FLASH_ATTR get_varint(struct bc_codec_t *pCodec, const uint8_t **pp, int *pLen, uint64_t *pVal)
+{
+    if (*pLen == 0) {
+        return 0;
+    }
+
+    uint8_t prefix = (pCodec->bytes == 0) ? **pp : pCodec->buf[0];
+    const uint8_t *p = gather(pCodec, pp, pLen, bc_misc_varint_len(prefix));
+    if (p == NULL) {
+        return 0;
+    }
+    bc_misc_get_varint(p, pVal);
+    return 1;
+}
+
+
+/** 受信データを進める
+ *
+ * 進めた分でHASH256を更新し、payloadの最後まで進んだらchecksumを照合する。
+ *
+ * @param[in,out]   pCodec      デコーダ状態
+ * @param[in,out]   pp          受信データ
+ * @param[in,out]   pLen        受信データ長
+ * @param[in]       nByte       進めるサイズ
+ */
+static inline void ICACHE_FLASH_ATTR consume(struct bc_codec_t *pCodec, const uint8_t **pp, int *pLen, int nByte)
+{
+    bc_misc_hash256_update(&pCodec->hash, *pp, nByte);
+    *pp += nByte;
+    *pLen -= nByte;
+    pCodec->rest -= nByte;
+    if ((nByte > 0) && (pCodec->rest == 0)) {
+        verify(pCodec);
+    }
+}
+
+
+/** コールバック呼び出し
+ *
+ * @param[in,out]   pCodec      デコーダ状態
+ * @param[in]       pField      解析中のフィールド定義
+ * @param[in]       pData       データ
+ * @param[in]       Len         pData長
+ * @param[in]       Val         値
+ */
+static void ICACHE_FLASH_ATTR notify(struct bc_codec_t *pCodec, const struct bc_codec_field_t *pField, const uint8_t *pData, int Len, uint64_t Val)
+{
+    if (pField->pFunc == NULL) {
+        return;
+    }
+
+    struct bc_codec_elem_t elem;
+    elem.field = pCodec->field;
+    elem.pData = pData;
+    elem.len = Len;
+    elem.val = Val;
+    elem.idx = pCodec->idx;
+    if ((*pField->pFunc)(pCodec->pArg, &elem) == BC_CODEC_ABORT) {
+        pCodec->abort = 1;
+    }
+}
+
+
+/** checksum照合
+ *
+ * @param[in,out]   pCodec      デコーダ状態(hash256を更新し、不一致ならbadを1にする)
+ */
+static void ICACHE_FLASH_ATTR verify(struct bc_codec_t *pCodec)
+{
+    bc_misc_hash256_final(&pCodec->hash, pCodec->hash256);
+    if (MEMCMP(pCodec->hash256, pCodec->checksum, sizeof(pCodec->checksum)) != 0) {
+        pCodec->bad = 1;
+    }
+}
@@ -5,6 +5,7 @@
 
 #include "bc_flash.h"
 #include "bc_proto.h"
+#include "bc_checkpoint.h"
 
 
 /**************************************************************************
@@ -15,14 +16,20 @@
 #define SEC_TX_END      (BC_FLASH_START + 499)
 #define SEC_BLOCK1      (BC_FLASH_START + 500)
 #define SEC_BLOCK2      (BC_FLASH_START + 501)
-#define SEC_RESTORE     (BC_FLASH_START + 502)
-#define SEC_RESTORE_NUM (BC_FLASH_START + 503)
+#define SEC_HDR_START   (BC_FLASH_START + 502)
+#define SEC_HDR_END     (BC_FLASH_START + 506)
 #define SEC_WALLET      (BC_FLASH_START + 507)
 
 #define M_FLASH_EMPTY8   ((uint8_t)0xff)
 #define M_FLASH_EMPTY16  ((uint8_t)0xffff)
 #define M_FLASH_EMPTY32  ((uint32_t)0xffffffff)
 
+#define M_BLK_HEAD_SZ32  ((BC_SZ_HASH256 + 4 * 3) / 4)  ///< bc_flash_blk_tのhistory[]より前のサイズ(uint32単位)
+#define M_BLK_DENSE      (4)                            ///< block locatorの履歴のうち、間引かずに残す保存回数
+#define M_HDR_PER_SEC    (SPI_FLASH_SEC_SIZE / sizeof(struct bc_flash_hdr_t))   ///< 1セクタのheader記録数
+#define M_HDR_NUM        (M_HDR_PER_SEC * (SEC_HDR_END - SEC_HDR_START + 1))    ///< header記録数(リングバッファ)
+#define M_HDR_CHUNK      (16)                           ///< header記録を1回に読む件数(M_HDR_PER_SECの約数)
+
 #define M_FLASH_OPECHK(fret) \
     if (fret != SPI_FLASH_RESULT_OK) {                          \
         DBG_PRINTF("flash fail[%d] : %d\n", __LINE__, fret);    \
@@ -52,7 +59,7 @@ struct txpos_t {
  **************************************************************************/
 
 //エンディアンを逆順にし忘れないように注意！
-//Height : 685351
+//Height : 685351(高さはbc_checkpoint_tbl.hから取得する)
 //000000000079667b6264c468a4f8b12549815994583be1398d4682d9c3f83535
 const uint8_t kBlockHashStart[] __attribute__ ((aligned (4))) = {
     0x35, 0x35, 0xf8, 0xc3, 0xd9, 0x82, 0x46, 0x8d, 
@@ -62,6 +69,19 @@ const uint8_t kBlockHashStart[] __attribute__ ((aligned (4))) = {
 };
 
 
+/**************************************************************************
+ * private variables
+ **************************************************************************/
+
+#ifdef __XTENSA__
+static int          mHdrPos = -1;       ///< 次に書き込むheader記録の位置(-1:未検索)
+static uint32_t     mHdrSeq;            ///< 次に書き込むheader記録のseq
+static uint32       mHdrBuf[sizeof(struct bc_flash_hdr_t) * BC_FLASH_HDR_BATCH / sizeof(uint32)];  ///< 書込み待ちのheader記録
+static int          mHdrBufNum;         ///< mHdrBuf[]の件数
+static struct bc_flash_hdr_t mHdrTip;  ///< 最新のheader記録(mHdrSeq == 0の場合は無効)
+#endif  //__XTENSA__
+
+
 /**************************************************************************
  * prototypes
  **************************************************************************/
@@ -69,7 +89,12 @@ const uint8_t kBlockHashStart[] __attribute__ ((aligned (4))) = {
 #ifdef __XTENSA__
 static int ICACHE_FLASH_ATTR search_txinfo(struct txpos_t *pPos, uint32_t timestamp);
 static void ICACHE_FLASH_ATTR show_bcaddr(const struct bc_flash_wlt_t *pAddr);
+static int ICACHE_FLASH_ATTR blk_newest(void);
+static int ICACHE_FLASH_ATTR blk_thin(struct bc_flash_loc_t *pHistory, int Num, uint32_t Seq);
+static int ICACHE_FLASH_ATTR blk_log2(uint32_t Val);
+static void ICACHE_FLASH_ATTR hdr_scan(void);
 #endif  //__XTENSA__
+static void ICACHE_FLASH_ATTR blk_first(uint8_t *pHash);
 
 
 /**************************************************************************
@@ -85,6 +110,7 @@ int ICACHE_FLASH_ATTR bc_flash_save_bcaddr(const uint32_t *pData)
 
     int ret;
     struct bc_flash_wlt_t wlt;
+    uint32 buff[BC_FLASH_WALLET_SZ32];
 
     bc_flash_get_bcaddr(&wlt);
     int cmp = memcmp(pData, &wlt, BC_SZ_HASH160 + BC_SZ_PUBKEY);
@@ -93,11 +119,16 @@ int ICACHE_FLASH_ATTR bc_flash_save_bcaddr(const uint32_t *pData)
         return BC_FLASH_WRT_IGNORE;
     }
 
+    //ウォレット作成時刻(時刻未取得ならBC_TIME_INVALID=不明)
+    MEMCPY(buff, pData, BC_FLASH_WALLET_RXLEN);
+    ((struct bc_flash_wlt_t *)buff)->birthday = bc_misc_time_get();
+    DBG_PRINTF("birthday : %u\n", ((struct bc_flash_wlt_t *)buff)->birthday);
+
     //書込み
     spi_flash_erase_sector(SEC_WALLET);
     SpiFlashOpResult fret = spi_flash_write(
             (uint32)(SPI_FLASH_SEC_SIZE * SEC_WALLET),
-            (uint32 *)pData,
+            buff,
             (uint32)sizeof(struct bc_flash_wlt_t));
     M_FLASH_OPECHK(fret);
 
@@ -154,24 +185,40 @@ void ICACHE_FLASH_ATTR bc_flash_get_bcaddr(struct bc_flash_wlt_t *pAddr)
 
     MEMCPY(pAddr->bcaddr, kPubKeyHash, sizeof(kPubKeyHash));
     MEMCPY(pAddr->pubkey, kPubKey, sizeof(kPubKey));
+    pAddr->birthday = M_FLASH_EMPTY32;
 #endif  //__XTENSA__
 }
 
 
+uint32_t ICACHE_FLASH_ATTR bc_flash_get_birthday(void)
+{
+    struct bc_flash_wlt_t wlt;
+
+    bc_flash_get_bcaddr(&wlt);
+    if ((wlt.birthday == M_FLASH_EMPTY32) || (wlt.birthday < BC_FLASH_BIRTHDAY_MARGIN)) {
+        //未設定(birthday追加前に保存したウォレットを含む)
+        return 0;
+    }
+    return wlt.birthday - BC_FLASH_BIRTHDAY_MARGIN;
+}
+
+
 void ICACHE_FLASH_ATTR bc_flash_erase_txinfo(void)
 {
 #ifdef __XTENSA__
     DBG_FUNCNAME();
 
-    for (int sec = SEC_TX_START; sec <= SEC_BLOCK2; sec++) {
+    for (int sec = SEC_TX_START; sec <= SEC_HDR_END; sec++) {
         //DBG_PRINTF("erase %d\n", sec);
         spi_flash_erase_sector(sec);
     }
+    mHdrPos = -1;
+    mHdrBufNum = 0;
     DBG_PRINTF("%s() done.\n", __func__);
 
 #if 0
     //消去確認
-    for (int sec = SEC_TX_START; sec <= SEC_BLOCK2; sec++) {
+    for (int sec = SEC_TX_START; sec <= SEC_HDR_END; sec++) {
         uint32 tmp[128 / sizeof(uint32)];      //128byte
         const uint8_t *ptmp = (const uint8_t *)tmp;
         for (int addr = 0; addr < SPI_FLASH_SEC_SIZE / sizeof(tmp); addr++) {
@@ -219,7 +266,7 @@ void ICACHE_FLASH_ATTR bc_flash_update_txinfo(uint8_t Type, const struct bc_prot
     case BC_FLASH_TYPE_TXA:
         //inputのHASH256
         DBG_PRINTF("  TX(a)\n");
-        bc_misc_hash256(hash, pProtoTx->pTx, pProtoTx->Len);
+        MEMCPY(hash, pProtoTx->pTxHash, BC_SZ_HASH256);
         break;
     case BC_FLASH_TYPE_TXB:
         //prev_output
@@ -296,7 +343,7 @@ void ICACHE_FLASH_ATTR bc_flash_update_txinfo(uint8_t Type, const struct bc_prot
                                 //check ok
                                 txpos.edit = 1;
                                 txpos.p_tx[txpos.pos].started_time = started_time;
-                                bc_misc_hash256(txpos.p_tx[txpos.pos].txb_hash, pProtoTx->pTx, pProtoTx->Len);
+                                MEMCPY(txpos.p_tx[txpos.pos].txb_hash, pProtoTx->pTxHash, BC_SZ_HASH256);
 
                                 DBG_PRINTF("  * [%s()] add TX(b) sec=%d, pos=%d\n", __func__, txpos.sec, txpos.pos);
                                 DBG_PRINTF("  * hash: ");
@@ -440,196 +487,470 @@ void ICACHE_FLASH_ATTR bc_flash_save_last_bhash(const uint8_t *pHash)
 #ifdef __XTENSA__
     SpiFlashOpResult fret;
 
-    uint32 blk1[sizeof(struct bc_flash_blk_t) / sizeof(uint32)];
-    uint32 blk2[sizeof(struct bc_flash_blk_t) / sizeof(uint32)];
+    //履歴の先頭に前回のbhashを追加するため、1件多く確保する
+    uint32 *p_buff = (uint32 *)MALLOC(sizeof(struct bc_flash_blk_t) + sizeof(struct bc_flash_loc_t));
+    if (p_buff == NULL) {
+        //保存しない(次回の保存で追いつく)
+        DBG_PRINTF("[%s()] no memory\n", __func__);
+        return;
+    }
+    struct bc_flash_blk_t *p_blk = (struct bc_flash_blk_t *)p_buff;
+    int sec = blk_newest();
+    int num = 0;
 
-    fret = spi_flash_read(
-            (uint32)(SPI_FLASH_SEC_SIZE * SEC_BLOCK1),
-            blk1,
-            (uint32)sizeof(blk1));
-    M_FLASH_OPECHK(fret);
+    if (sec != 0) {
+        fret = spi_flash_read(
+                (uint32)(SPI_FLASH_SEC_SIZE * sec),
+                p_buff,
+                (uint32)sizeof(struct bc_flash_blk_t));
+        M_FLASH_OPECHK(fret);
 
-    fret = spi_flash_read(
-            (uint32)(SPI_FLASH_SEC_SIZE * SEC_BLOCK2),
-            blk2,
-            (uint32)sizeof(blk2));
-    M_FLASH_OPECHK(fret);
+        if (MEMCMP(p_blk->bhash, pHash, BC_SZ_HASH256) == 0) {
+            DBG_PRINTF("[%s()] same hash. not saved.\n", __func__);
+            FREE(p_buff);
+            return;
+        }
 
-    int sec;
-    struct bc_flash_blk_t *p1 = (struct bc_flash_blk_t *)blk1;
-    struct bc_flash_blk_t *p2 = (struct bc_flash_blk_t *)blk2;
-    DBG_PRINTF("(blk1:%u, blk2:%u)\n", p1->update_time, p2->update_time);
-    if (p1->update_time == M_FLASH_EMPTY32) {
-        //blk1更新
-        DBG_PRINTF("[%s()] new blk1\n", __func__);
-        sec = SEC_BLOCK1;
-    }
-    else if (p2->update_time == M_FLASH_EMPTY32) {
-        //blk2更新
-        DBG_PRINTF("[%s()] new blk2\n", __func__);
-        sec = SEC_BLOCK2;
+        if (p_blk->num > BC_FLASH_LOCATOR_NUM - 1) {
+            //履歴追加前の形式
+            p_blk->seq = 0;
+            p_blk->num = 0;
+        }
+        //前回のbhashを履歴の先頭に追加
+        num = (int)p_blk->num;
+        MEMMOVE(&p_blk->history[1], &p_blk->history[0], sizeof(struct bc_flash_loc_t) * num);
+        p_blk->history[0].seq = p_blk->seq;
+        MEMCPY(p_blk->history[0].bhash, p_blk->bhash, BC_SZ_HASH256);
+        num++;
+        p_blk->seq++;
+        num = blk_thin(p_blk->history, num, p_blk->seq);
     }
     else {
-        if (p1->update_time <= p2->update_time) {
-            //blk1の方が古い
-            DBG_PRINTF("[%s()] update blk1\n", __func__);
-            sec = SEC_BLOCK1;
-        }
-        else {
-            DBG_PRINTF("[%s()] update blk2\n", __func__);
-            sec = SEC_BLOCK2;
-        }
+        p_blk->seq = 0;
+    }
+    p_blk->num = (uint32_t)num;
+    MEMCPY(p_blk->bhash, pHash, BC_SZ_HASH256);
+    p_blk->update_time = bc_misc_time_get();
+
+    //古い方(あるいは空き)に書き込む
+    sec = (sec == SEC_BLOCK1) ? SEC_BLOCK2 : SEC_BLOCK1;
+    spi_flash_erase_sector(sec);
+    fret = spi_flash_write(
+            (uint32)(SPI_FLASH_SEC_SIZE * sec),
+            p_buff,
+            (uint32)sizeof(struct bc_flash_blk_t));
+    M_FLASH_OPECHK(fret);
+
+    DBG_PRINTF("saved block hash[%u](sec=%d, seq=%u, locator=%d): ", p_blk->update_time, sec, p_blk->seq, num + 1);
+    for (int i = 0; i < BC_SZ_HASH256; i++) {
+        DBG_PRINTF("%02x", p_blk->bhash[BC_SZ_HASH256 - i - 1]);
     }
+    DBG_PRINTF("\n");
+
+    FREE(p_buff);
+#endif  //__XTENSA__
+}
 
-    if (MEMCMP(p1->bhash, pHash, BC_SZ_HASH256) != 0) {
-        //不一致の場合
-        MEMCPY(p1->bhash, pHash, BC_SZ_HASH256);
-        p1->update_time = bc_misc_time_get();
 
-        spi_flash_erase_sector(sec);
-        fret = spi_flash_write(
+void ICACHE_FLASH_ATTR bc_flash_get_last_bhash(uint8_t *pHash)
+{
+    bc_flash_get_locator(pHash, 1);
+}
+
+
+int ICACHE_FLASH_ATTR bc_flash_get_locator(uint8_t *pHashes, int Max)
+{
+#ifdef __XTENSA__
+    SpiFlashOpResult fret;
+    int sec = blk_newest();
+
+    if (sec == 0) {
+        //どちらも初めて
+        DBG_PRINTF("[%s()] first\n", __func__);
+        blk_first(pHashes);
+        return 1;
+    }
+
+    uint32 *p_buff = (uint32 *)MALLOC(sizeof(struct bc_flash_blk_t));
+    if (p_buff == NULL) {
+        //履歴は返さず、最後に取得したBlock Hashだけ読む
+        uint32 head[M_BLK_HEAD_SZ32];
+
+        DBG_PRINTF("[%s()] no memory\n", __func__);
+        fret = spi_flash_read(
                 (uint32)(SPI_FLASH_SEC_SIZE * sec),
-                blk1,
-                (uint32)sizeof(blk1));
+                head,
+                (uint32)sizeof(head));
         M_FLASH_OPECHK(fret);
+        MEMCPY(pHashes, ((const struct bc_flash_blk_t *)head)->bhash, BC_SZ_HASH256);
+        return 1;
+    }
+    const struct bc_flash_blk_t *p_blk = (const struct bc_flash_blk_t *)p_buff;
 
+    fret = spi_flash_read(
+            (uint32)(SPI_FLASH_SEC_SIZE * sec),
+            p_buff,
+            (uint32)sizeof(struct bc_flash_blk_t));
+    M_FLASH_OPECHK(fret);
 
-        DBG_PRINTF("saved block hash[%u]: ", p1->update_time);
-        for (int i = 0; i < BC_SZ_HASH256; i++) {
-            DBG_PRINTF("%02x", p1->bhash[BC_SZ_HASH256 - i - 1]);
+    MEMCPY(pHashes, p_blk->bhash, BC_SZ_HASH256);
+    int cnt = 1;
+    if (p_blk->num <= BC_FLASH_LOCATOR_NUM - 1) {
+        for (int lp = 0; (lp < (int)p_blk->num) && (cnt < Max); lp++) {
+            MEMCPY(pHashes + BC_SZ_HASH256 * cnt, p_blk->history[lp].bhash, BC_SZ_HASH256);
+            cnt++;
         }
-        DBG_PRINTF("\n");
-    }
-    else {
-        DBG_PRINTF("[%s()] same hash. not saved.\n", __func__);
     }
+    DBG_PRINTF("[%s()] sec=%d, locator=%d\n", __func__, sec, cnt);
+    FREE(p_buff);
+
+    return cnt;
+#else   //__XTENSA__
+    blk_first(pHashes);
+    return 1;
 #endif  //__XTENSA__
 }
 
 
-void ICACHE_FLASH_ATTR bc_flash_get_last_bhash(uint8_t *pHash)
+int ICACHE_FLASH_ATTR bc_flash_is_locator(const uint8_t *pBhash)
 {
 #ifdef __XTENSA__
     SpiFlashOpResult fret;
+    uint32 head[M_BLK_HEAD_SZ32];
+    uint32 loc[sizeof(struct bc_flash_loc_t) / sizeof(uint32)];
+    const struct bc_flash_blk_t *p_blk = (const struct bc_flash_blk_t *)head;
+    const struct bc_flash_loc_t *p_loc = (const struct bc_flash_loc_t *)loc;
+    int sec = blk_newest();
 
-    uint32 blk1[sizeof(struct bc_flash_blk_t) / sizeof(uint32)];
-    uint32 blk2[sizeof(struct bc_flash_blk_t) / sizeof(uint32)];
+    if (sec == 0) {
+        //どちらも初めて
+        uint8_t hash[BC_SZ_HASH256];
 
-    fret = spi_flash_read(
-            (uint32)(SPI_FLASH_SEC_SIZE * SEC_BLOCK1),
-            blk1,
-            (uint32)sizeof(blk1));
-    M_FLASH_OPECHK(fret);
+        blk_first(hash);
+        return MEMCMP(hash, pBhash, BC_SZ_HASH256) == 0;
+    }
 
     fret = spi_flash_read(
-            (uint32)(SPI_FLASH_SEC_SIZE * SEC_BLOCK2),
-            blk2,
-            (uint32)sizeof(blk2));
+            (uint32)(SPI_FLASH_SEC_SIZE * sec),
+            head,
+            (uint32)sizeof(head));
     M_FLASH_OPECHK(fret);
+    if (MEMCMP(p_blk->bhash, pBhash, BC_SZ_HASH256) == 0) {
+        return 1;
+    }
+    if (p_blk->num > BC_FLASH_LOCATOR_NUM - 1) {
+        //履歴追加前の形式
+        return 0;
+    }
 
-    const uint8_t *p;
-    struct bc_flash_blk_t *p1 = (struct bc_flash_blk_t *)blk1;
-    struct bc_flash_blk_t *p2 = (struct bc_flash_blk_t *)blk2;
-    DBG_PRINTF("(blk1:%u, blk2:%u)\n", p1->update_time, p2->update_time);
-    if ((p1->update_time == M_FLASH_EMPTY32) && (p2->update_time == M_FLASH_EMPTY32)) {
-        //どちらも初めて
-        DBG_PRINTF("[%s()] first\n", __func__);
-        p = kBlockHashStart;
+    //履歴は1件ずつ読む
+    for (int lp = 0; lp < (int)p_blk->num; lp++) {
+        fret = spi_flash_read(
+                (uint32)(SPI_FLASH_SEC_SIZE * sec + sizeof(head) + sizeof(loc) * lp),
+                loc,
+                (uint32)sizeof(loc));
+        M_FLASH_OPECHK(fret);
+        if (MEMCMP(p_loc->bhash, pBhash, BC_SZ_HASH256) == 0) {
+            return 1;
+        }
     }
-    else if (p1->update_time == M_FLASH_EMPTY32) {
-        //blk2有効
-        DBG_PRINTF("[%s()] use blk2\n", __func__);
-        p = p2->bhash;
+    return 0;
+#else   //__XTENSA__
+    uint8_t hash[BC_SZ_HASH256];
+
+    blk_first(hash);
+    return MEMCMP(hash, pBhash, BC_SZ_HASH256) == 0;
+#endif  //__XTENSA__
+}
+
+
+void ICACHE_FLASH_ATTR bc_flash_hdr_add(uint32_t Height, const uint8_t *pBhash, uint32_t Bits, uint32_t Timestamp)
+{
+#ifdef __XTENSA__
+    if (mHdrPos < 0) {
+        hdr_scan();
     }
-    else if (p2->update_time == M_FLASH_EMPTY32) {
-        //blk1有効
-        DBG_PRINTF("[%s()] use blk1\n", __func__);
-        p = p1->bhash;
+
+    struct bc_flash_hdr_t *p_hdr = (struct bc_flash_hdr_t *)mHdrBuf + mHdrBufNum;
+    p_hdr->seq = mHdrSeq++;
+    p_hdr->height = Height;
+    MEMCPY(p_hdr->bhash, pBhash, BC_FLASH_HDR_HASHLEN);
+    p_hdr->bits = Bits;
+    p_hdr->timestamp = Timestamp;
+    mHdrBufNum++;
+    MEMCPY(&mHdrTip, p_hdr, sizeof(struct bc_flash_hdr_t));
+    if (mHdrBufNum == BC_FLASH_HDR_BATCH) {
+        bc_flash_hdr_flush();
     }
-    else {
-        if (p1->update_time > p2->update_time) {
-            //blk1の方が新しい
-            DBG_PRINTF("[%s()] use new blk1\n", __func__);
-            p = p1->bhash;
+#endif  //__XTENSA__
+}
+
+
+void ICACHE_FLASH_ATTR bc_flash_hdr_flush(void)
+{
+#ifdef __XTENSA__
+    SpiFlashOpResult fret;
+    int done = 0;
+
+    while (done < mHdrBufNum) {
+        int sec = SEC_HDR_START + mHdrPos / M_HDR_PER_SEC;
+        int ofs = mHdrPos % M_HDR_PER_SEC;
+        if (ofs == 0) {
+            //次のセクタに進んだ --> 最も古い記録を消去
+            spi_flash_erase_sector(sec);
         }
-        else {
-            DBG_PRINTF("[%s()] use new blk2\n", __func__);
-            p = p2->bhash;
+        //セクタの終わりまでをまとめて書く
+        int num = M_HDR_PER_SEC - ofs;
+        if (num > mHdrBufNum - done) {
+            num = mHdrBufNum - done;
         }
+        fret = spi_flash_write(
+                (uint32)(SPI_FLASH_SEC_SIZE * sec + sizeof(struct bc_flash_hdr_t) * ofs),
+                mHdrBuf + sizeof(struct bc_flash_hdr_t) / sizeof(uint32) * done,
+                (uint32)(sizeof(struct bc_flash_hdr_t) * num));
+        M_FLASH_OPECHK(fret);
+
+        done += num;
+        mHdrPos = (mHdrPos + num) % M_HDR_NUM;
     }
-    MEMCPY(pHash, p, BC_SZ_HASH256);
-#else   //__XTENSA__
-    MEMCPY(pHash, kBlockHashStart, BC_SZ_HASH256);
+    mHdrBufNum = 0;
 #endif  //__XTENSA__
 }
 
 
-int ICACHE_FLASH_ATTR bc_flash_erase_last_bhash(void)
+int ICACHE_FLASH_ATTR bc_flash_hdr_find(struct bc_flash_hdr_t *pHdr, const uint8_t *pBhash)
 {
 #ifdef __XTENSA__
     SpiFlashOpResult fret;
 
-    uint32 blk1[sizeof(struct bc_flash_blk_t) / sizeof(uint32)];
-    uint32 blk2[sizeof(struct bc_flash_blk_t) / sizeof(uint32)];
+    if (mHdrPos < 0) {
+        hdr_scan();
+    }
+
+    if (mHdrSeq == 0) {
+        //記録なし
+        return 0;
+    }
+    if ((pBhash == NULL) || (MEMCMP(mHdrTip.bhash, pBhash, BC_FLASH_HDR_HASHLEN) == 0)) {
+        //最新(FLASHを読まない)
+        MEMCPY(pHdr, &mHdrTip, sizeof(struct bc_flash_hdr_t));
+        return 1;
+    }
+
+    //書込み待ち
+    for (int lp = mHdrBufNum - 1; lp >= 0; lp--) {
+        const struct bc_flash_hdr_t *p_hdr = (const struct bc_flash_hdr_t *)mHdrBuf + lp;
+        if (MEMCMP(p_hdr->bhash, pBhash, BC_FLASH_HDR_HASHLEN) == 0) {
+            MEMCPY(pHdr, p_hdr, sizeof(struct bc_flash_hdr_t));
+            return 1;
+        }
+    }
+
+    //FLASH(新しい方から, M_HDR_CHUNK件ずつ読む)
+    uint32 buff[sizeof(struct bc_flash_hdr_t) * M_HDR_CHUNK / sizeof(uint32)];
+    const struct bc_flash_hdr_t *p_chunk = (const struct bc_flash_hdr_t *)buff;
+    int loaded = -1;
+    int ret = 0;
+    for (int lp = 0; lp < M_HDR_NUM; lp++) {
+        int pos = (mHdrPos + M_HDR_NUM - 1 - lp) % M_HDR_NUM;
+        if (pos / M_HDR_CHUNK != loaded) {
+            fret = spi_flash_read(
+                    (uint32)(SPI_FLASH_SEC_SIZE * (SEC_HDR_START + pos / M_HDR_PER_SEC) +
+                                sizeof(struct bc_flash_hdr_t) * (pos % M_HDR_PER_SEC - pos % M_HDR_CHUNK)),
+                    buff,
+                    (uint32)sizeof(buff));
+            M_FLASH_OPECHK(fret);
+            loaded = pos / M_HDR_CHUNK;
+            system_soft_wdt_feed();
+        }
+
+        const struct bc_flash_hdr_t *p_hdr = &p_chunk[pos % M_HDR_CHUNK];
+        if (p_hdr->seq == M_FLASH_EMPTY32) {
+            //これより古い記録はない
+            break;
+        }
+        if (MEMCMP(p_hdr->bhash, pBhash, BC_FLASH_HDR_HASHLEN) == 0) {
+            MEMCPY(pHdr, p_hdr, sizeof(struct bc_flash_hdr_t));
+            ret = 1;
+            break;
+        }
+    }
+
+    return ret;
+#else   //__XTENSA__
+    return 0;
+#endif  //__XTENSA__
+}
+
+
+uint32_t ICACHE_FLASH_ATTR bc_flash_get_height(const uint8_t *pBhash)
+{
+    struct bc_flash_hdr_t hdr;
+
+    if (bc_flash_hdr_find(&hdr, pBhash)) {
+        return hdr.height;
+    }
+    return bc_checkpoint_get_height(pBhash);
+}
+
+
+void ICACHE_FLASH_ATTR bc_flash_get_first_bhash(uint8_t *pHash)
+{
+    blk_first(pHash);
+}
+
+
+/**************************************************************************
+ * private functions
+ **************************************************************************/
+
+/** 初回起動時のBlock Hash
+ * 
+ * ウォレット作成時間がわかっていれば、それより前でkBlockHashStartより後のcheckpointから開始する。
+ * 
+ * @param[out]  pHash       Block Hash
+ */
+static void ICACHE_FLASH_ATTR blk_first(uint8_t *pHash)
+{
+    struct bc_checkpoint_t cp;
+    uint32_t birthday = bc_flash_get_birthday();
+
+    if ((birthday != 0) && bc_checkpoint_start(birthday, &cp) &&
+            (cp.height > bc_checkpoint_get_height(kBlockHashStart))) {
+        DBG_PRINTF("[%s()] checkpoint(height=%u)\n", __func__, cp.height);
+        MEMCPY(pHash, cp.bhash, BC_SZ_HASH256);
+    }
+    else {
+        MEMCPY(pHash, kBlockHashStart, BC_SZ_HASH256);
+    }
+}
+
+
+#ifdef __XTENSA__
+/** Block Hash保存セクタの選択
+ * 
+ * seqが大きい方を返す(履歴追加前の形式はupdate_timeで比較する)。
+ * 
+ * @return      新しい方のセクタ(0:どちらも未保存)
+ */
+static int ICACHE_FLASH_ATTR blk_newest(void)
+{
+    SpiFlashOpResult fret;
+    uint32 head1[M_BLK_HEAD_SZ32];
+    uint32 head2[M_BLK_HEAD_SZ32];
 
     fret = spi_flash_read(
             (uint32)(SPI_FLASH_SEC_SIZE * SEC_BLOCK1),
-            blk1,
-            (uint32)sizeof(blk1));
+            head1,
+            (uint32)sizeof(head1));
     M_FLASH_OPECHK(fret);
 
     fret = spi_flash_read(
             (uint32)(SPI_FLASH_SEC_SIZE * SEC_BLOCK2),
-            blk2,
-            (uint32)sizeof(blk2));
+            head2,
+            (uint32)sizeof(head2));
     M_FLASH_OPECHK(fret);
 
-    int sec;
-    struct bc_flash_blk_t *p1 = (struct bc_flash_blk_t *)blk1;
-    struct bc_flash_blk_t *p2 = (struct bc_flash_blk_t *)blk2;
+    const struct bc_flash_blk_t *p1 = (const struct bc_flash_blk_t *)head1;
+    const struct bc_flash_blk_t *p2 = (const struct bc_flash_blk_t *)head2;
     DBG_PRINTF("(blk1:%u, blk2:%u)\n", p1->update_time, p2->update_time);
-    if ((p1->update_time == M_FLASH_EMPTY32) && (p2->update_time == M_FLASH_EMPTY32)) {
-        //どちらも初めて
-        DBG_PRINTF("[%s()] none\n", __func__);
-        return 0;
+    if (p1->update_time == M_FLASH_EMPTY32) {
+        return (p2->update_time == M_FLASH_EMPTY32) ? 0 : SEC_BLOCK2;
     }
-    else if (p1->update_time == M_FLASH_EMPTY32) {
-        //blk2有効
-        DBG_PRINTF("[%s()] erase blk2\n", __func__);
-        sec = SEC_BLOCK1;
+    if (p2->update_time == M_FLASH_EMPTY32) {
+        return SEC_BLOCK1;
     }
-    else if (p2->update_time == M_FLASH_EMPTY32) {
-        //blk1有効
-        DBG_PRINTF("[%s()] erase blk1\n", __func__);
-        sec = SEC_BLOCK2;
+    if ((p1->seq != M_FLASH_EMPTY32) && (p2->seq != M_FLASH_EMPTY32)) {
+        //保存回数で比較する(時刻は戻ることがある)
+        return (p1->seq > p2->seq) ? SEC_BLOCK1 : SEC_BLOCK2;
     }
-    else {
-        if (p1->update_time > p2->update_time) {
-            //blk1の方が新しい
-            DBG_PRINTF("[%s()] erase new blk1\n", __func__);
-            sec = SEC_BLOCK1;
+    //どちらかが履歴追加前の形式(seqが0xffffffff)
+    return (p1->update_time > p2->update_time) ? SEC_BLOCK1 : SEC_BLOCK2;
+}
+
+
+/** block locatorの履歴を間引く
+ * 
+ * 新しい方からM_BLK_DENSE回分は全部残し、それより古いものは
+ * 保存回数の差が[2^n, 2^(n+1))の範囲ごとに最も古い1件だけを残す。
+ * 
+ * @param[in,out]   pHistory    履歴(新しい順)
+ * @param[in]       Num         pHistory[]の件数
+ * @param[in]       Seq         現在の保存回数
+ * @return          間引いた後の件数(最大BC_FLASH_LOCATOR_NUM - 1)
+ */
+static int ICACHE_FLASH_ATTR blk_thin(struct bc_flash_loc_t *pHistory, int Num, uint32_t Seq)
+{
+    int cnt = 0;
+
+    for (int lp = 0; (lp < Num) && (cnt < BC_FLASH_LOCATOR_NUM - 1); lp++) {
+        uint32_t age = Seq - pHistory[lp].seq;
+        if ((age > M_BLK_DENSE) && (lp + 1 < Num) &&
+                (blk_log2(age) == blk_log2(Seq - pHistory[lp + 1].seq))) {
+            //同じ範囲に、より古いものがある
+            continue;
         }
-        else {
-            DBG_PRINTF("[%s()] erase new blk2\n", __func__);
-            sec = SEC_BLOCK2;
+        if (cnt != lp) {
+            MEMCPY(&pHistory[cnt], &pHistory[lp], sizeof(struct bc_flash_loc_t));
         }
+        cnt++;
     }
+    return cnt;
+}
 
-    //有効 or 新しい方を消去
-    spi_flash_erase_sector(sec);
 
-    return 1;
-#else   //__XTENSA__
-    return 0;
-#endif  //__XTENSA__
+/** log2(切り捨て)
+ * 
+ * @param[in]   Val     値(1以上)
+ * @return      log2(Val)
+ */
+static int ICACHE_FLASH_ATTR blk_log2(uint32_t Val)
+{
+    int ret = 0;
+
+    while (Val > 1) {
+        Val >>= 1;
+        ret++;
+    }
+    return ret;
 }
 
 
-/**************************************************************************
- * private functions
- **************************************************************************/
+/** header記録の書込み位置検索
+ * 
+ * seqが最も大きい記録の次を、書込み位置にする。
+ * seqが最も大きい記録はmHdrTipに残す。
+ */
+static void ICACHE_FLASH_ATTR hdr_scan(void)
+{
+    SpiFlashOpResult fret;
+    uint32 buff[sizeof(struct bc_flash_hdr_t) * M_HDR_CHUNK / sizeof(uint32)];
+    const struct bc_flash_hdr_t *p_chunk = (const struct bc_flash_hdr_t *)buff;
+    int newest = -1;
+
+    for (int pos = 0; pos < M_HDR_NUM; pos += M_HDR_CHUNK) {
+        fret = spi_flash_read(
+                (uint32)(SPI_FLASH_SEC_SIZE * (SEC_HDR_START + pos / M_HDR_PER_SEC) +
+                            sizeof(struct bc_flash_hdr_t) * (pos % M_HDR_PER_SEC)),
+                buff,
+                (uint32)sizeof(buff));
+        M_FLASH_OPECHK(fret);
+
+        for (int lp = 0; lp < M_HDR_CHUNK; lp++) {
+            if ((p_chunk[lp].seq != M_FLASH_EMPTY32) && ((newest < 0) || (p_chunk[lp].seq > mHdrTip.seq))) {
+                newest = pos + lp;
+                MEMCPY(&mHdrTip, &p_chunk[lp], sizeof(struct bc_flash_hdr_t));
+            }
+        }
+        system_soft_wdt_feed();
+    }
+
+    mHdrPos = (newest + 1) % M_HDR_NUM;
+    mHdrSeq = (newest < 0) ? 0 : mHdrTip.seq + 1;
+    DBG_PRINTF("[%s()]pos=%d, seq=%u\n", __func__, mHdrPos, mHdrSeq);
+}
+
 
-#ifdef __XTENSA__
 /** TX(a)検索
  * 
  * @param[in,out]   pPos        [in]検索情報, [out]検索結果
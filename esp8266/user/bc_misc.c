@@ -3,10 +3,48 @@
 
 #ifdef __XTENSA__
 #else
+#include <time.h>           //clock_gettime()
 #include <openssl/sha.h>    //SHA256
+#include "bc_sha256.h"
 #endif
 
 
+/**************************************************************************
+ * [common]prototypes
+ **************************************************************************/
+
+static void ICACHE_FLASH_ATTR sha256_header(uint8_t *pHash, const uint8_t *pHeader);
+static void ICACHE_FLASH_ATTR sha256_compress(uint32_t *pState, uint32_t *pW);
+#ifdef __XTENSA__
+static void ICACHE_FLASH_ATTR sha256_start(struct bc_misc_hash256_t *pCtx);
+static void ICACHE_FLASH_ATTR sha256_put(struct bc_misc_hash256_t *pCtx, const uint8_t *pData, size_t Size);
+static void ICACHE_FLASH_ATTR sha256_end(struct bc_misc_hash256_t *pCtx, uint8_t *pHash);
+static void ICACHE_FLASH_ATTR sha256_block(uint32_t *pState, const uint8_t *pBlock);
+#endif  //__XTENSA__
+
+
+/**************************************************************************
+ * [common]const variables
+ **************************************************************************/
+
+/** SHA256の定数 */
+static const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/** SHA256の初期値 */
+static const uint32_t kSha256H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+
 /**************************************************************************
  * [common]public functions
  **************************************************************************/
@@ -34,64 +72,260 @@ void ICACHE_FLASH_ATTR bc_misc_hash256(uint8_t *pHash, const uint8_t *pData, siz
         DBG_PRINTF("hash2 err\n");
     }
 #else
-    SHA256_CTX ctx;
+    bc_sha256_hash256(pHash, pData, Size);
+#endif
+}
+
+
+void ICACHE_FLASH_ATTR bc_misc_hash256_init(struct bc_misc_hash256_t *pCtx)
+{
+#ifdef __XTENSA__
+    sha256_start(pCtx);
+#else
+    SHA256_Init(&pCtx->ctx);
+#endif
+}
+
+
+void ICACHE_FLASH_ATTR bc_misc_hash256_update(struct bc_misc_hash256_t *pCtx, const uint8_t *pData, size_t Size)
+{
+#ifdef __XTENSA__
+    sha256_put(pCtx, pData, Size);
+#else
+    SHA256_Update(&pCtx->ctx, pData, Size);
+#endif
+}
+
+
+void ICACHE_FLASH_ATTR bc_misc_hash256_final(struct bc_misc_hash256_t *pCtx, uint8_t *pHash)
+{
     uint8_t hash1[BC_SZ_HASH256];
 
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, pData, Size);
-    SHA256_Final(hash1, &ctx);
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, hash1, sizeof(hash1));
-    SHA256_Final(pHash, &ctx);
+#ifdef __XTENSA__
+    sha256_end(pCtx, hash1);
+    sha256_start(pCtx);
+    sha256_put(pCtx, hash1, sizeof(hash1));
+    sha256_end(pCtx, pHash);
+#else
+    SHA256_Final(hash1, &pCtx->ctx);
+    SHA256_Init(&pCtx->ctx);
+    SHA256_Update(&pCtx->ctx, hash1, sizeof(hash1));
+    SHA256_Final(pHash, &pCtx->ctx);
+#endif
+}
+
+
+void ICACHE_FLASH_ATTR bc_misc_hash256_header(uint8_t *pHash, const uint8_t *pHeader)
+{
+#ifdef __XTENSA__
+    sha256_header(pHash, pHeader);
+#else
+    //80byte専用にせず、計測して選んだバックエンドで計算する
+    bc_sha256_hash256(pHash, pHeader, BC_SZ_BLOCK_HEADER);
+#endif
+}
+
+
+void ICACHE_FLASH_ATTR bc_misc_hash256_header_c(uint8_t *pHash, const uint8_t *pHeader)
+{
+    sha256_header(pHash, pHeader);
+}
+
+
+void ICACHE_FLASH_ATTR bc_misc_hash256_batch(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num)
+{
+#ifdef __XTENSA__
+    for (int lp = 0; lp < Num; lp++) {
+        if (Size == BC_SZ_BLOCK_HEADER) {
+            sha256_header(pHash, pData);
+        }
+        else {
+            bc_misc_hash256(pHash, pData, Size);
+        }
+        pHash += BC_SZ_HASH256;
+        pData += Stride;
+    }
+#else
+    bc_sha256_hash256_batch(pHash, pData, Size, Stride, Num);
+#endif
+}
+
+
+uint32_t ICACHE_FLASH_ATTR bc_misc_tick(void)
+{
+#ifdef __XTENSA__
+    return system_get_time();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
 #endif
 }
 
 
-void ICACHE_FLASH_ATTR bc_misec_add_varint(uint8_t **pp, uint16_t Len)
+int ICACHE_FLASH_ATTR bc_misc_get_varint(const uint8_t *p, uint64_t *pVal)
+{
+    int len = bc_misc_varint_len(*p);
+
+    if (len == 1) {
+        *pVal = *p;
+    }
+    else {
+        *pVal = 0;
+        MEMCPY(pVal, p + 1, len - 1);       //Little Endian
+    }
+    return len;
+}
+
+
+void ICACHE_FLASH_ATTR bc_misc_add_varint(uint8_t **pp, uint64_t val)
 {
-    if (Len < 0xfd) {
-        bc_misc_add(pp, Len, 1);
+    if (val < 0xfd) {
+        bc_misc_add(pp, val, 1);
     }
-    else if (Len < 0xffff) {
-        uint32_t len2 = (uint32_t)(Len | 0xfd0000);
-        bc_misc_add(pp, len2, 3);
+    else if (val <= 0xffff) {
+        bc_misc_add(pp, 0xfd, 1);
+        bc_misc_add(pp, val, 2);
+    }
+    else if (val <= 0xffffffff) {
+        bc_misc_add(pp, 0xfe, 1);
+        bc_misc_add(pp, val, 4);
     }
     else {
-        //TODO:
-        DBG_PRINTF("string too long!\n");
-        return;
+        bc_misc_add(pp, 0xff, 1);
+        bc_misc_add(pp, val, 8);
     }
 }
 
 
-/** varint長取得
- * 
- * @param[in]   pp          受信データ
- * @parent[out] pLen        verint長
- * @return      解析データ長
- * 
- * @note
- *      - 16bitデータまでしか対応しない
+/**************************************************************************
+ * [common]private functions
+ **************************************************************************/
+
+/** HASH256 : block header(80byte)専用
+ *
+ * 1回目の2ブロック目(header[64..79] + padding)と2回目の入力(32byte + padding)は、
+ * バイト列を作らずにメッセージ(word)として組み立てて圧縮関数に渡す。
+ *
+ * @param[out]      pHash       計算結果(32byte)
+ * @param[in]       pHeader     block header(80byte)
  */
-int ICACHE_FLASH_ATTR bc_misc_get_varint(const uint8_t *p, int *pLen)
+static void ICACHE_FLASH_ATTR sha256_header(uint8_t *pHash, const uint8_t *pHeader)
 {
-    int rlen;
+    uint32_t state[8];
+    uint32_t w[16];
+    const uint8_t *p;
+    int lp;
+
+    //1回目 : 1ブロック目(header[0..63])
+    MEMCPY(state, kSha256H0, sizeof(state));
+    p = pHeader;
+    for (lp = 0; lp < 16; lp++) {
+        w[lp] = GET_BE32(p);
+        p += 4;
+    }
+    sha256_compress(state, w);
 
-    if (*p < 0xfd) {
-        *pLen = *p;
-        rlen = 1;
+    //1回目 : 2ブロック目(header[64..79] + padding, 640bit)
+    for (lp = 0; lp < 4; lp++) {
+        w[lp] = GET_BE32(p);
+        p += 4;
     }
-    else if (*p == 0xfd) {
-        *pLen = *(p + 1) | (*(p + 2) << 8);
-        rlen = 3;
+    w[4] = 0x80000000;
+    MEMSET(&w[5], 0, sizeof(uint32_t) * 10);
+    w[15] = BC_SZ_BLOCK_HEADER * 8;
+    sha256_compress(state, w);
+
+    //2回目 : 1回目の結果 + padding(256bit)
+    MEMCPY(w, state, sizeof(state));
+    w[8] = 0x80000000;
+    MEMSET(&w[9], 0, sizeof(uint32_t) * 6);
+    w[15] = BC_SZ_HASH256 * 8;
+    MEMCPY(state, kSha256H0, sizeof(state));
+    sha256_compress(state, w);
+
+    for (lp = 0; lp < 8; lp++) {
+        pHash[lp * 4 + 0] = (uint8_t)(state[lp] >> 24);
+        pHash[lp * 4 + 1] = (uint8_t)(state[lp] >> 16);
+        pHash[lp * 4 + 2] = (uint8_t)(state[lp] >> 8);
+        pHash[lp * 4 + 3] = (uint8_t)state[lp];
     }
-    else {
-        DBG_PRINTF("too large varint !\n");
-        rlen = 0;
-        return -1;
+}
+
+
+/** SHA256 : 圧縮関数
+ *
+ * 8ラウンドずつ展開し、変数の入れ替えをなくしている。
+ * メッセージスケジュールはpW[]を16wordのリングとして使う。
+ *
+ * @param[in,out]   pState      中間ハッシュ値
+ * @param[in,out]   pW          メッセージ(16word, 計算で壊れる)
+ */
+static void ICACHE_FLASH_ATTR sha256_compress(uint32_t *pState, uint32_t *pW)
+{
+#define ROTR(x,n)       (((x) >> (n)) | ((x) << (32 - (n))))
+#define SIG0(x)         (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIG1(x)         (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define GAM0(x)         (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define GAM1(x)         (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+#define CH(x,y,z)       ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x,y,z)      (((x) & (y)) | ((z) & ((x) | (y))))
+#define SCHED(i)        (pW[(i) & 15] += GAM1(pW[((i) - 2) & 15]) + pW[((i) - 7) & 15] + GAM0(pW[((i) - 15) & 15]))
+#define RND(a,b,c,d,e,f,g,h,i,x)    {   \
+            uint32_t t1 = h + SIG1(e) + CH(e, f, g) + kSha256K[i] + (x);  \
+            d += t1;                    \
+            h = t1 + SIG0(a) + MAJ(a, b, c);  \
+        }
+#define RND8(i,X)   {   \
+            RND(a, b, c, d, e, f, g, h, (i) + 0, X((i) + 0));   \
+            RND(h, a, b, c, d, e, f, g, (i) + 1, X((i) + 1));   \
+            RND(g, h, a, b, c, d, e, f, (i) + 2, X((i) + 2));   \
+            RND(f, g, h, a, b, c, d, e, (i) + 3, X((i) + 3));   \
+            RND(e, f, g, h, a, b, c, d, (i) + 4, X((i) + 4));   \
+            RND(d, e, f, g, h, a, b, c, (i) + 5, X((i) + 5));   \
+            RND(c, d, e, f, g, h, a, b, (i) + 6, X((i) + 6));   \
+            RND(b, c, d, e, f, g, h, a, (i) + 7, X((i) + 7));   \
+        }
+#define MSG(i)          (pW[i])
+
+    uint32_t a = pState[0];
+    uint32_t b = pState[1];
+    uint32_t c = pState[2];
+    uint32_t d = pState[3];
+    uint32_t e = pState[4];
+    uint32_t f = pState[5];
+    uint32_t g = pState[6];
+    uint32_t h = pState[7];
+    int lp;
+
+    for (lp = 0; lp < 16; lp += 8) {
+        RND8(lp, MSG);
+    }
+    for (; lp < 64; lp += 8) {
+        RND8(lp, SCHED);
     }
 
-    return rlen;
+    pState[0] += a;
+    pState[1] += b;
+    pState[2] += c;
+    pState[3] += d;
+    pState[4] += e;
+    pState[5] += f;
+    pState[6] += g;
+    pState[7] += h;
+
+#undef MSG
+#undef RND8
+#undef RND
+#undef SCHED
+#undef MAJ
+#undef CH
+#undef GAM1
+#undef GAM0
+#undef SIG1
+#undef SIG0
+#undef ROTR
 }
 
 
@@ -222,4 +456,104 @@ static void ICACHE_FLASH_ATTR time_update(void *pArg)
     (void)bc_misc_time_get();
 }
 
+
+/** SHA256逐次計算 : 開始
+ *
+ * SDKはsha256_vector()(一括計算)しか公開していないため、逐次計算は自前で行う。
+ *
+ * @param[out]      pCtx        計算状態
+ */
+static void ICACHE_FLASH_ATTR sha256_start(struct bc_misc_hash256_t *pCtx)
+{
+    MEMCPY(pCtx->state, kSha256H0, sizeof(pCtx->state));
+    pCtx->total = 0;
+}
+
+
+/** SHA256逐次計算 : データ追加
+ *
+ * @param[in,out]   pCtx        計算状態
+ * @param[in]       pData       データ
+ * @param[in]       Size        データサイズ
+ */
+static void ICACHE_FLASH_ATTR sha256_put(struct bc_misc_hash256_t *pCtx, const uint8_t *pData, size_t Size)
+{
+    size_t pos = pCtx->total % sizeof(pCtx->buf);
+
+    pCtx->total += Size;
+    if (pos > 0) {
+        //前回の残りを埋める
+        size_t sz = sizeof(pCtx->buf) - pos;
+        if (sz > Size) {
+            sz = Size;
+        }
+        MEMCPY(pCtx->buf + pos, pData, sz);
+        pData += sz;
+        Size -= sz;
+        if (pos + sz < sizeof(pCtx->buf)) {
+            return;
+        }
+        sha256_block(pCtx->state, pCtx->buf);
+    }
+    while (Size >= sizeof(pCtx->buf)) {
+        sha256_block(pCtx->state, pData);
+        pData += sizeof(pCtx->buf);
+        Size -= sizeof(pCtx->buf);
+    }
+    if (Size > 0) {
+        MEMCPY(pCtx->buf, pData, Size);
+    }
+}
+
+
+/** SHA256逐次計算 : 完了
+ *
+ * @param[in,out]   pCtx        計算状態
+ * @param[out]      pHash       計算結果(32byte)
+ */
+static void ICACHE_FLASH_ATTR sha256_end(struct bc_misc_hash256_t *pCtx, uint8_t *pHash)
+{
+    size_t pos = pCtx->total % sizeof(pCtx->buf);
+    uint32_t bits = pCtx->total << 3;
+
+    //padding : 0x80, 0x00..., データ長(bit, Big Endian)
+    pCtx->buf[pos++] = 0x80;
+    if (pos > sizeof(pCtx->buf) - 8) {
+        MEMSET(pCtx->buf + pos, 0, sizeof(pCtx->buf) - pos);
+        sha256_block(pCtx->state, pCtx->buf);
+        pos = 0;
+    }
+    MEMSET(pCtx->buf + pos, 0, sizeof(pCtx->buf) - 4 - pos);
+    pCtx->buf[60] = (uint8_t)(bits >> 24);
+    pCtx->buf[61] = (uint8_t)(bits >> 16);
+    pCtx->buf[62] = (uint8_t)(bits >> 8);
+    pCtx->buf[63] = (uint8_t)bits;
+    pCtx->buf[59] = (uint8_t)(pCtx->total >> 29);
+    sha256_block(pCtx->state, pCtx->buf);
+
+    for (int lp = 0; lp < 8; lp++) {
+        pHash[lp * 4 + 0] = (uint8_t)(pCtx->state[lp] >> 24);
+        pHash[lp * 4 + 1] = (uint8_t)(pCtx->state[lp] >> 16);
+        pHash[lp * 4 + 2] = (uint8_t)(pCtx->state[lp] >> 8);
+        pHash[lp * 4 + 3] = (uint8_t)pCtx->state[lp];
+    }
+}
+
+
+/** SHA256 : 1ブロック(64byte)処理
+ *
+ * @param[in,out]   pState      中間ハッシュ値
+ * @param[in]       pBlock      データ(アラインメント不要)
+ */
+static void ICACHE_FLASH_ATTR sha256_block(uint32_t *pState, const uint8_t *pBlock)
+{
+    uint32_t w[16];
+
+    for (int lp = 0; lp < 16; lp++) {
+        w[lp] = GET_BE32(pBlock);
+        pBlock += 4;
+    }
+    sha256_compress(pState, w);
+}
+
 #endif  //__XTENSA__
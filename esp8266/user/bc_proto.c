@@ -24,19 +24,18 @@
 #include "bc_ope.h"
 #include "bc_proto.h"
 #include "bc_flash.h"
+#include "bc_checkpoint.h"
+#include "bc_codec.h"
 #include "picocoin/bloom.h"
 
 
 /**************************************************************************
  * macros
  **************************************************************************/
-#define SZ_SEND_BUF             (3096)
-
-#define BC_PROTOCOL_VERSION     ((int32_t)70001)
+#define BC_PROTOCOL_VERSION     ((int32_t)70012)
+#define BC_SENDHEADERS_VERSION  ((int32_t)70012)      ///< sendheaders(BIP130)に対応したプロトコルバージョン
 #define BC_MAGIC_TESTNET3       ((uint32_t)0x0709110B)
 #define BC_PORT_TESTNET3        (18333)
-#define BC_CMD_LEN              (12)
-#define BC_CHKSUM_LEN           (4)
 #define BC_VER_UA               "/kumacoinc:0.00/test:0.0/"
 
 //Elements=200, Rate=0.00001で、600バイト程度
@@ -55,7 +54,37 @@
 #define INV_MSG_BLOCK               (2)
 #define INV_MSG_FILTERED_BLOCK      (3)
 
-#define GETDATA_NUM                 (60)            ///< 1回のheadersでgetdataする最大件数
+#define WND_INIT                    (80)            ///< 1roundで1接続に要求するmerkleblock数の初期値
+#define WND_MIN                     (20)            ///< 1roundで1接続に要求するmerkleblock数の最小値
+#define WND_MAX                     (480)           ///< 1roundで1接続に要求するmerkleblock数の最大値
+#define WND_STEP                    (20)            ///< ssthresh以上でwndを増やす量
+#define WND_PRESSURE_CNT            (2)             ///< 送信待ちがこの数以上あれば送信バッファあふれとみなす
+#define SZ_ESP_SEND_BUF             (2920)          ///< ESP8266の送信バッファサイズ(espconn_get_packet_info())
+#define GETDATA_CHUNK               ((SZ_ESP_SEND_BUF - sizeof(struct bc_proto_t) - 1) / sizeof(struct inv_t))  ///< 1回のgetdataメッセージで要求する最大件数(80件)
+
+#ifdef __XTENSA__
+#define HASHQ_NUM                   (500)           ///< 1回のheadersから保持するBlock Hashの最大件数(500件で20KB)
+#else
+#define HASHQ_NUM                   (2000)          ///< 1回のheadersから保持するBlock Hashの最大件数
+#endif
+#define SZ_HASHQ(n)                 ((BC_SZ_HASH256 + sizeof(struct bc_proto_hdrq_t)) * (n))   ///< pHashQ[]とpHdrQ[]をn件ずつ確保するサイズ
+
+#ifndef BITS_POW_LIMIT
+#define BITS_POW_LIMIT              (0x1d00ffff)    ///< testnet3の最低難易度(powLimit)のbits(tools/bc_bench.cはregtestの値でビルドする)
+#endif
+#define RETARGET_FACTOR             (4)             ///< 1回のretargetで難易度が変わる上限(倍)
+#define RETARGET_INTERVAL           (2016)          ///< retargetするblock高さの間隔
+#define POW_LIMIT_SPACING           (20 * 60)       ///< 最低難易度のblockを作れる、前のblockからの間隔(秒, testnet3)
+#define MAX_FUTURE_TIME             (2 * 60 * 60)   ///< 現在時刻より先のtimestampを許す範囲(秒)
+
+#define REPLY_MAX                   (16)            ///< 登録できる受信メッセージ数(#bc_proto_register())
+#define REPLY_CMD_WORDS             (BC_CMD_LEN / 4)    ///< commandを整数で比較する場合のword数
+#define REPLY_UNKNOWN               (0xfe)          ///< 未登録の受信メッセージ(#bc_proto_peer_t.currentProto)
+
+#define SEND_LATER                  (1)             ///< [send_xxx()戻り値]送信バッファに空きがない(送信完了後にやり直す)
+#define SZ_VERSION_PAYLOAD          (4 + 8 + 8 + 26 + 26 + 8 + 1 + 4 + 1)   ///< versionのpayload長(user_agentの文字列を除く)
+#define SZ_GETHEADERS_PAYLOAD(n)    (4 + 1 + BC_SZ_HASH256 * ((n) + 1))     ///< getheadersのpayload長(block locator n件)
+#define CHKSUM_EMPTY                { 0x5d, 0xf6, 0xe0, 0xe2 }              ///< payloadなしのchecksum(hash256("")の先頭4byte)
 
 /** @def    BC_PACKET_LEN()
  *
@@ -63,32 +92,53 @@
  */
 #define BC_PACKET_LEN(pProto)   (sizeof(struct bc_proto_t) + pProto->length)
 
-/** @def    BC_LEN_CHECK()
- *
- * 受信データ長がpayload長を満たしているか
- */
-#define BC_LEN_CHECK(p,l)   \
-    if (l < p.length) {     \
-        DBG_PRINTF("not enough length (%d < %d)\n", l, p.length);   \
-        HALT();                                                     \
-    }
-
 /**************************************************************************
  * types
  **************************************************************************/
-#pragma pack(1)
-/** @struct bc_proto_t
+/** @enum   stage_t
+ *
+ * 受信解析状態(#bc_proto_peer_t.stage)
+ */
+enum stage_t {
+    STAGE0,         //ヘッダ受信前
+    STAGE1,         //ヘッダ受信済み
+    STAGE2,         //ペイロード判定
+    STAGE3          //ペイロード処理
+};
+
+/** @enum   txstage_t
  *
+ * txの解析位置(#bc_proto_txparse_t.stage)
+ */
+enum txstage_t {
+    TX_VERSION,         ///< version
+    TX_IN_COUNT,        ///< tx_in count
+    TX_IN_PREV,         ///< [TxIn]previous_output
+    TX_IN_SCRLEN,       ///< [TxIn]script length
+    TX_IN_SCRIPT,       ///< [TxIn]signature script
+    TX_IN_SEQ,          ///< [TxIn]sequence
+    TX_OUT_COUNT,       ///< tx_out count
+    TX_OUT_VALUE,       ///< [TxOut]value
+    TX_OUT_SCRLEN,      ///< [TxOut]pk_script length
+    TX_OUT_SCRIPT,      ///< [TxOut]pk_script
+    TX_DONE,            ///< 解析完了(lock_timeは見ない)
+};
+
+/** @enum   hdrstate_t
  *
+ * 受信中のheadersの扱い(#bc_proto_sync_t.hdrState)
+ * 受信中は決めるだけで、checksumを照合してから#fin_headers()で処理する。
  */
-struct bc_proto_t {
-    uint32_t    magic;
-    char        command[BC_CMD_LEN];
-    uint32_t    length;
-    uint8_t     checksum[BC_CHKSUM_LEN];
-    uint8_t     payload[0];
+enum hdrstate_t {
+    HDR_NONE,           ///< 受信していない、あるいは処理しないheaders
+    HDR_READ,           ///< pHashQ[]にためている
+    HDR_EMPTY,          ///< countが0だった
+    HDR_REJECT,         ///< 検査に失敗した(batchごと捨てる)
+    HDR_NOCONNECT,      ///< 通知されたheadersがつながらない(getheadersで取得し直す)
+    HDR_GENESIS,        ///< Block#1から返ってきた, あるいはblock locatorにない分岐点から続いている
 };
 
+#pragma pack(1)
 /** @struct net_addr
  *
  *
@@ -124,54 +174,89 @@ struct headers_t {
 };
 #pragma pack()
 
-typedef int (*read_function_t)(struct espconn *pConn, const uint8_t *p, int *pLen);
-
 
 /**************************************************************************
  * prototypes
  **************************************************************************/
-static int ICACHE_FLASH_ATTR send_data(struct espconn *pConn, struct bc_proto_t *pProto);
+static void ICACHE_FLASH_ATTR reply_init(void);
+static inline int ICACHE_FLASH_ATTR reply_cmp(const uint32_t *pCmd1, const uint32_t *pCmd2);
+static uint8_t ICACHE_FLASH_ATTR reply_find(const uint32_t *pCmd);
+static struct bc_proto_t *ICACHE_FLASH_ATTR send_reserve(struct bc_proto_peer_t *pPeer, int Len);
+static int ICACHE_FLASH_ATTR send_data(struct bc_proto_peer_t *pPeer, struct bc_proto_t *pProto);
+static int ICACHE_FLASH_ATTR send_frame(struct bc_proto_peer_t *pPeer, struct bc_proto_t *pProto);
+static int ICACHE_FLASH_ATTR find_magic(const uint8_t *pData, int Len);
 static void ICACHE_FLASH_ATTR set_header(struct bc_proto_t *pProto, const char *pCmd);
 static sint64_t ICACHE_FLASH_ATTR get_current_time(void);
 static void ICACHE_FLASH_ATTR print_time(uint64_t tm);
 
 static void ICACHE_FLASH_ATTR add_netaddr(uint8_t **pp, uint64_t serv, int ip0, int ip1, int ip2, int ip3, uint16_t port);
-static void ICACHE_FLASH_ATTR add_varint(uint8_t **pp, int Len);
 
 static inline int ICACHE_FLASH_ATTR get32(const uint8_t *p, uint32_t *pVal);
-static inline int ICACHE_FLASH_ATTR get64(const uint8_t *p, uint64_t *pVal);
-static int ICACHE_FLASH_ATTR getstr(const uint8_t *p, char *pStr);
 static inline int ICACHE_FLASH_ATTR get_netaddr(const uint8_t *p, struct net_addr_t *pAddr);
-static inline int ICACHE_FLASH_ATTR get_headers(const uint8_t *p, struct headers_t *pHead);
 //static inline int ICACHE_FLASH_ATTR get_inv(const uint8_t *p, struct inv_t *pInv);
 
 static void ICACHE_FLASH_ATTR print_netaddr(const struct net_addr_t *pAddr);
 static void ICACHE_FLASH_ATTR print_inv(const struct inv_t *pInv);
 static void ICACHE_FLASH_ATTR print_headers(const struct headers_t* pHead);
 
-static uint8_t *ICACHE_FLASH_ATTR read_nbyte(const uint8_t *pData, int *pLen, int nByte);
-static int ICACHE_FLASH_ATTR read_varint(const uint8_t *pData, int *pLen, uint64_t *pVal);
-static int ICACHE_FLASH_ATTR read_version(struct espconn *pConn, const uint8_t *p, int *pLen);
-static int ICACHE_FLASH_ATTR read_verack(struct espconn *pConn, const uint8_t *p, int *pLen);
-static int ICACHE_FLASH_ATTR read_ping(struct espconn *pConn, const uint8_t *p, int *pLen);
-static int ICACHE_FLASH_ATTR read_pong(struct espconn *pConn, const uint8_t *p, int *pLen);
-//static int ICACHE_FLASH_ATTR read_addr(struct espconn *pConn, const uint8_t *p, int *pLen);
-static int ICACHE_FLASH_ATTR read_inv(struct espconn *pConn, const uint8_t *p, int *pLen);
-static int ICACHE_FLASH_ATTR read_block(struct espconn *pConn, const uint8_t *p, int *pLen);
-static int ICACHE_FLASH_ATTR read_tx(struct espconn *pConn, const uint8_t *p, int *pLen);
-static int ICACHE_FLASH_ATTR read_headers(struct espconn *pConn, const uint8_t *pData, int *pLen);
-static int ICACHE_FLASH_ATTR read_merkleblock(struct espconn *pConn, const uint8_t *pData, int *pLen);
-static int ICACHE_FLASH_ATTR read_unknown(struct espconn *pConn, const uint8_t *pData, int *pLen);
-
-static int ICACHE_FLASH_ATTR send_version(struct espconn *pConn);
-static int ICACHE_FLASH_ATTR send_verack(struct espconn *pConn);
-//static int ICACHE_FLASH_ATTR send_ping(struct espconn *pConn);
-static int ICACHE_FLASH_ATTR send_pong(struct espconn *pConn, uint64_t Nonce);
-//static int ICACHE_FLASH_ATTR send_getblocks(struct espconn *pConn, const uint8_t *pHash);
-static int ICACHE_FLASH_ATTR send_getheaders(struct espconn *pConn, const uint8_t *pHash);
-//static int ICACHE_FLASH_ATTR send_getdata(struct espconn *pConn, const uint8_t *pInv, int Len);
-static int ICACHE_FLASH_ATTR send_filterload(struct espconn *pConn);
-static int ICACHE_FLASH_ATTR send_mempool(struct espconn *pConn);
+static int ICACHE_FLASH_ATTR read_version(void *pArg, const struct bc_codec_elem_t *pElem);
+static void ICACHE_FLASH_ATTR fin_verack(void *pArg);
+static int ICACHE_FLASH_ATTR read_ping(void *pArg, const struct bc_codec_elem_t *pElem);
+static void ICACHE_FLASH_ATTR fin_ping(void *pArg);
+static int ICACHE_FLASH_ATTR read_pong(void *pArg, const struct bc_codec_elem_t *pElem);
+//static int ICACHE_FLASH_ATTR read_addr(void *pArg, const struct bc_codec_elem_t *pElem);
+static int ICACHE_FLASH_ATTR read_inv(void *pArg, const struct bc_codec_elem_t *pElem);
+static void ICACHE_FLASH_ATTR fin_inv(void *pArg);
+static int ICACHE_FLASH_ATTR read_block(void *pArg, const struct bc_codec_elem_t *pElem);
+static int ICACHE_FLASH_ATTR read_tx(void *pArg, const struct bc_codec_elem_t *pElem);
+static void ICACHE_FLASH_ATTR fin_tx(void *pArg);
+static int ICACHE_FLASH_ATTR tx_gather(struct bc_proto_txparse_t *pTx, const uint8_t **pp, int *pLen, int nByte);
+static int ICACHE_FLASH_ATTR tx_varint(struct bc_proto_txparse_t *pTx, const uint8_t **pp, int *pLen, uint64_t *pVal);
+static int ICACHE_FLASH_ATTR tx_script(struct bc_proto_txparse_t *pTx, const uint8_t **pp, int *pLen);
+static int ICACHE_FLASH_ATTR tx_in_script(struct bc_proto_txparse_t *pTx);
+static int ICACHE_FLASH_ATTR tx_out_script(struct bc_proto_txparse_t *pTx);
+static int ICACHE_FLASH_ATTR read_headers(void *pArg, const struct bc_codec_elem_t *pElem);
+static void ICACHE_FLASH_ATTR fin_headers(void *pArg);
+static void ICACHE_FLASH_ATTR fin_merkleblock(void *pArg);
+static void ICACHE_FLASH_ATTR fin_unknown(void *pArg);
+static void ICACHE_FLASH_ATTR bad_inv(void *pArg);
+static void ICACHE_FLASH_ATTR bad_headers(void *pArg);
+static void ICACHE_FLASH_ATTR bad_merkleblock(void *pArg);
+
+static int ICACHE_FLASH_ATTR sync_join(struct bc_proto_sync_t *pSync, struct bc_proto_peer_t *pPeer);
+static void ICACHE_FLASH_ATTR sync_leave(struct bc_proto_peer_t *pPeer);
+static void ICACHE_FLASH_ATTR sync_reset(struct bc_proto_sync_t *pSync);
+static void ICACHE_FLASH_ATTR sync_free_hashq(struct bc_proto_sync_t *pSync);
+static int ICACHE_FLASH_ATTR sync_request(struct bc_proto_sync_t *pSync);
+static void ICACHE_FLASH_ATTR sync_next(struct bc_proto_sync_t *pSync);
+static int ICACHE_FLASH_ATTR sync_sending(const struct bc_proto_sync_t *pSync);
+static void ICACHE_FLASH_ATTR sync_getheaders(struct bc_proto_sync_t *pSync, const uint8_t *pHash);
+static void ICACHE_FLASH_ATTR sync_finish(struct bc_proto_sync_t *pSync);
+static void ICACHE_FLASH_ATTR sync_sendheaders(struct bc_proto_peer_t *pPeer);
+static void ICACHE_FLASH_ATTR sync_reject_headers(struct bc_proto_sync_t *pSync);
+static void ICACHE_FLASH_ATTR sync_commit(struct bc_proto_sync_t *pSync);
+static void ICACHE_FLASH_ATTR sync_record(struct bc_proto_sync_t *pSync, uint32_t Height, const uint8_t *pBhash, uint32_t Bits, uint32_t Timestamp);
+
+static void ICACHE_FLASH_ATTR hdrchk_reset(struct bc_proto_hdrchk_t *pChk, const uint8_t *pBhash);
+static int ICACHE_FLASH_ATTR hdrchk_verify(struct bc_proto_hdrchk_t *pChk, const struct headers_t *pHead, const uint8_t *pBhash, uint32_t Height, int Trusted);
+static uint32_t ICACHE_FLASH_ATTR hdrchk_median_time(const struct bc_proto_hdrchk_t *pChk);
+static int ICACHE_FLASH_ATTR bits_to_target(uint8_t *pTarget, uint32_t Bits);
+static int ICACHE_FLASH_ATTR bits_in_window(uint32_t Bits, uint32_t Ref);
+static int ICACHE_FLASH_ATTR cmp_uint256(const uint8_t *pA, const uint8_t *pB);
+
+static void ICACHE_FLASH_ATTR wnd_update(struct bc_proto_peer_t *pPeer);
+static void ICACHE_FLASH_ATTR wnd_shrink(struct bc_proto_peer_t *pPeer);
+
+static int ICACHE_FLASH_ATTR send_version(struct bc_proto_peer_t *pPeer);
+static int ICACHE_FLASH_ATTR send_verack(struct bc_proto_peer_t *pPeer);
+//static int ICACHE_FLASH_ATTR send_ping(struct bc_proto_peer_t *pPeer);
+static int ICACHE_FLASH_ATTR send_pong(struct bc_proto_peer_t *pPeer, uint64_t Nonce);
+//static int ICACHE_FLASH_ATTR send_getblocks(struct bc_proto_peer_t *pPeer, const uint8_t *pHash);
+static int ICACHE_FLASH_ATTR send_getheaders(struct bc_proto_peer_t *pPeer, const uint8_t *pHash, const uint8_t *pStop);
+static int ICACHE_FLASH_ATTR send_getdata(struct bc_proto_peer_t *pPeer);
+static int ICACHE_FLASH_ATTR send_filterload(struct bc_proto_peer_t *pPeer);
+static int ICACHE_FLASH_ATTR send_mempool(struct bc_proto_peer_t *pPeer);
+static int ICACHE_FLASH_ATTR send_sendheaders(struct bc_proto_peer_t *pPeer);
 
 
 /**************************************************************************
@@ -192,6 +277,20 @@ const char kCMD_FILTERLOAD[] = "filterload";        ///< [message]filterload
 const char kCMD_TX[] = "tx";                        ///< [message]tx
 const char kCMD_MEMPOOL[] = "mempool";              ///< [message]mempool
 const char kCMD_MERKLEBLOCK[] = "merkleblock";      ///< [message]merkleblock
+const char kCMD_SENDHEADERS[] = "sendheaders";      ///< [message]sendheaders
+
+/** 送信メッセージの雛形(payloadなしはchecksumまで確定済み) */
+static const struct bc_proto_t kFrameVerack = { BC_MAGIC_TESTNET3, "verack", 0, CHKSUM_EMPTY };
+static const struct bc_proto_t kFrameMempool = { BC_MAGIC_TESTNET3, "mempool", 0, CHKSUM_EMPTY };
+static const struct bc_proto_t kFrameSendheaders = { BC_MAGIC_TESTNET3, "sendheaders", 0, CHKSUM_EMPTY };
+static const struct bc_proto_t kFrameGetheaders = { BC_MAGIC_TESTNET3, "getheaders", 0, { 0 } };
+static const struct bc_proto_t kFrameGetdata = { BC_MAGIC_TESTNET3, "getdata", 0, { 0 } };
+
+/** getheadersのpayload先頭(version) */
+static const uint8_t kGetheadersPrefix[] = {
+    (uint8_t)BC_PROTOCOL_VERSION, (uint8_t)(BC_PROTOCOL_VERSION >> 8),
+    (uint8_t)(BC_PROTOCOL_VERSION >> 16), (uint8_t)(BC_PROTOCOL_VERSION >> 24),
+};
 
 //Genesis Hash
 //000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943
@@ -210,278 +309,437 @@ const uint8_t kBhash1[] = {
     0x97, 0xe7, 0x73, 0xb8, 0x00, 0x00, 0x00, 0x00, 
 };
 
-/** 受信解析用 */
+/** payload定義(version) */
+static const struct bc_codec_field_t kFieldVersion[] = {
+    {   BC_CODEC_U32,       0,                          read_version    },  //version
+    {   BC_CODEC_U64,       0,                          read_version    },  //services
+    {   BC_CODEC_U64,       0,                          read_version    },  //timestamp
+    {   BC_CODEC_FIXED,     sizeof(struct net_addr_t),  read_version    },  //addr_recv
+    {   BC_CODEC_FIXED,     sizeof(struct net_addr_t),  read_version    },  //addr_from
+    {   BC_CODEC_U64,       0,                          read_version    },  //nonce
+    {   BC_CODEC_VARBYTES,  0,                          read_version    },  //user_agent
+    {   BC_CODEC_U32,       0,                          read_version    },  //start_height
+    {   BC_CODEC_U8,        0,                          read_version    },  //relay
+};
+
+/** payload定義(ping) */
+static const struct bc_codec_field_t kFieldPing[] = {
+    {   BC_CODEC_U64,       0,                          read_ping       },  //nonce
+};
+
+/** payload定義(pong) */
+static const struct bc_codec_field_t kFieldPong[] = {
+    {   BC_CODEC_U64,       0,                          read_pong       },  //nonce
+};
+
+//addrはnet_addrの前にtimestampがつく
+//static const struct bc_codec_field_t kFieldAddr[] = {
+//    {   BC_CODEC_VARARRAY,  sizeof(uint32_t) + sizeof(struct net_addr_t),  read_addr   },  //addr_list
+//};
+
+/** payload定義(inv) */
+static const struct bc_codec_field_t kFieldInv[] = {
+    {   BC_CODEC_VARARRAY,  sizeof(struct inv_t),       read_inv        },  //inventory
+};
+
+/** payload定義(headers) */
+static const struct bc_codec_field_t kFieldHeaders[] = {
+    {   BC_CODEC_VARARRAY,  sizeof(struct headers_t),   read_headers    },  //headers
+};
+
+/** payload定義(merkleblock) : 中身は見ない */
+static const struct bc_codec_field_t kFieldMerkleblock[] = {
+    {   BC_CODEC_FIXED,     sizeof(struct headers_t) - 1,   NULL        },  //block header
+    {   BC_CODEC_U32,       0,                          NULL            },  //total_transactions
+    {   BC_CODEC_VARARRAY,  BC_SZ_HASH256,              NULL            },  //hashes
+    {   BC_CODEC_VARBYTES,  0,                          NULL            },  //flags
+};
+
+/** payload定義(tx) : ためずに受信した分ずつ解析する */
+static const struct bc_codec_field_t kFieldTx[] = {
+    {   BC_CODEC_REST,      0,                          read_tx         },
+};
+
+/** payload定義(block) */
+static const struct bc_codec_field_t kFieldBlock[] = {
+    {   BC_CODEC_FIXED,     sizeof(struct headers_t) - 1,   read_block  },  //block header
+    {   BC_CODEC_VARINT,    0,                          read_block      },  //txn_count
+    {   BC_CODEC_REST,      0,                          NULL            },  //txns
+};
+
+/** payload定義(未処理) */
+static const struct bc_codec_field_t kFieldUnknown[] = {
+    {   BC_CODEC_REST,      0,                          NULL            },
+};
+
+/** 受信解析用
+ *
+ * payloadをどのように分割して受信しても、#bc_codec_decode()が解析する。
+ * 送信やFLASHへの記録はchecksumを照合してから完了コールバック(fin_xxx())で行う。
+ * checksumが一致しなかったメッセージは完了コールバックを呼ばず、受信中の内容をbad_xxx()で取り消す。
+ */
 static const struct {
-    const char          *pCmd;                  ///< メッセージ
-    read_function_t     pFunc;                  ///< 処理関数
-    int                 longPayload;            /**< 1:long payload対応
-                                                 *      payload長があまり長くないと思われるメッセージは、
-                                                 *      MALLOC()で動的にメモリを確保してでも一度に処理する。
-                                                 *      あらかじめpayload長が長くなると思われるメッセージは、
-                                                 *      各処理関数内で何度も受信が呼び出されることを想定した
-                                                 *      実装を行う。
-                                                 */
+    const char              *pCmd;              ///< メッセージ
+    struct bc_codec_msg_t   msg;                ///< payload定義
 } kReplyFunc[] = {
-    {   kCMD_PING,              read_ping,          0   },
-    {   kCMD_HEADERS,           read_headers,       1   },
-    {   kCMD_MERKLEBLOCK,       read_merkleblock,   1   },
-    {   kCMD_INV,               read_inv,           1   },
-    {   kCMD_TX,                read_tx,            0   },
-    {   kCMD_BLOCK,             read_block,         0   },
-    {   kCMD_PONG,              read_pong,          0   },
-//    {   kCMD_ADDR,              read_addr,          0   },
-    {   kCMD_VERSION,           read_version,       0   },
-    {   kCMD_VERACK,            read_verack,        0   },
-    {   NULL,                   read_unknown,       1   },
+    {   kCMD_PING,          { kFieldPing,           ARRAY_SIZE(kFieldPing),         fin_ping,       NULL            }   },
+    {   kCMD_HEADERS,       { kFieldHeaders,        ARRAY_SIZE(kFieldHeaders),      fin_headers,    bad_headers     }   },
+    {   kCMD_MERKLEBLOCK,   { kFieldMerkleblock,    ARRAY_SIZE(kFieldMerkleblock),  fin_merkleblock,    bad_merkleblock }   },
+    {   kCMD_INV,           { kFieldInv,            ARRAY_SIZE(kFieldInv),          fin_inv,        bad_inv         }   },
+    {   kCMD_TX,            { kFieldTx,             ARRAY_SIZE(kFieldTx),           fin_tx,         NULL            }   },
+    {   kCMD_BLOCK,         { kFieldBlock,          ARRAY_SIZE(kFieldBlock),        NULL,           NULL            }   },
+    {   kCMD_PONG,          { kFieldPong,           ARRAY_SIZE(kFieldPong),         NULL,           NULL            }   },
+//    {   kCMD_ADDR,          { kFieldAddr,           ARRAY_SIZE(kFieldAddr),         NULL,           NULL            }   },
+    {   kCMD_VERSION,       { kFieldVersion,        ARRAY_SIZE(kFieldVersion),      NULL,           NULL            }   },
+    {   kCMD_VERACK,        { NULL,                 0,                              fin_verack,     NULL            }   },
+};
+
+/** 受信解析用(未登録のメッセージ) */
+static const struct bc_codec_msg_t kMsgUnknown = {
+    kFieldUnknown,  ARRAY_SIZE(kFieldUnknown),  fin_unknown,    NULL
 };
 
 
 /**************************************************************************
  * private variables
  **************************************************************************/
-static uint8_t mBufferCnt = 0;                  /**< 送信要求数 */
-static uint8_t mMerkleCnt = 0;                  /**< getheaders-->headers-->getdata後のmerkleblock数(カウントダウン) */
-static uint8_t mCurrentProto = 0xff;            /**< 現在処理中の受信メッセージ */
-static uint8_t mBuffer[SZ_SEND_BUF];            /**< 送信バッファ
-                                                 *      espconn_send()は送信バッファにためていき、
-                                                 *      送信は非同期で行われる。
-                                                 *      しかし、送信完了コールバックが来るまでは
-                                                 *      espconn_send()を呼び出してもうまく動かない(エラーにはならない)。
-                                                 *      そのため、送信完了コールバックが来るまでの送信を
-                                                 *      このバッファにためる。
-                                                 */
-static uint8_t *mBufferWPnt = mBuffer;          /**< 送信データ書込みポイント */
-static uint8_t *mBufferRPnt = mBuffer;          /**< 送信データ読込みポイント */
-static uint8_t mLastHeadersBhash[BC_SZ_HASH256] __attribute__ ((aligned (4)));  /**< headersで最後に読んだBlock Hash */
-static uint8_t mLastInvBhash[BC_SZ_HASH256] __attribute__ ((aligned (4)));      /**< invで最後に読んだBlock Hash
-                                                                                 *      getheadersで使用する。
-                                                                                 *      MSG_BLOCKで更新したか判定するため、
-                                                                                 *      最後の要素を0xffにしておく。
-                                                                                 */
-static struct bc_proto_t    mProto;             /**< 現在処理中のプロトコルヘッダ */
-static uint8_t *mpPayload = NULL;               /**< getdataメッセージのペイロード(mBufferWPnt内)
-                                                 *      read_inv(), read_headers()用
-                                                 */
-
-static int8_t mStatus = -1;                     /**< TODO:用途を決め切れてないフラグ */
-                                                //0: 送信完了時にgetheadersを投げ、1にする
-                                                //1: getheaders中。全部投げてmempool投げると同時に2にする
-static int8_t mHasPing = 0;                     /**< 0:ping受信あり */
-static uint64_t mPingNonce;                     /**< 最後に受信したpingのnonce */
+
+/** 受信メッセージの解析定義(#bc_proto_register())
+ *
+ * commandを4byteずつの整数として比較できるようにし、昇順に並べて二分探索する。
+ */
+static struct {
+    uint32_t                        cmd[REPLY_CMD_WORDS];   ///< command(0x00埋め)
+    const struct bc_codec_msg_t     *pMsg;                  ///< payload定義
+} mReply[REPLY_MAX];
+static uint8_t      mReplyNum;                  ///< mReply[]の登録数
+static uint8_t      mReplyInit;                 ///< 1:kReplyFunc[]を登録済み
 
 
 /**************************************************************************
  * public functions
  **************************************************************************/
-int ICACHE_FLASH_ATTR bc_start(struct espconn *pConn)
+int ICACHE_FLASH_ATTR bc_start(struct bc_proto_peer_t *pPeer, struct espconn *pConn, struct bc_proto_sync_t *pSync)
 {
     DBG_FUNCNAME();
 
+    reply_init();
+
+    MEMSET(pPeer, 0, sizeof(struct bc_proto_peer_t));
+    pPeer->pConn = pConn;
+    pPeer->stage = STAGE0;
+    pPeer->currentProto = 0xff;
+    pPeer->pBufferWPnt = pPeer->buffer;
+    pPeer->pBufferRPnt = pPeer->buffer;
+    pPeer->status = -1;
+    pPeer->wnd = WND_INIT;
+    pPeer->ssthresh = WND_MAX;
+
+    if (pSync == NULL) {
+        //単独で同期する
+        pSync = &pPeer->single;
+    }
+    if (!sync_join(pSync, pPeer)) {
+        DBG_PRINTF("[%s()]sync peer full\n", __func__);
+        return -1;
+    }
+
     bc_flash_update_txinfo(BC_FLASH_TYPE_FLASH, NULL);
 
     //末尾に0x00以外を書込んでおく(read_headersでの更新判定のため)
-    mLastHeadersBhash[BC_SZ_HASH256 - 1] = 0xff;
+    pPeer->lastHeadersBhash[BC_SZ_HASH256 - 1] = 0xff;
     //末尾に0x00以外を書込んでおく(read_invでの更新判定のため)
-    mLastInvBhash[BC_SZ_HASH256 - 1] = 0xff;
+    pPeer->lastInvBhash[BC_SZ_HASH256 - 1] = 0xff;
 
-    return send_version(pConn);
+    return send_version(pPeer);
 }
 
 
-void ICACHE_FLASH_ATTR bc_read_message(struct espconn *pConn, const uint8_t *pBuffer, int *pLen)
+void ICACHE_FLASH_ATTR bc_read_message(struct bc_proto_peer_t *pPeer, const uint8_t *pBuffer, int *pLen)
 {
-    static enum {
-        STAGE0,         //ヘッダ受信前
-        STAGE1,         //ヘッダ受信済み
-        STAGE2,         //ペイロード判定
-        STAGE2_5,       //ペイロード受信(longPayload非対応かつ受信済みが小さい場合)
-        STAGE3          //ペイロード処理
-    } sStage = STAGE0;
-    static uint8_t sProtoLen;           //mProtoに詰めたデータ長(Stage0の受信不足かStage1のMAGIC不正)
-    static uint8_t *spBuffer = NULL;
-
-    int ret;
+    int len;
 
     //DBG_FUNCNAME();
 
-    switch (sStage) {
-    case STAGE0:
-        //DBG_PRINTF("*** STAGE 0 ***[sProtoLen=%d]\n", sProtoLen);
-        //DBG_PRINTF("0");
-        //ヘッダ分以上のサイズがあるならヘッダだけ、それ未満なら全部読込む
-        if (sProtoLen + *pLen >= sizeof(struct bc_proto_t)) {
-            MEMCPY((uint8_t *)&mProto + sProtoLen, pBuffer, sizeof(struct bc_proto_t) - sProtoLen);
-            sStage = STAGE1;
-        }
-        else {
-            //受信不足
-            MEMCPY((uint8_t *)&mProto + sProtoLen, pBuffer, *pLen);
-            sProtoLen += *pLen;
-            *pLen = 0;
-//            DBG_PRINTF("[%s()]  ... more read ...\n", __func__);
-//            for (int lp = 0; lp < sProtoLen; lp++) {
-//                DBG_PRINTF("%02x", *((uint8_t *)&mProto + lp));
-//            }
-//            DBG_PRINTF("\n");
-        }
-        break;
-
-    case STAGE1:
-        //DBG_PRINTF("*** STAGE 1 ***\n");
-        //DBG_PRINTF("1");
-        if (mProto.magic == BC_MAGIC_TESTNET3) {
-            //DBG_PRINTF("  magic : %08x\n", mProto.magic);
-            //DBG_PRINTF("  cmd   : %s\n", mProto.command);
-            //DBG_PRINTF("  len   : %d\n", mProto.length);
-            //DBG_PRINTF("  hash  : %02x %02x %02x %02x\n", mProto.length.checksum[0], mProto.length.checksum[1], mProto.length.checksum[2], mProto.length.checksum[3]);
-
-            sStage = STAGE2;
-            *pLen -= sizeof(struct bc_proto_t) - sProtoLen;
-            sProtoLen = 0;
-        }
-        else {
-            DBG_PRINTF("[%s()]  invalid magic(%08x)\n", __func__, mProto.magic);
-            for (int lp = 0; lp < *pLen; lp++) {
-                DBG_PRINTF("%02x ", mBuffer[lp]);
+    //受信データを使い切るまで処理する
+    do {
+        switch (pPeer->stage) {
+        case STAGE0:
+            //DBG_PRINTF("*** STAGE 0 ***[pPeer->protoLen=%d]\n", pPeer->protoLen);
+            if (pPeer->resync && (pPeer->protoLen == 0)) {
+                //MAGICの候補まで読み捨てる
+                len = find_magic(pBuffer, *pLen);
+                pPeer->resyncSkip += len;
+                pBuffer += len;
+                *pLen -= len;
+                if (*pLen == 0) {
+                    break;
+                }
             }
-            DBG_PRINTF("\n");
-
-            //不一致 --> 1byte詰める
-            sProtoLen = sizeof(struct bc_proto_t) - 1;
-            MEMMOVE(&mProto, (uint8_t *)&mProto + 1, sProtoLen);
-            (*pLen)--;
-            sStage = STAGE0;
-        }
-        break;
-
-    case STAGE2:
-        //DBG_PRINTF("*** STAGE 2 ***\n");
-        //DBG_PRINTF("2");
-        mCurrentProto = 0;
-        while (kReplyFunc[mCurrentProto].pCmd != NULL) {
-            if (STRCMP(mProto.command, kReplyFunc[mCurrentProto].pCmd) == 0) {
+            //ヘッダ分だけ読込む
+            len = sizeof(struct bc_proto_t) - pPeer->protoLen;
+            if (len > *pLen) {
+                len = *pLen;
+            }
+            MEMCPY((uint8_t *)&pPeer->proto + pPeer->protoLen, pBuffer, len);
+            pPeer->protoLen += len;
+            pBuffer += len;
+            *pLen -= len;
+            if (pPeer->protoLen < sizeof(struct bc_proto_t)) {
+                //受信不足
                 break;
             }
-            mCurrentProto++;
-        }
-        if ((kReplyFunc[mCurrentProto].longPayload == 0) &&
-          (mProto.length > *pLen)) {
-            //longPayload非対応で、受信済みサイズがペイロード長よりも短い
-            spBuffer = read_nbyte(pBuffer, pLen, mProto.length);
-            sStage = STAGE2_5;
-            DBG_PRINTF("*** STAGE 2 --> 2.5 *** : spBuffer=%p\n", spBuffer);
-        }
-        else {
-            spBuffer = NULL;
-            sStage = STAGE3;
-        }
-        break;
-
-    case STAGE2_5:
-        DBG_PRINTF("*** STAGE 2.5 *** : spBuffer=%p\n", spBuffer);
-        if (spBuffer == NULL) {
-            spBuffer = read_nbyte(pBuffer, pLen, mProto.length);
-        }
-        if (spBuffer != NULL) {
-            DBG_PRINTF("*** STAGE 2.5 --> analyze ***\n");
-//            for (int lp = 0; lp < mProto.length; lp++) {
-//                DBG_PRINTF("%02x ", spBuffer[lp]);
-//            }
-//            DBG_PRINTF("\n");
-            //解析は1回で終了する
-            int len = mProto.length;
-            (void)((*kReplyFunc[mCurrentProto].pFunc)(pConn, spBuffer, &len));
-            FREE(spBuffer);
-            spBuffer = NULL;
-            sStage = STAGE0;
-        }
-        break;
+            pPeer->stage = STAGE1;
+            //no break
+
+        case STAGE1:
+            //DBG_PRINTF("*** STAGE 1 ***\n");
+            if (pPeer->proto.magic != BC_MAGIC_TESTNET3) {
+                if (!pPeer->resync) {
+                    DBG_PRINTF("[%s()]  invalid magic(%08x)\n", __func__, pPeer->proto.magic);
+                    pPeer->resync = 1;
+                    pPeer->resyncSkip = 0;
+                    pPeer->resyncCnt++;
+                }
+
+                //受信済みのヘッダ内からMAGICの候補を探して詰める(なければ受信データから探す)
+                uint8_t *p_proto = (uint8_t *)&pPeer->proto;
+                len = 1 + find_magic(p_proto + 1, sizeof(struct bc_proto_t) - 1);
+                pPeer->protoLen = sizeof(struct bc_proto_t) - len;
+                MEMMOVE(p_proto, p_proto + len, pPeer->protoLen);
+                pPeer->resyncSkip += len;
+                pPeer->stage = STAGE0;
+                break;
+            }
+            if (pPeer->resync) {
+                DBG_PRINTF("[%s()]  resync(skip %u bytes)\n", __func__, pPeer->resyncSkip);
+                pPeer->resync = 0;
+            }
+            //DBG_PRINTF("  cmd   : %s\n", pPeer->proto.command);
+            //DBG_PRINTF("  len   : %d\n", pPeer->proto.length);
+            pPeer->protoLen = 0;
+            pPeer->stage = STAGE2;
+            //no break
+
+        case STAGE2:
+            //DBG_PRINTF("*** STAGE 2 ***\n");
+            pPeer->currentProto = reply_find((const uint32_t *)pPeer->proto.command);
+            bc_codec_start(&pPeer->codec,
+                        (pPeer->currentProto != REPLY_UNKNOWN) ? mReply[pPeer->currentProto].pMsg : &kMsgUnknown,
+                        pPeer->proto.length, pPeer->proto.checksum, pPeer);
+            pPeer->stage = STAGE3;
+            //no break (payload長0でも完了させる)
+
+        case STAGE3:
+            //DBG_PRINTF("*** STAGE 3 *** : <<<< length:%d >>>>\n", *pLen);
+            len = *pLen;
+            if (bc_codec_decode(&pPeer->codec, pBuffer, pLen) == BC_CODEC_FIN) {
+                //解析完了
+                if (pPeer->codec.bad) {
+                    //メッセージは読み捨てた
+                    pPeer->checksumErr++;
+                }
+                pPeer->stage = STAGE0;
+                pPeer->currentProto = 0xff;
+            }
+            pBuffer += len - *pLen;
+            break;
 
-    case STAGE3:
-        //DBG_PRINTF("*** STAGE 3 *** : <<<< length:%d >>>>\n", *pLen);
-        //DBG_PRINTF("3");
-        ret = (*kReplyFunc[mCurrentProto].pFunc)(pConn, pBuffer, pLen);
-        if (ret == BC_PROTO_FIN) {
-            //解析完了
-            sStage = STAGE0;
-            mCurrentProto = 0xff;
-            //DBG_PRINTF("  <<< fin >>>\n\n");
-            //DBG_PRINTF(";");
-        }
-        else {
-            //解析継続あり
-            //DBG_PRINTF("  <<< cont >>>\n\n");
+        default:
+            DBG_PRINTF("invalid stage : %d\n", (int)pPeer->stage);
+            HALT();
+            break;
         }
-        break;
-
-    default:
-        DBG_PRINTF("invalid stage : %d\n", (int)sStage);
-        HALT();
-        break;
-    }
+    } while (*pLen > 0);
 }
 
 
-void ICACHE_FLASH_ATTR bc_sent(struct espconn *pConn, uint16_t sent_length)
+void ICACHE_FLASH_ATTR bc_sent(struct bc_proto_peer_t *pPeer, uint16_t sent_length)
 {
-    DBG_PRINTF("\n[%s(%u)]mBufferCnt=%d, sent_length=%u\n", __func__, bc_misc_time_get(), mBufferCnt, sent_length);
+    DBG_PRINTF("\n[%s(%u)]bufferCnt=%d, sent_length=%u\n", __func__, bc_misc_time_get(), pPeer->bufferCnt, sent_length);
 
-    if (mBufferCnt) {
-        const struct bc_proto_t *pProto = (const struct bc_proto_t *)mBufferRPnt;
-        int ret = espconn_send(pConn, mBufferRPnt, BC_PACKET_LEN(pProto));
-        if (ret == 0) {
-            mBufferRPnt += BC_PACKET_LEN(pProto);
-            mBufferCnt--;
+    if (pPeer->bufferCnt) {
+        if ((pPeer->bufferCnt >= WND_PRESSURE_CNT) && !pPeer->wndCut) {
+            //送信がたまっている --> 要求を減らす
+            wnd_shrink(pPeer);
+            pPeer->wndCut = 1;
+        }
+
+        if (pPeer->pBufferRPnt == pPeer->pBufferEnd) {
+            //折り返し
+            pPeer->pBufferRPnt = pPeer->buffer;
+            pPeer->pBufferEnd = NULL;
+        }
 
-            if (mBufferCnt == 0) {
-                //DBG_PRINTF("[%s()] buff init\n", __func__);
-                mBufferRPnt = mBuffer;
-                mBufferWPnt = mBuffer;
+        //ESP8266の送信バッファに入る分だけ、連続している送信待ちをまとめる
+        const uint8_t *p_end = (pPeer->pBufferEnd != NULL) ? pPeer->pBufferEnd : pPeer->pBufferWPnt;
+        int len = 0;
+        int cnt = 0;
+        while ((cnt < pPeer->bufferCnt) && (pPeer->pBufferRPnt + len < p_end)) {
+            const struct bc_proto_t *pProto = (const struct bc_proto_t *)(pPeer->pBufferRPnt + len);
+            if ((cnt > 0) && (len + BC_PACKET_LEN(pProto) > SZ_ESP_SEND_BUF)) {
+                break;
             }
+            len += BC_PACKET_LEN(pProto);
+            cnt++;
+        }
+        int ret = espconn_send(pPeer->pConn, pPeer->pBufferRPnt, len);
+        if (ret == 0) {
+            DBG_PRINTF("[%s()]send %d frames(len=%d)\n", __func__, cnt, len);
+            pPeer->pBufferRPnt += len;
+            pPeer->bufferCnt -= cnt;
+            pPeer->sendCalls++;
+            pPeer->sendFrames += cnt;
         }
         else {
+            //送信できなかった --> 次の送信完了で再送する
             DBG_PRINTF("[%s()]ret = %d\n", __func__, ret);
-            HALT();
         }
     }
     else {
-        //DBG_PRINTF("mBufferCnt : 0\n");
+        //DBG_PRINTF("bufferCnt : 0\n");
 
-        if (mStatus == 0) {
+        if (pPeer->hasVerack) {
+            //送信バッファの空き待ちだったverack
+            if (send_verack(pPeer) != SEND_LATER) {
+                pPeer->hasVerack = 0;
+            }
+        }
+        else if (pPeer->hasFilterload) {
+            //送信バッファの空き待ちだったfilterload
+            if (send_filterload(pPeer) != SEND_LATER) {
+                pPeer->hasFilterload = 0;
+                //getdataを受け持てるようになった
+                sync_next(pPeer->pSync);
+            }
+        }
+        else if (pPeer->status == 0) {
             //初回のgetheaders送信
-            mStatus = 1;
+            pPeer->status = 1;
             uint8_t hash[BC_SZ_HASH256];
             bc_flash_get_last_bhash(hash);
-            send_getheaders(pConn, hash);
+            sync_getheaders(pPeer->pSync, hash);
         }
         else {
-            if ((mHasPing) && (mpPayload == NULL)) {
+            struct bc_proto_sync_t *pSync = pPeer->pSync;
+
+            if ((pPeer->hasPing) && (pPeer->pPayload == NULL)) {
                 //ping受信済みで、Long Payloadの処理をしていないとき
-                send_pong(pConn, mPingNonce);
-                mHasPing = 0;
+                if (send_pong(pPeer, pPeer->pingNonce) != SEND_LATER) {
+                    pPeer->hasPing = 0;
+                }
+            }
+            else if ((pSync->headersLater) && (pSync->pHeaderPeer == pPeer) && (pPeer->pPayload == NULL)) {
+                //送信バッファの空き待ちだったgetheaders
+                const uint8_t *p_stop = (pSync->laterStop) ? pSync->stopBhash[pSync->stopPos - 1] : NULL;
+                if (send_getheaders(pPeer, pSync->laterBhash, p_stop) != SEND_LATER) {
+                    pSync->headersLater = 0;
+                }
+            }
+            else if ((pPeer->hasMempool) && (pPeer->pPayload == NULL)) {
+                //送信バッファの空き待ちだったmempool
+                if (send_mempool(pPeer) != SEND_LATER) {
+                    pPeer->hasMempool = 0;
+                }
+            }
+            else if ((pPeer->hasSendheaders) && (pPeer->pPayload == NULL)) {
+                //送信バッファの空き待ちだったsendheaders
+                if (send_sendheaders(pPeer) != SEND_LATER) {
+                    pPeer->hasSendheaders = 0;
+                }
+            }
+            else if ((pPeer->getdataRest > 0) && (pPeer->pPayload == NULL)) {
+                //分割したgetdataの続き
+                send_getdata(pPeer);
+                if (pPeer->getdataRest == 0) {
+                    //送信し終わった --> 次のroundを受け持てる
+                    sync_next(pPeer->pSync);
+                }
             }
         }
     }
 }
 
 
-void ICACHE_FLASH_ATTR bc_finish(void)
+void ICACHE_FLASH_ATTR bc_finish(struct bc_proto_peer_t *pPeer)
 {
     DBG_FUNCNAME();
 
-    if (mStatus == 1) {
-        //FLASHの初期処理中であれば、現状を保持する
-        if (mLastHeadersBhash[BC_SZ_HASH256 - 1] != 0xff) {
+    struct bc_proto_sync_t *pSync = pPeer->pSync;
+    if (pSync == NULL) {
+        //開始していない
+        return;
+    }
+
+    if ((pPeer->status == 1) && (pSync->pHeaderPeer == pPeer)) {
+        //FLASHの初期処理中であれば、merkleblockがそろったところまでを保持する
+        if (pSync->bhash[BC_SZ_HASH256 - 1] != 0xff) {
             DBG_PRINTF("save current block : ");
             for (int i = 0; i < BC_SZ_HASH256; i++) {
-                DBG_PRINTF("%02x", mLastHeadersBhash[BC_SZ_HASH256 - i - 1]);
+                DBG_PRINTF("%02x", pSync->bhash[BC_SZ_HASH256 - i - 1]);
             }
             DBG_PRINTF("\n");
-            bc_flash_save_last_bhash(mLastHeadersBhash);
-            mLastHeadersBhash[BC_SZ_HASH256 - 1] = 0xff;
+            bc_flash_save_last_bhash(pSync->bhash);
+            pSync->bhash[BC_SZ_HASH256 - 1] = 0xff;
         }
-        mStatus = -1;
+        bc_flash_hdr_flush();
     }
+    sync_leave(pPeer);
+    pPeer->status = -1;
+}
+
+
+int ICACHE_FLASH_ATTR bc_proto_register(const char *pCmd, const struct bc_codec_msg_t *pMsg)
+{
+    uint32_t cmd[REPLY_CMD_WORDS];
+    int lp;
+
+    reply_init();
+
+    if (STRLEN(pCmd) > BC_CMD_LEN) {
+        DBG_PRINTF("[%s()]too long command(%s)\n", __func__, pCmd);
+        return -1;
+    }
+    MEMSET(cmd, 0, sizeof(cmd));
+    MEMCPY(cmd, pCmd, STRLEN(pCmd));
+
+    //挿入位置(登録済みなら置き換える)
+    for (lp = 0; lp < mReplyNum; lp++) {
+        int cmp = reply_cmp(cmd, mReply[lp].cmd);
+        if (cmp == 0) {
+            mReply[lp].pMsg = pMsg;
+            return 0;
+        }
+        if (cmp < 0) {
+            break;
+        }
+    }
+    if (mReplyNum >= REPLY_MAX) {
+        DBG_PRINTF("[%s()]reply full(%s)\n", __func__, pCmd);
+        return -1;
+    }
+    MEMMOVE(&mReply[lp + 1], &mReply[lp], sizeof(mReply[0]) * (mReplyNum - lp));
+    MEMCPY(mReply[lp].cmd, cmd, sizeof(cmd));
+    mReply[lp].pMsg = pMsg;
+    mReplyNum++;
+
+    return 0;
+}
+
+
+void ICACHE_FLASH_ATTR bc_proto_get_stats(const struct bc_proto_peer_t *pPeer, struct bc_proto_stats_t *pStats)
+{
+    pStats->window = pPeer->wnd;
+    pStats->ssthresh = pPeer->ssthresh;
+    pStats->blocksPerSec = pPeer->rate;
+    pStats->blocks = pPeer->merkleTotal;
+    pStats->checksumErrors = pPeer->checksumErr;
+    pStats->resyncs = pPeer->resyncCnt;
+    pStats->headersRejected = pPeer->headersBad;
+    pStats->height = (pPeer->pSync != NULL) ? pPeer->pSync->height : 0;
+    pStats->sendDeferred = pPeer->sendLaterCnt;
+    pStats->sendCalls = pPeer->sendCalls;
+    pStats->sendFrames = pPeer->sendFrames;
 }
 
 
@@ -489,6 +747,66 @@ void ICACHE_FLASH_ATTR bc_finish(void)
  * private functions
  **************************************************************************/
 
+/** 受信メッセージ : kReplyFunc[]登録
+ *
+ * 最初の#bc_start()か#bc_proto_register()で1回だけ行う。
+ */
+static void ICACHE_FLASH_ATTR reply_init(void)
+{
+    if (mReplyInit) {
+        return;
+    }
+    mReplyInit = 1;
+    for (int lp = 0; lp < (int)ARRAY_SIZE(kReplyFunc); lp++) {
+        bc_proto_register(kReplyFunc[lp].pCmd, &kReplyFunc[lp].msg);
+    }
+}
+
+
+/** 受信メッセージ : command比較
+ *
+ * @param[in]       pCmd1       command(4byte×REPLY_CMD_WORDS)
+ * @param[in]       pCmd2       command(4byte×REPLY_CMD_WORDS)
+ * @return          pCmd1 - pCmd2の符号(整数として比較した大小)
+ */
+static inline int ICACHE_FLASH_ATTR reply_cmp(const uint32_t *pCmd1, const uint32_t *pCmd2)
+{
+    for (int lp = 0; lp < REPLY_CMD_WORDS; lp++) {
+        if (pCmd1[lp] != pCmd2[lp]) {
+            return (pCmd1[lp] < pCmd2[lp]) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+
+/** 受信メッセージ : 解析定義検索
+ *
+ * @param[in]       pCmd        受信したcommand(4byteアラインメント)
+ * @return          mReply[]の位置(REPLY_UNKNOWN:未登録)
+ */
+static uint8_t ICACHE_FLASH_ATTR reply_find(const uint32_t *pCmd)
+{
+    int lo = 0;
+    int hi = mReplyNum;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = reply_cmp(pCmd, mReply[mid].cmd);
+        if (cmp == 0) {
+            return (uint8_t)mid;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return REPLY_UNKNOWN;
+}
+
+
 ///////////////
 // 環境依存
 ///////////////
@@ -522,25 +840,93 @@ static void ICACHE_FLASH_ATTR print_time(uint64_t tm)
 }
 
 
+/** 送信バッファ確保
+ *
+ * 送信バッファをメッセージ単位のリングバッファとして使い、pBufferWPntからLenバイト書き込めるか確認する。
+ * 末尾に空きがなければ先頭に折り返すが、1メッセージを分割して置くことはしない。
+ *
+ * @param[in,out]   pPeer       管理データ
+ * @param[in]       Len         書き込むメッセージ長
+ * @return          書込み位置(NULL:空きなし)
+ *
+ * @note
+ *          - 空きがない場合、送信完了(#bc_sent())を待ってから作り直すこと。
+ *          - getdata作成中(pPayload!=NULL)は、pBufferWPntから作成中のメッセージがあるものとして扱う。
+ */
+static struct bc_proto_t *ICACHE_FLASH_ATTR send_reserve(struct bc_proto_peer_t *pPeer, int Len)
+{
+    uint8_t *p_tail = pPeer->buffer + sizeof(pPeer->buffer);
+
+    if ((pPeer->bufferCnt == 0) && (pPeer->pPayload == NULL)) {
+        //送信待ちなし --> 先頭から使う
+        pPeer->pBufferWPnt = pPeer->buffer;
+        pPeer->pBufferRPnt = pPeer->buffer;
+        pPeer->pBufferEnd = NULL;
+    }
+    if (pPeer->pBufferEnd == NULL) {
+        //[RPnt..WPnt)が送信待ち
+        if (p_tail - pPeer->pBufferWPnt >= Len) {
+            return (struct bc_proto_t *)pPeer->pBufferWPnt;
+        }
+        if (pPeer->pBufferRPnt - pPeer->buffer > Len) {
+            //先頭に折り返す
+            //  WPntとRPntが一致すると空と区別できないので、1byteは空ける
+            pPeer->pBufferEnd = pPeer->pBufferWPnt;
+            pPeer->pBufferWPnt = pPeer->buffer;
+            return (struct bc_proto_t *)pPeer->pBufferWPnt;
+        }
+    }
+    else {
+        //[RPnt..End)と[buffer..WPnt)が送信待ち
+        if (pPeer->pBufferRPnt - pPeer->pBufferWPnt > Len) {
+            return (struct bc_proto_t *)pPeer->pBufferWPnt;
+        }
+    }
+
+    DBG_PRINTF("[%s()]send buffer full(len=%d, bufferCnt=%d)\n", __func__, Len, pPeer->bufferCnt);
+    pPeer->sendLaterCnt++;
+    return NULL;
+}
+
+
 /** TCP送信
  *
- * @param[in]       pConn       管理データ
- * @param[in]       pProto      Bitcoinプロトコルデータ
+ * #send_reserve()で確保した位置に作成したメッセージを送信する。
+ * 送信待ちがあれば、送信バッファにためて#bc_sent()で送信する。
+ *
+ * @param[in]       pPeer       管理データ
+ * @param[in]       pProto      Bitcoinプロトコルデータ(pBufferWPnt)
  * @return          送信結果(0...OK)
  */
-static int ICACHE_FLASH_ATTR send_data(struct espconn *pConn, struct bc_proto_t *pProto)
+static int ICACHE_FLASH_ATTR send_data(struct bc_proto_peer_t *pPeer, struct bc_proto_t *pProto)
 {
-    int ret = ESPCONN_MAXNUM;
-
     //checksum
     uint8_t hash[BC_SZ_HASH256];
     bc_misc_hash256(hash, pProto->payload, pProto->length);
     MEMCPY(pProto->checksum, hash, BC_CHKSUM_LEN);
 
-    if (mBufferCnt == 0) {
+    return send_frame(pPeer, pProto);
+}
+
+
+/** TCP送信(checksum計算済み)
+ *
+ * @param[in]       pPeer       管理データ
+ * @param[in]       pProto      Bitcoinプロトコルデータ(pBufferWPnt)
+ * @return          送信結果(0...OK)
+ */
+static int ICACHE_FLASH_ATTR send_frame(struct bc_proto_peer_t *pPeer, struct bc_proto_t *pProto)
+{
+    int ret = ESPCONN_MAXNUM;
+
+    if (pPeer->bufferCnt == 0) {
         //戻り値0は成功時
-        ret = espconn_send(pConn, (uint8_t *)pProto, BC_PACKET_LEN(pProto));
+        ret = espconn_send(pPeer->pConn, (uint8_t *)pProto, BC_PACKET_LEN(pProto));
         DBG_PRINTF("[%s(%u)] ret=%d, len=%d\n", __func__, bc_misc_time_get(), ret, BC_PACKET_LEN(pProto));
+        if (ret == 0) {
+            pPeer->sendCalls++;
+            pPeer->sendFrames++;
+        }
     }
 #ifdef __XTENSA__
     if (ret == 0) {
@@ -548,18 +934,11 @@ static int ICACHE_FLASH_ATTR send_data(struct espconn *pConn, struct bc_proto_t
     }
     else if (ret == ESPCONN_MAXNUM) {
         //ESP8266の送信バッファあふれ
-        mBufferCnt++;
-        mBufferWPnt += BC_PACKET_LEN(pProto);
-        DBG_PRINTF("  add send buffer(mBufferCnt=%d[%s]len=%d, %p)\n", mBufferCnt, pProto->command, BC_PACKET_LEN(pProto), mBufferWPnt);
-        if (mBufferWPnt - mBuffer >= sizeof(mBuffer)) {
-            //バッファへの書込みは各関数でやっているので、実はこの時点で既に領域破壊している。
-            //ならば、本来はバッファの書込み中にあふれないかどうかをチェックするのが正しいだろう。
-            //しかし、だ。
-            //書込みがあふれるような作りにしないことが先なのだ。
-            //だから、あえてここは目をつぶろう。
-            DBG_PRINTF(" oops! send buffer already FULL!!!!\n");
-            HALT();
-        }
+        //  書込み前にsend_reserve()で確保しているので、送信バッファからはあふれない
+        pPeer->bufferCnt++;
+        pPeer->pBufferWPnt += BC_PACKET_LEN(pProto);
+        DBG_PRINTF("  add send buffer(bufferCnt=%d[%s]len=%d, %p)\n", pPeer->bufferCnt, pProto->command, BC_PACKET_LEN(pProto), pPeer->pBufferWPnt);
+        ret = 0;
     }
     else {
         DBG_PRINTF("[%s()] ret=%d\n", __func__, ret);
@@ -570,17 +949,7 @@ static int ICACHE_FLASH_ATTR send_data(struct espconn *pConn, struct bc_proto_t
     }
     //Linuxでは同期送信なので、ためない
     ret = 0;
-    mBufferCnt = 0;
-
-    if (BC_PACKET_LEN(pProto) >= sizeof(mBuffer)) {
-        //バッファへの書込みは各関数でやっているので、実はこの時点で既に領域破壊している。
-        //ならば、本来はバッファの書込み中にあふれないかどうかをチェックするのが正しいだろう。
-        //しかし、だ。
-        //書込みがあふれるような作りにしないことが先なのだ。
-        //だから、あえてここは目をつぶろう。
-        DBG_PRINTF(" oops! send buffer already FULL!!!!\n");
-        HALT();
-    }
+    pPeer->bufferCnt = 0;
 #endif
     return ret;
 }
@@ -599,6 +968,49 @@ static void ICACHE_FLASH_ATTR set_header(struct bc_proto_t *pProto, const char *
 }
 
 
+/** MAGIC検索
+ *
+ * 4byteずつMAGICの先頭byteがあるか判定し、候補が見つかるまでまとめて読み飛ばす。
+ *
+ * @param[in]       pData       受信データ
+ * @param[in]       Len         pData長
+ * @return          MAGICの位置(末尾で途切れている場合はその位置, 見つからない場合はLen)
+ */
+static int ICACHE_FLASH_ATTR find_magic(const uint8_t *pData, int Len)
+{
+    const uint32_t magic = BC_MAGIC_TESTNET3;
+    const uint8_t *p_magic = (const uint8_t *)&magic;           //Little Endian
+    const uint32_t first = (magic & 0xff) * 0x01010101;
+    int pos = 0;
+
+    while (pos < Len) {
+        if (((size_t)(pData + pos) & 0x03) == 0) {
+            //アラインメントされていれば、4byteずつ判定する
+            while (pos + 4 <= Len) {
+                uint32_t v = *(const uint32_t *)(pData + pos) ^ first;
+                if (((v - 0x01010101) & ~v & 0x80808080) != 0) {
+                    //どこかのbyteが先頭byteと一致
+                    break;
+                }
+                pos += 4;
+            }
+            if (pos >= Len) {
+                break;
+            }
+        }
+        if (pData[pos] == p_magic[0]) {
+            int sz = (Len - pos < (int)sizeof(magic)) ? Len - pos : (int)sizeof(magic);
+            if (MEMCMP(pData + pos, p_magic, sz) == 0) {
+                return pos;
+            }
+        }
+        pos++;
+    }
+
+    return Len;
+}
+
+
 /** net_addr設定
  *
  * @param[in,out]   pp      設定先バッファ
@@ -629,31 +1041,6 @@ static void ICACHE_FLASH_ATTR add_netaddr(uint8_t **pp, uint64_t serv, int ip0,
 }
 
 
-/** データ設定(varint)
- *
- * @param[in,out]   pp      設定先バッファ
- * @param[in]       Len     値
- *
- * @note
- *      - ポインタを進める
- */
-static void ICACHE_FLASH_ATTR add_varint(uint8_t **pp, int Len)
-{
-    if (Len < 0xfd) {
-        bc_misc_add(pp, Len, 1);
-    }
-    else if (Len < 0xffff) {
-        bc_misc_add(pp, 0xfd, 1);
-        bc_misc_add(pp, Len, 2);
-    }
-    else {
-        //TODO:
-        DBG_PRINTF("string too long!\n");
-        return;
-    }
-}
-
-
 /** データ取得(32bit)
  *
  * @param[in]   pp          受信データ
@@ -669,38 +1056,6 @@ static inline int ICACHE_FLASH_ATTR get32(const uint8_t *p, uint32_t *pVal)
 }
 
 
-/** データ取得(64bit)
- *
- * @param[in]   pp          受信データ
- * @return      データ(64bit)
- *
- * @note
- *      - ポインタを進める
- */
-static inline int ICACHE_FLASH_ATTR get64(const uint8_t *p, uint64_t *pVal)
-{
-    MEMCPY(pVal, p, sizeof(*pVal));
-    return sizeof(uint64_t);
-}
-
-
-/** データ取得(文字列)
- *
- * @param[in]   p       受信データ
- * @param[out]  pStr    文字列
- * @return          解析データ長
- */
-static int ICACHE_FLASH_ATTR getstr(const uint8_t *p, char *pStr)
-{
-    int len;
-    int rlen = bc_misc_get_varint(p, &len);
-    p += rlen;
-    MEMCPY(pStr, p, len);
-    *(pStr + len) = '\0';
-    return rlen + len;
-}
-
-
 /** データ取得(net_addr)
  *
  * @param[in]   p       受信データ
@@ -715,19 +1070,6 @@ static inline int ICACHE_FLASH_ATTR get_netaddr(const uint8_t *p, struct net_add
 }
 
 
-/** データ取得(header)
- *
- * @param[in]   p       受信データ
- * @param[out]  pHead   block header
- * @return      解析データ長
- */
-static inline int ICACHE_FLASH_ATTR get_headers(const uint8_t *p, struct headers_t *pHead)
-{
-    MEMCPY(pHead, p, sizeof(struct headers_t));
-    return sizeof(struct headers_t);
-}
-
-
 /** データ取得(inv)
  *
  * @param[in]   p       受信データ
@@ -824,7 +1166,7 @@ static void ICACHE_FLASH_ATTR print_headers(const struct headers_t* pHead)
 
     //block hash
     uint8_t hash[BC_SZ_HASH256];
-    bc_misc_hash256(hash, (const uint8_t *)pHead, sizeof(struct headers_t) - 1); //block hash
+    bc_misc_hash256_header(hash, (const uint8_t *)pHead);  //block hash
     DBG_PRINTF("    block hash(%u) : ", bc_misc_time_get());
     for (int i = 0; i < BC_SZ_HASH256; i++) {
         DBG_PRINTF("%02x", hash[BC_SZ_HASH256 - i - 1]);
@@ -833,873 +1175,1937 @@ static void ICACHE_FLASH_ATTR print_headers(const struct headers_t* pHead)
 }
 
 
-/** @brief  MALLOC()して指定サイズまでためる
+/** 受信データ解析(version)
  *
- * @param[in]       pData       入力データ
- * @param[in,out]   pLen        [in]pDataサイズ, [out]残りサイズ
- * @param[in]       nByte       指定サイズ
- * @retval          NULL        指定サイズまでたまっていない
- * @retval          それ以外
- * @note
- *      - 戻り値が非NULLだった場合、呼び出し元でFREE()すること
+ * @param[in]       pArg        管理データ
+ * @param[in]       pElem       解析したフィールド
+ * @return          BC_CODEC_OK
  */
-static uint8_t *ICACHE_FLASH_ATTR read_nbyte(const uint8_t *pData, int *pLen, int nByte)
+static int ICACHE_FLASH_ATTR read_version(void *pArg, const struct bc_codec_elem_t *pElem)
 {
-    static uint8_t *spBuf = NULL;       //呼び出し元でFREE()してもらうこと！
-    static int sBytes = 0;
-
-    uint8_t *pRet = NULL;
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+    struct net_addr_t addr;
 
-    if (sBytes == 0) {
-        spBuf = (uint8_t *)MALLOC(nByte);
+    switch (pElem->field) {
+    case 0:
+        //version
+        DBG_PRINTF("  [version]\n");
+        DBG_PRINTF("   version : %d\n", (int32_t)pElem->val);
+        pPeer->version = (int32_t)pElem->val;
+        break;
+    case 1:
+        //services
+        DBG_PRINTF("   services : %llu\n", pElem->val);
+        break;
+    case 2:
+        //timestamp
+        DBG_PRINTF("   timestamp : ");
+        print_time(pElem->val);
+        break;
+    case 3:
+        //addr_recv
+        DBG_PRINTF("   addr_recv:\n");
+        get_netaddr(pElem->pData, &addr);
+        print_netaddr(&addr);
+        break;
+    case 4:
+        //addr_from
+        DBG_PRINTF("   addr_from:\n");
+        get_netaddr(pElem->pData, &addr);
+        print_netaddr(&addr);
+        break;
+    case 5:
+        //nonce
+        DBG_PRINTF("   nonce : %08x%08x\n", (uint32_t)(pElem->val >> 32), (uint32_t)(pElem->val & 0xffffffff));
+        break;
+    case 6:
+        //UserAgent(受信データの境界で分割されて通知されることがある)
+        if (pElem->pData == NULL) {
+            DBG_PRINTF("   user_agent : ");
+        }
+        else {
+            for (int lp = 0; lp < pElem->len; lp++) {
+                DBG_PRINTF("%c", pElem->pData[lp]);
+            }
+        }
+        break;
+    case 7:
+        //height
+        DBG_PRINTF("\n");
+        DBG_PRINTF("   height : %d\n", (uint32_t)pElem->val);
+        break;
+    case 8:
+        //relay
+        DBG_PRINTF("   relay : %d\n", (int)pElem->val);
+        break;
+    default:
+        break;
     }
-    if (sBytes + *pLen >= nByte) {
-        MEMCPY(spBuf + sBytes, pData, nByte - sBytes);
-        *pLen -= nByte - sBytes;
-        pRet = spBuf;       //呼び出し元でFREE()してもらうこと！
-        sBytes = 0;
+
+    return BC_CODEC_OK;
+}
+
+
+/** 受信データ解析完了(verack)
+ *
+ * @param[in]       pArg        管理データ
+ *
+ * @note
+ *          - verackを送信する
+ *          - 最初にverackを返した接続がheaders担当になる
+ */
+static void ICACHE_FLASH_ATTR fin_verack(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+    struct bc_proto_sync_t *pSync = pPeer->pSync;
+
+    DBG_PRINTF("  [verack]\n");
+
+    //送信バッファの空き待ちになったら、送信完了(#bc_sent())で送信する
+    //  filterloadはverackより後に送信する
+    if (send_verack(pPeer) == SEND_LATER) {
+        pPeer->hasVerack = 1;
     }
-    else {
-        MEMCPY(spBuf + sBytes, pData, *pLen);
-        sBytes += *pLen;
-        *pLen = 0;
+    if (pPeer->hasVerack || (send_filterload(pPeer) == SEND_LATER)) {
+        pPeer->hasFilterload = 1;
     }
 
-    return pRet;
+    if (pSync->pHeaderPeer != NULL) {
+        //headers担当は決まっている --> merkleblockのgetdataだけ受け持つ
+        DBG_PRINTF("  sync : getdata peer\n");
+        pPeer->status = (pSync->pHeaderPeer->status == 2) ? 2 : 1;
+        if (pPeer->status == 2) {
+            //初回同期済み
+            sync_sendheaders(pPeer);
+        }
+        return;
+    }
+    pSync->pHeaderPeer = pPeer;
+    pSync->bhash[BC_SZ_HASH256 - 1] = 0xff;
+    pSync->birthday = bc_flash_get_birthday();
+
+    struct bc_flash_hdr_t hdr;
+    pSync->hdrTop = (bc_flash_hdr_find(&hdr, NULL)) ? hdr.height : 0;
+
+#ifdef __XTENSA__
+    //ESP8266は送信完了してからgetheadersし始める
+    pPeer->status = 0;
+#else
+    //Linux版は送信が同期なので、ここで送ってしまう。
+    uint8_t hash[BC_SZ_HASH256];
+
+    bc_flash_get_last_bhash(hash);
+    sync_getheaders(pSync, hash);
+#endif
+}
+
+
+/** 受信データ解析(ping)
+ *
+ * @param[in]       pArg        管理データ
+ * @param[in]       pElem       解析したフィールド
+ * @return          BC_CODEC_OK
+ *
+ * @note
+ *          - nonceを残すだけで、pongは#fin_ping()で送信する
+ */
+static int ICACHE_FLASH_ATTR read_ping(void *pArg, const struct bc_codec_elem_t *pElem)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+
+    DBG_PRINTF("  [ping]\n");
+
+    pPeer->pingRecv = pElem->val;
+
+    return BC_CODEC_OK;
 }
 
 
-/** varint数値変換
- * 
- * 初回のpDataは、varintデータの先頭から始まることを想定.
- * 先頭データから残りの必要サイズを決定し、処理したサイズを引いてpLenに戻す.
- * よって、BC_PROTO_CONTを返す場合や、BC_PROTO_FINでちょうどvarint分のデータだった場合、*pLenは0になる.
- * 
- * pDataは位置を変更させないので、pLenと統一性がない.
- * いっそのこと、pLenは「残りサイズ」ではなく「処理したサイズ」のほうがすっきりするかもしれないが、
- * 全体的に*pLenは残りサイズを返すように作っているため、それもやりづらい.
- * 
- * @param[in]       pData       入力データ
- * @param[in,out]   pLen        [in]pDataサイズ, [out]残りサイズ
- * @param[out]      pVal        変換結果
- * @retval      BC_PROTO_FIN    解析完了
- * @retval      BC_PROTO_CONT   データ不足
- * 
- * @note        内部で#read_nbyte()を呼び出す
+/** 受信データ解析完了(ping)
+ *
+ * @param[in]       pArg        管理データ
+ *
+ * @note
+ *          - pongを送信する
  */
-static int ICACHE_FLASH_ATTR read_varint(const uint8_t *pData, int *pLen, uint64_t *pVal)
+static void ICACHE_FLASH_ATTR fin_ping(void *pArg)
 {
-    static uint8_t *spBuf;
-    static int sCount = 0;
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
 
-    int ret = BC_PROTO_CONT;
+    pPeer->pingNonce = pPeer->pingRecv;
+    if ((pPeer->pPayload != NULL) || (send_pong(pPeer, pPeer->pingNonce) == SEND_LATER)) {
+        //今の処理が終わってから送信 or 送信バッファの空き待ち
+        pPeer->hasPing = 1;
+    }
+}
 
-    if (sCount == 0) {
-        if (*pData < 0xfd) {
-            *pVal = (uint64_t)*pData;
-            ret = BC_PROTO_FIN;
+
+/** 受信データ解析(pong)
+ *
+ * @param[in]       pArg        管理データ
+ * @param[in]       pElem       解析したフィールド
+ * @return          BC_CODEC_OK
+ */
+static int ICACHE_FLASH_ATTR read_pong(void *pArg, const struct bc_codec_elem_t *pElem)
+{
+    DBG_PRINTF("  [pong]\n");
+    DBG_PRINTF("   nonce : %08x%08x\n", (uint32_t)(pElem->val >> 32), (uint32_t)(pElem->val & 0xffffffff));
+
+    return BC_CODEC_OK;
+}
+
+
+#if 0
+/** 受信データ解析(addr)
+ *
+ * @param[in]       pArg        管理データ
+ * @param[in]       pElem       解析したフィールド
+ * @return          BC_CODEC_OK
+ */
+static int ICACHE_FLASH_ATTR read_addr(void *pArg, const struct bc_codec_elem_t *pElem)
+{
+    if (pElem->pData == NULL) {
+        DBG_PRINTF("  [addr]\n");
+        DBG_PRINTF("   count : %d\n", (int)pElem->val);
+        return BC_CODEC_OK;
+    }
+
+    DBG_PRINTF("   addr_list[%4d] :\n", pElem->idx);
+    //timestamp
+    DBG_PRINTF("    timestamp : ");
+    uint32_t timestamp;
+    get32(pElem->pData, &timestamp);
+    print_time(timestamp);
+    //addr
+    DBG_PRINTF("    addr:\n");
+    struct net_addr_t addr;
+    get_netaddr(pElem->pData + sizeof(uint32_t), &addr);
+    print_netaddr(&addr);
+
+    return BC_CODEC_OK;
+}
+#endif
+
+
+/** 受信データ解析(inv)
+ *
+ * @param[in]       pArg        管理データ
+ * @param[in]       pElem       解析したフィールド
+ * @retval          BC_CODEC_OK     解析継続
+ * @retval          BC_CODEC_ABORT  headers担当ではないので読み捨てる
+ */
+static int ICACHE_FLASH_ATTR read_inv(void *pArg, const struct bc_codec_elem_t *pElem)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+
+    if (pPeer->pSync->pHeaderPeer != pPeer) {
+        //headers担当以外のinvは、headers担当と重複するので読み捨てる
+        return BC_CODEC_ABORT;
+    }
+
+    if (pElem->pData == NULL) {
+        //count(最大で50000(bitcoin仕様))
+        DBG_PRINTF("  [inv]\n");
+        DBG_PRINTF("   count : %d\n", (int)pElem->val);
+        return BC_CODEC_OK;
+    }
+
+    const struct inv_t *pInv = (const struct inv_t *)pElem->pData;
+    print_inv(pInv);
+
+    struct bc_proto_t *pProto = (struct bc_proto_t *)pPeer->pBufferWPnt;
+    switch (pInv->type) {
+    case INV_MSG_TX:
+        //getdata
+        if ((pPeer->pPayload != NULL) && (*pProto->payload >= GETDATA_CHUNK)) {
+            //1メッセージの最大件数 --> ここまでをgetdataする
+            send_data(pPeer, pProto);
+            pPeer->pPayload = NULL;
         }
-        else if (*pData == 0xfd) {
-            sCount = 2;
+        if (pPeer->pPayload != NULL) {
+            //作成中のgetdataに追加する(先頭に折り返す場合は移動する)
+            struct bc_proto_t *p_new = send_reserve(pPeer, BC_PACKET_LEN(pProto) + sizeof(struct inv_t));
+            if (p_new == NULL) {
+                //送信バッファに空きがない --> ここまでをgetdataする
+                send_data(pPeer, pProto);
+                pPeer->pPayload = NULL;
+            }
+            else if (p_new != pProto) {
+                MEMMOVE(p_new, pProto, BC_PACKET_LEN(pProto));
+                pPeer->pPayload = (uint8_t *)p_new + (pPeer->pPayload - (uint8_t *)pProto);
+                pProto = p_new;
+            }
         }
-        else if (*pData == 0xfe) {
-            sCount = 4;
+        if (pPeer->pPayload == NULL) {
+            //getdataの準備
+            pProto = send_reserve(pPeer, sizeof(struct bc_proto_t) + 1 + sizeof(struct inv_t));
+            if (pProto == NULL) {
+                //送信バッファに空きがない --> このtxは要求しない
+                DBG_PRINTF("getdata - skip\n");
+                break;
+            }
+            MEMCPY(pProto, &kFrameGetdata, sizeof(struct bc_proto_t));
+            *pProto->payload = 0;
+            pPeer->pPayload = pProto->payload + 1;        //var_int=1byte分
+            pProto->length = 1;
         }
-        else {
-            sCount = 8;
+        (*pProto->payload)++;
+        MEMCPY(pPeer->pPayload, pInv, sizeof(struct inv_t));
+        pPeer->pPayload += sizeof(struct inv_t);
+        pProto->length += sizeof(struct inv_t);
+
+        DBG_PRINTF("getdata - %d\n", *pProto->payload);
+        break;
+    case INV_MSG_BLOCK:
+        //最後に通知されたBhash更新
+        MEMCPY(pPeer->lastInvBhash, pInv->hash, BC_SZ_HASH256);
+        break;
+    }
+
+    return BC_CODEC_OK;
+}
+
+
+/** 受信データ解析完了(inv)
+ *
+ * @param[in]       pArg        管理データ
+ */
+static void ICACHE_FLASH_ATTR fin_inv(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+
+    DBG_PRINTF("    ... end inv ...\n");
+
+    if (pPeer->pPayload != NULL) {
+        //ここまでをgetdataする
+        DBG_PRINTF("  *** send getdata[cnt:%d] ***\n", pPeer->pBufferWPnt[sizeof(struct bc_proto_t)]);
+        send_data(pPeer, (struct bc_proto_t *)pPeer->pBufferWPnt);
+        pPeer->pPayload = NULL;
+    }
+
+    //MSG_BLOCKがあるなら、getheadersしてmerkleblockを取得する
+    //  sendheaders非対応の接続か、headersで通知しきれなかった場合
+    if ((pPeer->status > 1) && (pPeer->lastInvBhash[BC_SZ_HASH256 - 1] != 0xff)) {
+        //1はgetheaders中
+        struct bc_proto_sync_t *pSync = pPeer->pSync;
+        pPeer->lastInvBhash[BC_SZ_HASH256 - 1] = 0xff;        //Bitcoinの仕様上、先頭は0x00のため
+        if (pSync->pHashQ != NULL) {
+            //取得中のbatchの後にgetheadersする
+            pSync->announced = 0;
+        }
+        else if ((pSync->headersWait == 0) && !pSync->headersLater) {
+            sync_getheaders(pSync, pSync->hdrchk.prevBhash);
         }
-        pData++;
-        (*pLen)--;
     }
-    if (sCount > 0) {
-        spBuf = read_nbyte(pData, pLen, sCount);
-        if (spBuf != NULL) {
-            switch (sCount) {
-            case 2:
-                *pVal = (uint64_t)*(uint16_t *)spBuf;
+
+    //getdata作成中で待たせていたgetheaders
+    sync_next(pPeer->pSync);
+}
+
+
+/** 受信データ解析(block)
+ *
+ * @param[in]       pArg        管理データ
+ * @param[in]       pElem       解析したフィールド
+ * @return          BC_CODEC_OK
+ */
+static int ICACHE_FLASH_ATTR read_block(void *pArg, const struct bc_codec_elem_t *pElem)
+{
+    switch (pElem->field) {
+    case 0:
+        //block header(txn_countはvarintとして別に読む)
+        DBG_PRINTF("  [block]\n");
+        print_headers((const struct headers_t *)pElem->pData);
+        break;
+    case 1:
+        //txn_count
+        DBG_PRINTF("   txn_count : %d\n", (int)pElem->val);
+        break;
+    default:
+        break;
+    }
+
+    return BC_CODEC_OK;
+}
+
+
+/** 受信データ解析(tx)
+ *
+ * txはためずに、受信した分ずつ解析する。
+ * FLASH保存の判定に使うデータだけpPeer->txに残し、保存は#fin_tx()で行う。
+ *
+ * @param[in]       pArg        管理データ
+ * @param[in]       pElem       解析したフィールド(受信した分のtx)
+ * @retval          BC_CODEC_OK     解析継続
+ * @retval          BC_CODEC_ABORT  保存対象ではないので、残りは読み捨てる
+ */
+static int ICACHE_FLASH_ATTR read_tx(void *pArg, const struct bc_codec_elem_t *pElem)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+    struct bc_proto_txparse_t *pTx = &pPeer->tx;
+    const uint8_t *p = pElem->pData;
+    int len = pElem->len;
+    uint64_t val;
+
+    if (p == NULL) {
+        //tx開始
+        DBG_PRINTF("  [tx]\n");
+        MEMSET(pTx, 0, sizeof(struct bc_proto_txparse_t));
+        pTx->stage = TX_VERSION;
+        return BC_CODEC_OK;
+    }
+
+    while (len > 0) {
+        switch (pTx->stage) {
+        case TX_VERSION:
+            if (!tx_gather(pTx, &p, &len, sizeof(int32_t))) {
+                break;
+            }
+            pTx->bytes = 0;
+            pTx->stage = TX_IN_COUNT;
+            break;
+
+        case TX_IN_COUNT:
+            if (!tx_varint(pTx, &p, &len, &val)) {
+                break;
+            }
+            if (val > pElem->val) {
+                DBG_PRINTF("    txn_in count : %u\n", (uint32_t)val);
+                return BC_CODEC_ABORT;
+            }
+            pTx->inCount = (uint32_t)val;
+            pTx->count = pTx->inCount;
+            pTx->idx = 0;
+            pTx->stage = (pTx->count > 0) ? TX_IN_PREV : TX_OUT_COUNT;
+            break;
+
+        case TX_IN_PREV:
+            if (!tx_gather(pTx, &p, &len, BC_SZ_HASH256 + sizeof(uint32_t))) {
                 break;
-            case 4:
-                *pVal = (uint64_t)*(uint32_t *)spBuf;
+            }
+            //hash(indexは見ない)
+            MEMCPY(pTx->prevOutput, pTx->buf, BC_SZ_HASH256);
+            pTx->bytes = 0;
+            pTx->stage = TX_IN_SCRLEN;
+            break;
+
+        case TX_IN_SCRLEN:
+            if (!tx_varint(pTx, &p, &len, &val)) {
+                break;
+            }
+            if (val > 255) {
+                //[len+署名][len+公開鍵]
+                DBG_PRINTF("     script length : %u\n", (uint32_t)val);
+                return BC_CODEC_ABORT;
+            }
+            pTx->scrLen = (uint16_t)val;
+            pTx->scrPos = 0;
+            pTx->capPos = 0;
+            pTx->capLen = 1;        //まず署名長
+            pTx->stage = TX_IN_SCRIPT;
+            break;
+
+        case TX_IN_SCRIPT:
+            if (!tx_script(pTx, &p, &len)) {
+                break;
+            }
+            if (!tx_in_script(pTx)) {
+                return BC_CODEC_ABORT;
+            }
+            pTx->stage = TX_IN_SEQ;
+            break;
+
+        case TX_IN_SEQ:
+            if (!tx_gather(pTx, &p, &len, sizeof(uint32_t))) {
                 break;
-            case 8:
-                *pVal = (uint64_t)*(uint64_t *)spBuf;
+            }
+            pTx->bytes = 0;
+            pTx->idx++;
+            pTx->stage = (pTx->idx < pTx->count) ? TX_IN_PREV : TX_OUT_COUNT;
+            break;
+
+        case TX_OUT_COUNT:
+            if (!tx_varint(pTx, &p, &len, &val)) {
+                break;
+            }
+            if ((val < 2) || (val > pElem->val)) {
+                //outputは2以上
+                DBG_PRINTF("    txn_out count : %u\n", (uint32_t)val);
+                return BC_CODEC_ABORT;
+            }
+            pTx->count = (uint32_t)val;
+            pTx->idx = 0;
+            pTx->stage = TX_OUT_VALUE;
+            break;
+
+        case TX_OUT_VALUE:
+            if (!tx_gather(pTx, &p, &len, sizeof(uint64_t))) {
+                break;
+            }
+            pTx->bytes = 0;
+            pTx->stage = TX_OUT_SCRLEN;
+            break;
+
+        case TX_OUT_SCRLEN:
+            if (!tx_varint(pTx, &p, &len, &val)) {
                 break;
-            default:
+            }
+            if (val > 255) {
+                DBG_PRINTF("     pk_script length : %u\n", (uint32_t)val);
+                return BC_CODEC_ABORT;
+            }
+            pTx->scrLen = (uint16_t)val;
+            pTx->scrPos = 0;
+            pTx->capPos = 0;
+            pTx->capLen = 3 + BC_SZ_HASH160;    //OP_DUP(1) OP_HASH160(1) LEN(1) BCADDR(20)
+            pTx->stage = TX_OUT_SCRIPT;
+            break;
+
+        case TX_OUT_SCRIPT:
+            if (!tx_script(pTx, &p, &len)) {
                 break;
             }
-            FREE(spBuf);
-            sCount = 0;
-            ret = BC_PROTO_FIN;
+            if (!tx_out_script(pTx)) {
+                return BC_CODEC_ABORT;
+            }
+            pTx->idx++;
+            pTx->stage = (pTx->idx < pTx->count) ? TX_OUT_VALUE : TX_DONE;
+            break;
+
+        default:
+            //lock_time
+            len = 0;
+            break;
         }
     }
 
-    return ret;
+    return BC_CODEC_OK;
 }
 
 
-/** 受信データ解析(version)
+/** 受信データ解析完了(tx)
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
+ * checksumが一致したtxだけ、FLASH保存の判定を行う。
+ *
+ * @param[in]       pArg        管理データ
+ */
+static void ICACHE_FLASH_ATTR fin_tx(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+    struct bc_proto_txparse_t *pTx = &pPeer->tx;
+    struct bc_proto_tx proto_tx;
+
+    if (pTx->stage != TX_DONE) {
+        DBG_PRINTF("too short tx\n");
+        return;
+    }
+
+    //payload全体のHASH256がtxのhash
+    proto_tx.pTxHash = pPeer->codec.hash256;
+    proto_tx.pPrevOutput = pTx->prevOutput;
+    proto_tx.pOpReturn = pTx->opReturn;
+
+    if (pTx->flgOpret) {
+        if (pTx->flgPubkey) {
+            //TX(a)
+            bc_flash_update_txinfo(BC_FLASH_TYPE_TXA, &proto_tx);
+        }
+        else if (pTx->flgBcaddr && (pTx->inCount == 1)) {
+            //TX(b)
+            bc_flash_update_txinfo(BC_FLASH_TYPE_TXB, &proto_tx);
+        }
+        else {
+            DBG_PRINTF("no match flags\n");
+        }
+    }
+    else {
+        DBG_PRINTF("no OP_RETURN\n");
+    }
+}
+
+
+/** tx解析 : 固定長データ取得
+ *
+ * 受信データの境界をまたいでもよいように、buf[]にためる。
+ * 使い終わったら、呼び出し元でbytesを0に戻すこと。
+ *
+ * @param[in,out]   pTx         tx解析状態
+ * @param[in,out]   pp          受信データ(処理した分進める)
  * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
+ * @param[in]       nByte       データ長(buf[]のサイズ以下)
+ * @retval          1           buf[]にnByteそろった
+ * @retval          0           受信データ不足
  */
-static int ICACHE_FLASH_ATTR read_version(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static int ICACHE_FLASH_ATTR tx_gather(struct bc_proto_txparse_t *pTx, const uint8_t **pp, int *pLen, int nByte)
 {
-    const uint8_t *p = pData;
+    int sz = nByte - pTx->bytes;
 
-    BC_LEN_CHECK(mProto, *pLen);
+    if (sz > *pLen) {
+        sz = *pLen;
+    }
+    if (sz > 0) {
+        MEMCPY(pTx->buf + pTx->bytes, *pp, sz);
+        pTx->bytes += sz;
+        *pp += sz;
+        *pLen -= sz;
+    }
+    return pTx->bytes == nByte;
+}
 
-    DBG_PRINTF("  [version]\n");
-    //version
-    int32_t version;
-    p += get32(p, (uint32_t *)&version);
-    DBG_PRINTF("   version : %d\n", version);
-    //services
-    uint64_t services;
-    p += get64(p, &services);
-    DBG_PRINTF("   services : %llu\n", services);
-    //timestamp
-    DBG_PRINTF("   timestamp : ");
-    uint64_t timestamp;
-    p += get64(p, &timestamp);
-    print_time(timestamp);
-    //addr_recv
-    DBG_PRINTF("   addr_recv:\n");
-    struct net_addr_t addr;
-    p += get_netaddr(p, &addr);
-    print_netaddr(&addr);
-    //addr_from
-    DBG_PRINTF("   addr_from:\n");
-    p += get_netaddr(p, &addr);
-    print_netaddr(&addr);
-    //nonce
-    uint64_t nonce;
-    p += get64(p, &nonce);
-    DBG_PRINTF("   nonce : %08x%08x\n", (uint32_t)(nonce >> 32), (uint32_t)(nonce & 0xffffffff));
-    //UserAgent
-    char buf[50];
-    p += getstr(p, buf);
-    DBG_PRINTF("   user_agent : %s\n", buf);
-    //height
-    uint32_t height;
-    p += get32(p, (uint32_t *)&height);
-    DBG_PRINTF("   height : %d\n", height);
-    //relay
-    DBG_PRINTF("   relay : %d\n", *p);
-    p++;
 
-    *pLen -= p - pData;
-    return BC_PROTO_FIN;
+/** tx解析 : varint取得
+ *
+ * @param[in,out]   pTx         tx解析状態
+ * @param[in,out]   pp          受信データ(処理した分進める)
+ * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
+ * @param[out]      pVal        値
+ * @retval          1           取得完了
+ * @retval          0           受信データ不足
+ */
+static int ICACHE_FLASH_ATTR tx_varint(struct bc_proto_txparse_t *pTx, const uint8_t **pp, int *pLen, uint64_t *pVal)
+{
+    if ((pTx->bytes == 0) && !tx_gather(pTx, pp, pLen, 1)) {
+        //先頭byteでデータ長が決まる
+        return 0;
+    }
+    if (!tx_gather(pTx, pp, pLen, bc_misc_varint_len(pTx->buf[0]))) {
+        return 0;
+    }
+    bc_misc_get_varint(pTx->buf, pVal);
+    pTx->bytes = 0;
+    return 1;
 }
 
 
-/** 受信データ解析(verack)
+/** tx解析 : script読み進め
+ *
+ * scriptのうち、capPosからcapLen分だけbuf[]にためる。
+ * [TxIn]は先頭の署名長を読んだら、公開鍵の位置にcapPosを移す。
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
+ * @param[in,out]   pTx         tx解析状態
+ * @param[in,out]   pp          受信データ(処理した分進める)
  * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
+ * @retval          1           script終了
+ * @retval          0           受信データ不足
+ */
+static int ICACHE_FLASH_ATTR tx_script(struct bc_proto_txparse_t *pTx, const uint8_t **pp, int *pLen)
+{
+    while ((pTx->scrPos < pTx->scrLen) && (*pLen > 0)) {
+        int sz = pTx->scrLen - pTx->scrPos;
+        if (sz > *pLen) {
+            sz = *pLen;
+        }
+
+        //buf[]にためる範囲と重なる分
+        int from = (pTx->scrPos > pTx->capPos) ? pTx->scrPos : pTx->capPos;
+        int to = (pTx->scrPos + sz < pTx->capPos + pTx->capLen) ? pTx->scrPos + sz : pTx->capPos + pTx->capLen;
+        if (from < to) {
+            MEMCPY(pTx->buf + from - pTx->capPos, *pp + from - pTx->scrPos, to - from);
+            pTx->bytes = (uint8_t)(to - pTx->capPos);
+            if ((pTx->stage == TX_IN_SCRIPT) && (pTx->capPos == 0)) {
+                //署名長を読んだところで止める
+                sz = to - pTx->scrPos;
+            }
+        }
+        *pp += sz;
+        *pLen -= sz;
+        pTx->scrPos += sz;
+
+        if ((pTx->stage == TX_IN_SCRIPT) && (pTx->capPos == 0) && (pTx->bytes == 1)) {
+            //署名の次にある公開鍵(len+公開鍵)をためる
+            pTx->capPos = 1 + pTx->buf[0];
+            pTx->capLen = 1 + BC_SZ_PUBKEY;
+            pTx->bytes = 0;
+        }
+    }
+
+    return pTx->scrPos >= pTx->scrLen;
+}
+
+
+/** tx解析 : [TxIn]signature script判定
  *
- * @note
- *          - verackを送信する
+ * @param[in,out]   pTx         tx解析状態
+ * @retval          1           解析継続
+ * @retval          0           保存対象外
  */
-static int ICACHE_FLASH_ATTR read_verack(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static int ICACHE_FLASH_ATTR tx_in_script(struct bc_proto_txparse_t *pTx)
 {
-    DBG_PRINTF("  [verack]\n");
+    struct bc_flash_wlt_t wlt;
+    int ret = 1;
 
-    send_verack(pConn);
-    send_filterload(pConn);
+    if ((pTx->capPos == 0) || (pTx->bytes < pTx->capLen) || (pTx->buf[0] != BC_SZ_PUBKEY)) {
+        //公開鍵長は33byte
+        DBG_PRINTF("     pubkey length : %d\n", (pTx->bytes > 0) ? pTx->buf[0] : -1);
+        ret = 0;
+    }
+    else {
+        bc_flash_get_bcaddr(&wlt);
+        if (MEMCMP(pTx->buf + 1, wlt.pubkey, BC_SZ_PUBKEY) == 0) {
+            //公開鍵一致
+            DBG_PRINTF("  match pubkey!\n");
+            pTx->flgPubkey = 1;
+        }
+    }
+    pTx->bytes = 0;
 
-#ifdef __XTENSA__
-    //ESP8266は送信完了してからgetheadersし始める
-    mStatus = 0;
-#else
-    //Linux版は送信が同期なので、ここで送ってしまう。
-    uint8_t hash[BC_SZ_HASH256];
+    return ret;
+}
+
+
+/** tx解析 : [TxOut]pk_script判定
+ *
+ * @param[in,out]   pTx         tx解析状態
+ * @retval          1           解析継続
+ * @retval          0           保存対象外
+ */
+static int ICACHE_FLASH_ATTR tx_out_script(struct bc_proto_txparse_t *pTx)
+{
+    const uint8_t *p = pTx->buf;
+    struct bc_flash_wlt_t wlt;
+    int ret = 1;
+
+    //OUTPUT1
+    if ((pTx->idx == 0) && !pTx->flgPubkey && (pTx->scrLen >= 23)) {   //OP_DUP(1) OP_HASH160(1) LEN(1) BCADDR(20) 
+        bc_flash_get_bcaddr(&wlt);
+        if ((p[0] != OP_DUP) && (p[1] != OP_HASH160) && (p[2] != (uint8_t)BC_SZ_HASH160)) {
+            DBG_PRINTF("not [OP_DUP][OP_HASH160]\n");
+            ret = 0;
+        }
+        else if (MEMCMP(&p[3], wlt.bcaddr, sizeof(wlt.bcaddr)) == 0) {
+            //output1のBitcoinアドレスが一致
+            DBG_PRINTF("  match bcaddr!\n");
+            pTx->flgBcaddr = 1;
+        }
+        else {
+            DBG_PRINTF("not match bcaddr\n");
+            ret = 0;
+        }
+    }
+    //OUTPUT2
+    else if ((pTx->idx == 1) && (pTx->scrLen >= 2)) {   //OP_RETURN(1) LEN(1)
+        if (p[0] == OP_RETURN) {
+            DBG_PRINTF("  detect OP_RETURN\n");
+            pTx->flgOpret = 1;
+            MEMCPY(pTx->opReturn, p + 1, sizeof(pTx->opReturn));
+        }
+    }
+    pTx->bytes = 0;
+
+    return ret;
+}
+
+
+/** 受信データ解析(headers)
+ *
+ * batchのうち先頭から最大でHASHQ_NUM件のBlock Hashを、getdata用にpHashQ[]にためる。
+ * pHashQ[]に入らなかったheadersは、hashQCap件ごとのBlock HashだけをstopBhash[]に残し、
+ * 続きのgetheadersのhash_stopにする(同じheadersを何度も受信しないようにする)。
+ * ためるheaderは#hdrchk_verify()で検査し、失敗したらbatchごと捨ててgetdataしない。
+ * ウォレット作成前(pSync->birthday)のheaderが先頭に続く間は、pHashQ[]にためずに進める。
+ * ためたheaderは高さを数え、記録内容をpHdrQ[]に残す。
+ * checkpointの高さでBlock Hashを照合する(#bc_checkpoint_verify())。
+ * 同じbatchの中で照合するcheckpointまでのheaderは、PoWなどを省いてつながりだけを検査する。
+ * checkpointが一致しなければbatchごと捨てるので、FLASHへの記録やgetdataは照合した後になる。
+ * batchの先頭がblock locatorの途中から続いている(reorg)場合は、分岐点の高さから数え直す。
+ * 初回同期後にsendheadersで通知されたheadersも同じようにgetdataする。
+ *
+ * FLASHへの記録やgetdata, getheadersはchecksumを照合してから#fin_headers()で行うため、
+ * ここではbatchの扱い(pSync->hdrState)を決めるだけにする。
+ *
+ * @param[in]       pArg        管理データ
+ * @param[in]       pElem       解析したフィールド
+ * @retval          BC_CODEC_OK     解析継続
+ * @retval          BC_CODEC_ABORT  不要なheadersなので、残りは読み捨てる
+ */
+static int ICACHE_FLASH_ATTR read_headers(void *pArg, const struct bc_codec_elem_t *pElem)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+    struct bc_proto_sync_t *pSync = pPeer->pSync;
+
+    if (pSync->pHeaderPeer != pPeer) {
+        //headers担当以外は読み捨てる
+        return BC_CODEC_ABORT;
+    }
+
+    if (pElem->pData == NULL) {
+        //count(最大で2000(bitcoin仕様))
+        if (pSync->headersWait > 1) {
+            //やり直す前に送信したgetheadersの応答
+            pSync->headersWait--;
+            return BC_CODEC_ABORT;
+        }
+        int announced = (pSync->headersWait == 0);
+        pSync->headersWait = 0;
+        if (pSync->pHashQ != NULL) {
+            //まだgetdataしていないbatchがある
+            if (announced) {
+                //通知されたblockは、batchの後のgetheadersで取得する
+                pSync->announced = 0;
+            }
+            return BC_CODEC_ABORT;
+        }
+        pSync->announced = (uint8_t)announced;
+
+        if (pElem->val == 0) {
+            //countが0だった
+            pSync->hdrState = HDR_EMPTY;
+            return BC_CODEC_OK;
+        }
+
+        //getdataするBlock Hashをためる(RAMに収まらないため、件数を制限する)
+        pSync->batchNum = (uint32_t)pElem->val;
+        pSync->hashQCap = (pElem->val > HASHQ_NUM) ? HASHQ_NUM : (uint16_t)pElem->val;
+        pSync->pHashQ = (uint8_t *)MALLOC(SZ_HASHQ(pSync->hashQCap));
+        if ((pSync->pHashQ == NULL) && (pSync->hashQCap > WND_INIT)) {
+            //1round分だけでも確保する
+            DBG_PRINTF("[%s()]malloc fail(%u)\n", __func__, pSync->hashQCap);
+            pSync->hashQCap = WND_INIT;
+            pSync->pHashQ = (uint8_t *)MALLOC(SZ_HASHQ(pSync->hashQCap));
+        }
+        if (pSync->pHashQ == NULL) {
+            DBG_PRINTF("[%s()]malloc fail(%u)\n", __func__, pSync->hashQCap);
+            HALT();
+        }
+        pSync->pHdrQ = (struct bc_proto_hdrq_t *)(pSync->pHashQ + BC_SZ_HASH256 * pSync->hashQCap);
+        pSync->hashQNum = 0;
+        pSync->hashQPos = 0;
+        pSync->hashQFill = 0;
+        pSync->skipNum = 0;
+        pSync->batchHeight = 0;
+        pSync->batchFork = 0;
+        pSync->hdrState = HDR_READ;
+        return BC_CODEC_OK;
+    }
+
+    //headers_t
+    if (pSync->hdrState != HDR_READ) {
+        //batchの扱いは決まっている --> 残りは読むだけ(checksumを照合してから#fin_headers()で処理する)
+        return BC_CODEC_OK;
+    }
+    if (pSync->hashQFill < pSync->hashQCap) {
+        //pHashQ[]にためる
+        const struct headers_t *p_head = (const struct headers_t *)pElem->pData;
+        bc_misc_hash256_header(pPeer->lastHeadersBhash, pElem->pData);   //block hash
+
+        if ((pElem->idx == 0) && (MEMCMP(pPeer->lastHeadersBhash, kBhash1, BC_SZ_HASH256) == 0)) {
+            //Block#1から返ってきた(block locatorを知らない)
+            DBG_PRINTF("get #1 BHash!\n");
+            pSync->hdrState = HDR_GENESIS;
+            return BC_CODEC_OK;
+        }
+
+        int fork = (pElem->idx == 0) && (MEMCMP(p_head->prev_block, pSync->hdrchk.prevBhash, BC_SZ_HASH256) != 0);
+        uint32_t height = (fork) ? bc_flash_get_height(p_head->prev_block) : pSync->height;
+        if (height != 0) {
+            height++;
+        }
+        if (fork) {
+            if ((height == 0) && pSync->announced) {
+                //通知されたheadersがつながらない(取りこぼした)
+                DBG_PRINTF("[%s()]not connect\n", __func__);
+                pSync->hdrState = HDR_NOCONNECT;
+                return BC_CODEC_OK;
+            }
+            if (!pSync->announced && !bc_flash_is_locator(p_head->prev_block)) {
+                //送信したblock locatorにないheaderからは分岐させない
+                //  同じlocatorで取り直しても変わらないので、最も古い開始位置からやり直す
+                DBG_PRINTF("[%s()]unknown fork point\n", __func__);
+                pSync->hdrState = HDR_GENESIS;
+                return BC_CODEC_OK;
+            }
+            //block locatorの途中から続いている --> 分岐点から検査し直す
+            //  分岐点の高さを記録していない(古いringから消えた等)場合は、高さ不明(0)のまま検査する
+            DBG_PRINTF("[%s()]fork(height=%u)\n", __func__, height);
+            hdrchk_reset(&pSync->hdrchk, p_head->prev_block);
+        }
+        //このbatchの中で照合するcheckpointまでは、つながりだけ見る
+        //(pHashQ[]に入らず照合できないcheckpointまでは検査を省かない)
+        uint32_t cp = (height != 0) ? bc_checkpoint_next(height) : 0;
+        int trusted = (cp != 0) &&
+                        (cp - height < (uint32_t)(pSync->hashQCap - pSync->hashQFill)) &&
+                        (pElem->idx + (cp - height) < pSync->batchNum);
+        if (!hdrchk_verify(&pSync->hdrchk, p_head, pPeer->lastHeadersBhash, height, trusted) ||
+                !bc_checkpoint_verify(height, pPeer->lastHeadersBhash)) {
+            //不正なheader --> batchごと捨てる
+            DBG_PRINTF("[%s()]reject headers(%u)\n", __func__, pElem->idx);
+            pSync->hdrState = HDR_REJECT;
+            return BC_CODEC_OK;
+        }
+        if (pElem->idx == 0) {
+            pSync->batchHeight = height;
+            pSync->batchFork = (uint8_t)fork;
+        }
+        pSync->height = height;
+
+        if ((pSync->hashQFill == 0) && (pSync->birthday != 0) && (p_head->timestamp < pSync->birthday)) {
+            //ウォレット作成前のblock --> getdataしない(記録は最後の1件だけ)
+            MEMCPY(pSync->skipBhash, pPeer->lastHeadersBhash, BC_SZ_HASH256);
+            pSync->skipBits = p_head->bits;
+            pSync->skipTime = p_head->timestamp;
+            pSync->skipNum++;
+            return BC_CODEC_OK;
+        }
+
+        MEMCPY(pSync->pHashQ + BC_SZ_HASH256 * pSync->hashQFill, pPeer->lastHeadersBhash, BC_SZ_HASH256);
+        pSync->pHdrQ[pSync->hashQFill].bits = p_head->bits;
+        pSync->pHdrQ[pSync->hashQFill].timestamp = p_head->timestamp;
+        pSync->hashQFill++;
+
+        DBG_PRINTF("=");        //プログレスバー代わりのログ
+    }
+    else {
+        //pHashQ[]に入らない --> hashQCap件ごとの区切りだけ残す
+        uint32_t over = pElem->idx - pSync->skipNum - pSync->hashQCap;
+        if (over == 0) {
+            pSync->stopNum = 0;
+            pSync->stopPos = 0;
+        }
+        if ((over % pSync->hashQCap == (uint32_t)(pSync->hashQCap - 1)) && (pSync->stopNum < BC_PROTO_HDRSTOP_NUM)) {
+            bc_misc_hash256_header(pSync->stopBhash[pSync->stopNum], pElem->pData);
+            pSync->stopNum++;
+        }
+        DBG_PRINTF(".");        //プログレスバー代わりのログ
+    }
+
+    return BC_CODEC_OK;
+}
+
+
+/** 受信データ解析完了(headers)
+ *
+ * checksumが一致したので、#read_headers()で決めたbatchの扱いを処理する。
+ * ためたheaderをFLASHに記録し、pHashQ[]の先頭からgetdataする。
+ *
+ * @param[in]       pArg        管理データ
+ */
+static void ICACHE_FLASH_ATTR fin_headers(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+    struct bc_proto_sync_t *pSync = pPeer->pSync;
+    uint8_t state = pSync->hdrState;
+
+    pSync->hdrState = HDR_NONE;
+    switch (state) {
+    case HDR_READ:
+        break;
+    case HDR_EMPTY:
+        //countが0だった場合はここで終わり
+        if (pSync->roundNum == 0) {
+            sync_finish(pSync);
+        }
+        else {
+            //要求中のroundがそろうのを待つ
+            pSync->fin = 1;
+        }
+        return;
+    case HDR_REJECT:
+        //不正なheader --> batchごと捨てる
+        pPeer->headersBad++;
+        sync_reject_headers(pSync);
+        return;
+    case HDR_NOCONNECT:
+        //通知されたheadersがつながらない --> getheadersで取得する
+        sync_free_hashq(pSync);
+        sync_getheaders(pSync, pSync->hdrchk.prevBhash);
+        return;
+    case HDR_GENESIS:
+        //block locatorを1つも知らない(保存したBlock Hashがすべてreorgで無効),
+        //あるいは送信していないBlock Hashから分岐している --> 最も古い開始位置からやり直す
+        sync_free_hashq(pSync);
+        if (!pSync->fromFirst) {
+            uint8_t hash[BC_SZ_HASH256];
+
+            pSync->fromFirst = 1;
+            bc_flash_get_first_bhash(hash);
+            sync_getheaders(pSync, hash);
+        }
+        else {
+            //開始位置のcheckpointも知らない --> 別のchainのpeer
+            pPeer->headersBad++;
+            sync_reject_headers(pSync);
+        }
+        return;
+    default:
+        return;
+    }
+
+    if ((pSync->pHashQ == NULL) || (pSync->hashQNum != 0)) {
+        return;
+    }
+    DBG_PRINTF("[%s()]height=%u\n", __func__, pSync->height);
+    sync_commit(pSync);
+    pSync->fromFirst = 0;
+    if (pSync->skipNum > 0) {
+        //getdataせずに進めたところまでは同期済み
+        DBG_PRINTF("[%s()]skip %u headers(birthday)\n", __func__, pSync->skipNum);
+        MEMCPY(pSync->bhash, pSync->skipBhash, BC_SZ_HASH256);
+        pSync->skipNum = 0;
+    }
+    if (pSync->hashQFill == 0) {
+        //全部ウォレット作成前 --> getdataせずに次のgetheaders
+        sync_free_hashq(pSync);
+        sync_getheaders(pSync, pSync->bhash);
+        return;
+    }
+    //以降はすべてgetdataする
+    pSync->birthday = 0;
+
+    //pHashQ[]の先頭からgetdataする
+    pSync->hashQNum = pSync->hashQFill;
+    pSync->hashQPos = 0;
+    sync_next(pSync);
+}
+
+
+/** 受信データ解析完了(merkleblock)
+ *
+ * 中身は見ずに読み捨て、届いた数だけ数える。
+ * 接続ごとに要求した順に返ってくるので、最も古いroundから数える。
+ *
+ * @param[in]       pArg        管理データ
+ */
+static void ICACHE_FLASH_ATTR fin_merkleblock(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+    struct bc_proto_sync_t *pSync = pPeer->pSync;
+
+    DBG_PRINTF("M");
+
+    if ((pSync == NULL) || (pPeer->merkleCnt == 0)) {
+        return;
+    }
+
+    int slot;
+    for (slot = 0; slot < BC_PROTO_PEER_MAX; slot++) {
+        if (pSync->pPeers[slot] == pPeer) {
+            break;
+        }
+    }
+    if (slot == BC_PROTO_PEER_MAX) {
+        //並列同期に参加していない
+        DBG_PRINTF("[%s()]not joined\n", __func__);
+        pPeer->merkleCnt = 0;
+        return;
+    }
+    pPeer->merkleCnt--;
+    pPeer->wndRecv++;
+    pPeer->merkleTotal++;
+    for (int lp = 0; lp < pSync->roundNum; lp++) {
+        struct bc_proto_sync_round_t *pRound = &pSync->rounds[(pSync->roundTop + lp) % BC_PROTO_SYNC_ROUNDS];
+        if (pRound->rest[slot] != 0) {
+            pRound->rest[slot]--;
+            if (pRound->rest[slot] == 0) {
+                //このroundのこの接続の分は全部返ってきた
+                wnd_update(pPeer);
+                sync_next(pSync);
+            }
+            break;
+        }
+    }
+}
+
+
+/** 受信データ解析完了(未処理)
+ *
+ * @param[in]       pArg        管理データ
+ */
+static void ICACHE_FLASH_ATTR fin_unknown(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+
+    DBG_PRINTF("  [%s] read out\n", pPeer->proto.command);
+}
+
+
+/** checksum不一致(inv)
+ *
+ * @param[in]       pArg        管理データ
+ */
+static void ICACHE_FLASH_ATTR bad_inv(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+
+    //作成中のgetdataと、更新したBlock Hashを捨てる
+    pPeer->pPayload = NULL;
+    pPeer->lastInvBhash[BC_SZ_HASH256 - 1] = 0xff;
+
+    //getdata作成中で待たせていたgetheaders
+    sync_next(pPeer->pSync);
+}
+
+
+/** checksum不一致(headers)
+ *
+ * ためたBlock Hashは信用できないので、そろっているところからやり直す。
+ *
+ * @param[in]       pArg        管理データ
+ */
+static void ICACHE_FLASH_ATTR bad_headers(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+    struct bc_proto_sync_t *pSync = pPeer->pSync;
+
+    if ((pSync->pHeaderPeer == pPeer) && (pSync->hdrState != HDR_NONE)) {
+        pSync->hdrState = HDR_NONE;
+        pSync->stopNum = 0;
+        pSync->retry = 1;
+        sync_next(pSync);
+    }
+}
+
+
+/** checksum不一致(merkleblock)
+ *
+ * 届いた数としては数え、そろっているところからやり直す。
+ *
+ * @param[in]       pArg        管理データ
+ */
+static void ICACHE_FLASH_ATTR bad_merkleblock(void *pArg)
+{
+    struct bc_proto_peer_t *pPeer = (struct bc_proto_peer_t *)pArg;
+
+    if ((pPeer->pSync != NULL) && (pPeer->merkleCnt != 0)) {
+        pPeer->pSync->retry = 1;
+    }
+    fin_merkleblock(pArg);
+}
+
+
+///////////////
+// 並列同期
+///////////////
+
+/** 並列同期 : 参加
+ *
+ * @param[in,out]   pSync       並列同期の管理データ
+ * @param[in,out]   pPeer       参加する接続
+ * @retval          1           参加した
+ * @retval          0           参加できる接続数を超えた
+ */
+static int ICACHE_FLASH_ATTR sync_join(struct bc_proto_sync_t *pSync, struct bc_proto_peer_t *pPeer)
+{
+    for (int lp = 0; lp < BC_PROTO_PEER_MAX; lp++) {
+        if (pSync->pPeers[lp] == NULL) {
+            pSync->pPeers[lp] = pPeer;
+            pPeer->pSync = pSync;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/** 並列同期 : 離脱
+ *
+ * 受け持っていたmerkleblockが欠けた場合は、roundをやり直す。
+ * headers担当が離脱した場合は、残っている接続に引き継ぐ。
+ *
+ * @param[in,out]   pPeer       離脱する接続
+ */
+static void ICACHE_FLASH_ATTR sync_leave(struct bc_proto_peer_t *pPeer)
+{
+    struct bc_proto_sync_t *pSync = pPeer->pSync;
+    int remain = 0;
+
+    for (int lp = 0; lp < BC_PROTO_PEER_MAX; lp++) {
+        if (pSync->pPeers[lp] == pPeer) {
+            pSync->pPeers[lp] = NULL;
+            for (int rnd = 0; rnd < BC_PROTO_SYNC_ROUNDS; rnd++) {
+                pSync->rounds[rnd].rest[lp] = 0;
+            }
+        }
+        if (pSync->pPeers[lp] != NULL) {
+            remain++;
+        }
+    }
+    pPeer->pSync = NULL;
+    pPeer->getdataRest = 0;
+
+    if (remain == 0) {
+        //誰もいなくなった
+        sync_reset(pSync);
+        return;
+    }
+
+    if (pPeer->merkleCnt) {
+        //受け持っていたmerkleblockが欠ける
+        pPeer->merkleCnt = 0;
+        pSync->retry = 1;
+    }
+
+    if (pSync->pHeaderPeer == pPeer) {
+        if ((pSync->headersWait > 0) || ((pSync->pHashQ != NULL) && (pSync->hashQNum == 0))) {
+            //getheadersの応答待ち、あるいは受信途中だった --> そろっているところからやり直す
+            pSync->retry = 1;
+        }
+
+        //headers担当を引き継ぐ
+        //  送信していないgetheadersは、やり直しで送信し直す
+        pSync->headersLater = 0;
+        pSync->pHeaderPeer = NULL;
+        for (int lp = 0; lp < BC_PROTO_PEER_MAX; lp++) {
+            struct bc_proto_peer_t *p = pSync->pPeers[lp];
+            if ((p != NULL) && (p->status >= 1)) {
+                pSync->pHeaderPeer = p;
+                DBG_PRINTF("[%s()]change header peer\n", __func__);
+                break;
+            }
+        }
+        if (pSync->pHeaderPeer == NULL) {
+            //引き継げる接続がない --> 次にverackを返した接続が最初からやり直す
+            sync_reset(pSync);
+            return;
+        }
+    }
+
+    //離脱した接続のmerkleblockを待っていた場合
+    sync_next(pSync);
+}
+
+
+/** 並列同期 : 同期状態の破棄
+ *
+ * headers担当がいなくなった場合に、要求中のroundとpHashQ[]を捨てる。
+ * 残っている接続の要求中merkleblockは、fin_merkleblock()で数えずに読み捨てる。
+ *
+ * @param[in,out]   pSync       並列同期の管理データ
+ */
+static void ICACHE_FLASH_ATTR sync_reset(struct bc_proto_sync_t *pSync)
+{
+    sync_free_hashq(pSync);
+    pSync->pHeaderPeer = NULL;
+    for (int rnd = 0; rnd < BC_PROTO_SYNC_ROUNDS; rnd++) {
+        MEMSET(pSync->rounds[rnd].rest, 0, sizeof(pSync->rounds[rnd].rest));
+    }
+    for (int lp = 0; lp < BC_PROTO_PEER_MAX; lp++) {
+        if (pSync->pPeers[lp] != NULL) {
+            pSync->pPeers[lp]->merkleCnt = 0;
+            pSync->pPeers[lp]->getdataRest = 0;
+        }
+    }
+    pSync->roundTop = 0;
+    pSync->roundNum = 0;
+    pSync->headersWait = 0;
+    pSync->fin = 0;
+    pSync->announced = 0;
+    pSync->retry = 0;
+    pSync->fromFirst = 0;
+    pSync->headersLater = 0;
+    pSync->stopNum = 0;
+    pSync->stopPos = 0;
+    pSync->hdrState = HDR_NONE;
+}
+
+
+/** 並列同期 : pHashQ[]解放
+ *
+ * @param[in,out]   pSync       並列同期の管理データ
+ */
+static void ICACHE_FLASH_ATTR sync_free_hashq(struct bc_proto_sync_t *pSync)
+{
+    if (pSync->pHashQ != NULL) {
+        FREE(pSync->pHashQ);
+        pSync->pHashQ = NULL;
+        pSync->pHdrQ = NULL;
+    }
+    pSync->hashQCap = 0;
+    pSync->hashQNum = 0;
+    pSync->hashQPos = 0;
+    pSync->hashQFill = 0;
+    pSync->skipNum = 0;
+}
+
+
+/** 並列同期 : roundのgetdata送信
+ *
+ * pHashQ[]の未要求分から、headers担当を先頭に、verack済みでfilterload送信済み、getdata作成中・送信中ではない接続へ
+ * 接続ごとにwnd件ずつgetdataする(#send_getdata()で分割送信する)。
+ *
+ * @param[in,out]   pSync       並列同期の管理データ
+ * @retval          1           roundを追加した
+ * @retval          0           getdataできる接続がない
+ */
+static int ICACHE_FLASH_ATTR sync_request(struct bc_proto_sync_t *pSync)
+{
+    struct bc_proto_sync_round_t *pRound = &pSync->rounds[(pSync->roundTop + pSync->roundNum) % BC_PROTO_SYNC_ROUNDS];
+    int req = 0;
+
+    MEMSET(pRound->rest, 0, sizeof(pRound->rest));
+    for (int lp = -1; (lp < BC_PROTO_PEER_MAX) && (pSync->hashQPos < pSync->hashQNum); lp++) {
+        //lp=-1 : headers担当
+        struct bc_proto_peer_t *p = (lp < 0) ? pSync->pHeaderPeer : pSync->pPeers[lp];
+        if ((p == NULL) || ((lp >= 0) && ((p == pSync->pHeaderPeer) || (p->status < 1))) ||
+                (p->pPayload != NULL) || (p->getdataRest != 0) || (p->hasFilterload)) {
+            continue;
+        }
+        int slot = lp;
+        if (slot < 0) {
+            for (slot = 0; pSync->pPeers[slot] != p; slot++) {
+            }
+        }
+
+        int cnt = pSync->hashQNum - pSync->hashQPos;
+        if (cnt > p->wnd) {
+            cnt = p->wnd;
+        }
+        if (p->merkleCnt == 0) {
+            //受信速度の計測開始
+            p->wndTick = bc_misc_tick();
+            p->wndRecv = 0;
+        }
+        p->pGetdataHash = pSync->pHashQ + BC_SZ_HASH256 * pSync->hashQPos;
+        p->getdataRest = (uint16_t)cnt;
+        p->merkleCnt += (uint16_t)cnt;
+        pRound->rest[slot] = (uint16_t)cnt;
+        pSync->hashQPos += cnt;
+        req++;
+        send_getdata(p);
+    }
+    if (req == 0) {
+        return 0;
+    }
+
+    MEMCPY(pRound->bhash, pSync->pHashQ + BC_SZ_HASH256 * (pSync->hashQPos - 1), BC_SZ_HASH256);
+    pSync->roundNum++;
+    return 1;
+}
+
+
+/** 並列同期 : 次のround
+ *
+ * 先頭から全merkleblockがそろったroundのBlock Hashを確定し、
+ * 要求中のroundがBC_PROTO_SYNC_ROUNDS個になるまでpHashQ[]から次のroundをgetdataする。
+ * pHashQ[]を全部要求し、getdataを送信し終わったら、headers担当から次のgetheadersを送信する(通知されたheadersの場合は送信しない)。
+ * headers担当がgetdata作成中の場合は、作成が終わってから呼び出すこと。
+ *
+ * @param[in,out]   pSync       並列同期の管理データ
+ */
+static void ICACHE_FLASH_ATTR sync_next(struct bc_proto_sync_t *pSync)
+{
+    if (pSync == NULL) {
+        return;
+    }
+    struct bc_proto_peer_t *pHead = pSync->pHeaderPeer;
+    if ((pHead == NULL) || (pHead->pPayload != NULL)) {
+        return;
+    }
+
+    if (pSync->retry) {
+        //欠けたroundは、そろっているところからやり直す
+        for (int lp = 0; lp < BC_PROTO_PEER_MAX; lp++) {
+            if ((pSync->pPeers[lp] != NULL) && (pSync->pPeers[lp]->merkleCnt != 0)) {
+                //要求済みの分が返ってくるのを待つ
+                return;
+            }
+        }
+        DBG_PRINTF("[%s()]retry\n", __func__);
+        sync_free_hashq(pSync);
+        pSync->roundNum = 0;
+        pSync->fin = 0;
+        pSync->retry = 0;
+        if (pSync->bhash[BC_SZ_HASH256 - 1] != 0xff) {
+            sync_getheaders(pSync, pSync->bhash);
+        }
+        else {
+            uint8_t hash[BC_SZ_HASH256];
+
+            bc_flash_get_last_bhash(hash);
+            sync_getheaders(pSync, hash);
+        }
+        return;
+    }
+
+    //先頭からそろったroundを確定する
+    while (pSync->roundNum > 0) {
+        struct bc_proto_sync_round_t *pRound = &pSync->rounds[pSync->roundTop];
+        int lp;
+        for (lp = 0; lp < BC_PROTO_PEER_MAX; lp++) {
+            if (pRound->rest[lp] != 0) {
+                break;
+            }
+        }
+        if (lp != BC_PROTO_PEER_MAX) {
+            //まだ返ってきていない
+            break;
+        }
+        MEMCPY(pSync->bhash, pRound->bhash, BC_SZ_HASH256);
+        pSync->roundTop = (pSync->roundTop + 1) % BC_PROTO_SYNC_ROUNDS;
+        pSync->roundNum--;
+    }
+
+    //次のround
+    while ((pSync->roundNum < BC_PROTO_SYNC_ROUNDS) && (pSync->hashQPos < pSync->hashQNum)) {
+        if (!sync_request(pSync)) {
+            break;
+        }
+    }
+
+    if ((pSync->hashQNum != 0) && (pSync->hashQPos == pSync->hashQNum) && !sync_sending(pSync)) {
+        //getdataの送信途中はpGetdataHashがpHashQ[]を指しているので、送信し終わってから解放する
+        //  最後のgetdataを送信したら、#bc_sent()から呼ばれる
+        if (pSync->announced) {
+            //通知されたblockを全部要求した --> 続きは次の通知を待つ
+            sync_free_hashq(pSync);
+            pSync->fin = 1;
+        }
+        else {
+            //pHashQ[]を全部要求した --> merkleblockを待たずに次のgetheaders
+            uint8_t hash[BC_SZ_HASH256];
 
-    bc_flash_get_last_bhash(hash);
-    send_getheaders(pConn, hash);
-#endif
+            MEMCPY(hash, pSync->pHashQ + BC_SZ_HASH256 * (pSync->hashQNum - 1), BC_SZ_HASH256);
+            sync_free_hashq(pSync);
+            sync_getheaders(pSync, hash);
+        }
+    }
 
-    return BC_PROTO_FIN;
+    if (pSync->fin && (pSync->roundNum == 0)) {
+        //全部そろった
+        pSync->fin = 0;
+        sync_finish(pSync);
+    }
 }
 
 
-/** 受信データ解析(ping)
- *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
+/** 並列同期 : getdataの送信途中か
  *
- * @note
- *          - pongを送信する
+ * @param[in]       pSync       並列同期の管理データ
+ * @retval          1           getdataを送信し終わっていない接続がある(pHashQ[]を参照している)
+ * @retval          0           全接続が送信済み
  */
-static int ICACHE_FLASH_ATTR read_ping(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static int ICACHE_FLASH_ATTR sync_sending(const struct bc_proto_sync_t *pSync)
 {
-    const uint8_t *p = pData;
-
-    DBG_PRINTF("  [ping]\n");
-
-    MEMCPY(&mPingNonce, p, sizeof(uint64_t));
-    if (mpPayload == NULL) {
-        //即時送信
-        send_pong(pConn, mPingNonce);
-    }
-    else {
-        //今の処理が終わってから送信
-        mHasPing = 1;
+    for (int lp = 0; lp < BC_PROTO_PEER_MAX; lp++) {
+        if ((pSync->pPeers[lp] != NULL) && (pSync->pPeers[lp]->getdataRest != 0)) {
+            return 1;
+        }
     }
-
-    //DBG_PRINTF("    LAST INV(LE)  : ");
-    //for (int i = 0; i < BC_SZ_HASH256; i++) {
-    //    DBG_PRINTF("%02x", mLastInvBhash[BC_SZ_HASH256 - i - 1]);
-    //}
-    //DBG_PRINTF("\n");
-    //DBG_PRINTF("    LAST HEAD(LE) : ");
-    //for (int i = 0; i < BC_SZ_HASH256; i++) {
-    //    DBG_PRINTF("%02x", mLastHeadersBhash[BC_SZ_HASH256 - i - 1]);
-    //}
-    //DBG_PRINTF("\n");
-
-    uint64_t nonce;
-    p += get64(p, &nonce);
-
-    *pLen -= p - pData;
-    return BC_PROTO_FIN;
+    return 0;
 }
 
 
-/** 受信データ解析(pong)
+/** 並列同期 : getheaders送信
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
+ * @param[in,out]   pSync       並列同期の管理データ
+ * @param[in]       pHash       block locator
  */
-static int ICACHE_FLASH_ATTR read_pong(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static void ICACHE_FLASH_ATTR sync_getheaders(struct bc_proto_sync_t *pSync, const uint8_t *pHash)
 {
-    const uint8_t *p = pData;
+    const uint8_t *p_stop = NULL;
+
+    if (MEMCMP(pSync->hdrchk.prevBhash, pHash, BC_SZ_HASH256) != 0) {
+        //前回のheadersの続きではない(開始時, やり直し) --> 検査状態と高さを取り直す
+        hdrchk_reset(&pSync->hdrchk, pHash);
+        pSync->height = bc_flash_get_height(pHash);
+        pSync->stopNum = 0;
+        pSync->stopPos = 0;
+    }
+    else if (pSync->stopPos < pSync->stopNum) {
+        //前回pHashQ[]に入らなかったheadersは、次の区切りまで要求する
+        p_stop = pSync->stopBhash[pSync->stopPos++];
+    }
 
-    DBG_PRINTF("  [pong]\n");
-    uint64_t nonce;
-    p += get64(p, &nonce);
-    DBG_PRINTF("   nonce : %08x%08x\n", (uint32_t)(nonce >> 32), (uint32_t)(nonce & 0xffffffff));
+    if (pSync->headersLater) {
+        //送信していないgetheadersがある --> 置き換える
+        MEMCPY(pSync->laterBhash, pHash, BC_SZ_HASH256);
+        pSync->laterStop = (p_stop != NULL);
+        return;
+    }
 
-    *pLen -= p - pData;
-    return BC_PROTO_FIN;
+    pSync->headersWait++;
+    if (send_getheaders(pSync->pHeaderPeer, pHash, p_stop) == SEND_LATER) {
+        //送信バッファの空き待ち --> 送信完了(#bc_sent())で送信する
+        MEMCPY(pSync->laterBhash, pHash, BC_SZ_HASH256);
+        pSync->laterStop = (p_stop != NULL);
+        pSync->headersLater = 1;
+    }
 }
 
 
-#if 0
-/** 受信データ解析(addr)
+/** 並列同期 : 初回同期完了
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
+ * @param[in,out]   pSync       並列同期の管理データ
  */
-static int ICACHE_FLASH_ATTR read_addr(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static void ICACHE_FLASH_ATTR sync_finish(struct bc_proto_sync_t *pSync)
 {
-    const uint8_t *p = pData;
+    //最後にmerkleblockがそろったblock hashを保存する
+    if (pSync->bhash[BC_SZ_HASH256 - 1] != 0xff) {
+        //最新のBlock Hashで起動した場合、bhash[]は未受信
+        bc_flash_save_last_bhash(pSync->bhash);
+        pSync->bhash[BC_SZ_HASH256 - 1] = 0xff;
+    }
+    bc_flash_hdr_flush();
+    DBG_PRINTF("[%s()]height=%u\n", __func__, pSync->height);
 
-    int lp;
-    int count;
+    if (pSync->pHeaderPeer->status == 2) {
+        //初回同期後に通知されたblockがそろった
+        return;
+    }
 
-    p += bc_misc_get_varint(p, &count);
+    CMD_MBED_SEND(BC_MBED_CMD_PREPARED, BC_MBED_CMD_PREPARED_LEN);  //準備完了
 
-    DBG_PRINTF("  [addr]\n");
-    DBG_PRINTF("   count : %d\n", count);
-    for (lp = 0; lp < count; lp++) {
-        DBG_PRINTF("   addr_list[%4d] :\n", lp);
-        //timestamp
-        DBG_PRINTF("    timestamp : ");
-        uint32_t timestamp;
-        p += get32(p, &timestamp);
-        print_time(timestamp);
-        //addr
-        DBG_PRINTF("    addr:\n");
-        struct net_addr_t addr;
-        p += get_netaddr(p, &addr);
-        print_netaddr(&addr);
+    //全headersが終わったので、mempoolを受け付ける
+    //  filterload前にmempoolすると全txがinvで通知されるため、filterloadの送信を待つ
+    if (pSync->pHeaderPeer->hasFilterload || (send_mempool(pSync->pHeaderPeer) == SEND_LATER)) {
+        //送信バッファの空き待ち --> 送信完了(#bc_sent())で送信する
+        pSync->pHeaderPeer->hasMempool = 1;
     }
 
-    *pLen -= p - pData;
-    return BC_PROTO_FIN;
+    //2は起動時のgetheadersが終わった意味
+    //  以降の新しいblockはheadersで通知してもらう
+    for (int lp = 0; lp < BC_PROTO_PEER_MAX; lp++) {
+        if (pSync->pPeers[lp] != NULL) {
+            pSync->pPeers[lp]->status = 2;
+            sync_sendheaders(pSync->pPeers[lp]);
+        }
+    }
 }
-#endif
 
 
-/** 受信データ解析(inv)
+/** 並列同期 : sendheaders送信
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
- * 
- * @note        内部で#read_nbyte()を呼び出す
+ * sendheaders(BIP130)に対応した接続だけに送信する。
+ * 初回同期中に通知されると要求したheadersと区別できないため、初回同期が終わってから送信する。
+ *
+ * @param[in,out]   pPeer       送信する接続
  */
-static int ICACHE_FLASH_ATTR read_inv(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static void ICACHE_FLASH_ATTR sync_sendheaders(struct bc_proto_peer_t *pPeer)
 {
-    static int sCount;                      //全部で回す回数(初回時に設定)
-                                            //最大で50000(bitcoin仕様)
+    if (pPeer->version < BC_SENDHEADERS_VERSION) {
+        return;
+    }
+    if (send_sendheaders(pPeer) == SEND_LATER) {
+        //送信バッファの空き待ち --> 送信完了(#bc_sent())で送信する
+        pPeer->hasSendheaders = 1;
+    }
+}
+
 
-    int ret = BC_PROTO_FIN;
-    const struct inv_t *pInv;
+/** 並列同期 : headersの破棄
+ *
+ * 検査に失敗したbatchはgetdataせずに捨て、headers担当を次の接続に替えて、そろっているところからやり直す。
+ * 他に接続がなければ、同じ接続でやり直す。
+ *
+ * @param[in,out]   pSync       並列同期の管理データ
+ */
+static void ICACHE_FLASH_ATTR sync_reject_headers(struct bc_proto_sync_t *pSync)
+{
+    int cur;
 
-    DBG_PRINTF("  [inv]\n");
+    sync_free_hashq(pSync);
 
-    if (*pLen == 0) {
-        DBG_PRINTF("    ... more read inv_t = 0\n");
-        return BC_PROTO_CONT;
+    for (cur = 0; (cur < BC_PROTO_PEER_MAX) && (pSync->pPeers[cur] != pSync->pHeaderPeer); cur++) {
     }
-
-    //count
-    if (sCount == 0) {
-        //初回
-        uint64_t val;
-        int len = *pLen;
-        ret = read_varint(pData, pLen, &val);
-        if (ret == BC_PROTO_CONT) {
-            *pLen = 0;
-            //DBG_PRINTF("    ... more read inv count\n");
-            return BC_PROTO_CONT;  //countが決まるまでは進まない
+    for (int lp = 1; lp < BC_PROTO_PEER_MAX; lp++) {
+        struct bc_proto_peer_t *p = pSync->pPeers[(cur + lp) % BC_PROTO_PEER_MAX];
+        if ((p != NULL) && (p->status >= 1)) {
+            pSync->pHeaderPeer = p;
+            DBG_PRINTF("[%s()]change header peer\n", __func__);
+            break;
         }
-        pData += len - *pLen;
-        mProto.length -= len - *pLen;
-        sCount = (int)val;
-        DBG_PRINTF("   count : %d\n", sCount);
-    }
-    if (sCount == 0) {
-        //あり得るのかわからないが、countが0だった場合はここで終わり
-        return BC_PROTO_FIN;
     }
 
-    //inv_t
-    uint8_t *pPkt = read_nbyte(pData, pLen, sizeof(struct inv_t));
-    if (pPkt == NULL) {
-        *pLen = 0;
-        //DBG_PRINTF("    ... more read inv_t\n");
-        return BC_PROTO_CONT;  //inv_t不足
-    }
-    pInv = (const struct inv_t *)pPkt;
-    print_inv(pInv);
+    //送信していないgetheadersは、やり直しで送信し直す
+    pSync->headersLater = 0;
+    pSync->retry = 1;
+    sync_next(pSync);
+}
 
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
-    switch (pInv->type) {
-    case INV_MSG_TX:
-        //getdata
-        if (mpPayload != NULL) {
-            (*pProto->payload)++;
-            MEMCPY(mpPayload, pInv, sizeof(struct inv_t));
-            pProto->length += sizeof(struct inv_t);
-            mpPayload += sizeof(struct inv_t);
-            if (mpPayload - mBufferWPnt > SZ_SEND_BUF) {
-                DBG_PRINTF("oops! Buffer full \n");
-                HALT();
-            }
 
-            DBG_PRINTF("getdata - %d\n", *pProto->payload);
-        }
-        else {
-            //getdataの準備
-            set_header(pProto, kCMD_GETDATA);
-            *pProto->payload = 1;     //1つ目
-            mpPayload = pProto->payload + 1;        //var_int=1byte分
-            MEMCPY(mpPayload, pInv, sizeof(struct inv_t));
-            mpPayload += sizeof(struct inv_t);
-            pProto->length = 1 + sizeof(struct inv_t);
+/** 並列同期 : batchの記録
+ *
+ * checksumを照合したbatchのheaderを、高さを数えてFLASHに記録する。
+ * ウォレット作成前で進めたheaderは最後の1件だけ、pHashQ[]にためたheaderは全部記録する。
+ *
+ * @param[in,out]   pSync       並列同期の管理データ
+ */
+static void ICACHE_FLASH_ATTR sync_commit(struct bc_proto_sync_t *pSync)
+{
+    uint32_t height = pSync->batchHeight;
 
-            DBG_PRINTF("getdata - first\n");
-        }
-        break;
-    case INV_MSG_BLOCK:
-        //最後に通知されたBhash更新
-        MEMCPY(mLastInvBhash, pInv->hash, BC_SZ_HASH256);
-        break;
+    if (pSync->batchFork) {
+        //block locatorの途中から続いている --> 分岐点から記録し直す
+        pSync->hdrTop = (height != 0) ? height - 1 : 0;
+        DBG_PRINTF("[%s()]fork(height=%u)\n", __func__, pSync->hdrTop);
     }
-
-    FREE(pPkt);
-    sCount--;
-    mProto.length -= sizeof(struct inv_t);
-    if (mProto.length > 0) {
-        //継続
-        //DBG_PRINTF("    ... more read(%d)(%d) ...\n", sCount, mProto.length);
-        ret = BC_PROTO_CONT;
+    if (pSync->skipNum > 0) {
+        sync_record(pSync, (height != 0) ? height + pSync->skipNum - 1 : 0,
+                    pSync->skipBhash, pSync->skipBits, pSync->skipTime);
     }
-    else {
-        //終了
-        DBG_PRINTF("    ... end inv ...\n");
-        sCount = 0;
-        ret = BC_PROTO_FIN;
-
-        //MSG_BLOCKがあるなら、次回のgetheaders負荷を減らすために更新
-        if ((mStatus > 1) && (mLastInvBhash[BC_SZ_HASH256 - 1] != 0xff)) {
-            //1はgetheaders中
-            bc_flash_save_last_bhash(mLastInvBhash);
-            mLastInvBhash[BC_SZ_HASH256 - 1] = 0xff;        //Bitcoinの仕様上、先頭は0x00のため
-        }
-
-        if (mpPayload != NULL) {
-            //ここまでをgetdataする
-            DBG_PRINTF("  *** send getdata[cnt:%d] ***\n", *pProto->payload);
-            send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
-            mpPayload = NULL;
-        }
+    for (int lp = 0; lp < pSync->hashQFill; lp++) {
+        sync_record(pSync, (height != 0) ? height + pSync->skipNum + lp : 0,
+                    pSync->pHashQ + BC_SZ_HASH256 * lp, pSync->pHdrQ[lp].bits, pSync->pHdrQ[lp].timestamp);
     }
-
-    return ret;
+    bc_flash_hdr_flush();
 }
 
 
-/** 受信データ解析(block)
+/** 並列同期 : header記録
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in]       Len         受信データ長
- * @return          処理バイト長
+ * 記録済みの高さ(retryで取り直したheader)と、高さが不明なheaderは記録しない。
+ *
+ * @param[in,out]   pSync       並列同期の管理データ
+ * @param[in]       Height      block高さ(0:不明)
+ * @param[in]       pBhash      Block Hash
+ * @param[in]       Bits        難易度
+ * @param[in]       Timestamp   block作成時間
  */
-static int ICACHE_FLASH_ATTR read_block(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static void ICACHE_FLASH_ATTR sync_record(struct bc_proto_sync_t *pSync, uint32_t Height, const uint8_t *pBhash, uint32_t Bits, uint32_t Timestamp)
 {
-    const uint8_t *p = pData;
-    int lp;
-
-    DBG_PRINTF("  [block]\n");
-    struct headers_t head;
-    p += get_headers(p, &head) - 1; //txn_countはこちらで処理する
-    print_headers(&head);
-
-    //tx
-    int txn_count;
-    p += bc_misc_get_varint(p, &txn_count);
-    DBG_PRINTF("   txn_count : %d\n", txn_count);
-    for (lp = 0; lp < txn_count; lp++) {
-        DBG_PRINTF("%02x", *p);
-        p++;
+    if ((Height != 0) && (Height > pSync->hdrTop)) {
+        bc_flash_hdr_add(Height, pBhash, Bits, Timestamp);
+        pSync->hdrTop = Height;
     }
-    DBG_PRINTF("\n");
-
-    *pLen -= p - pData;
-    return BC_PROTO_FIN;
 }
 
 
-/** 受信データ解析(tx)
+///////////////
+// headers検査
+///////////////
+
+/** headers検査 : 取り直し
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
+ * 記録済みのheader(なければcheckpoint)から、直前のtimestampと難易度を取り直す。
+ * どちらにもない場合、難易度は分岐点(やり直し位置)の前後で大きく変わらないため、refBitsは残す。
+ *
+ * @param[out]      pChk        検査状態
+ * @param[in]       pBhash      次に受信するheaderのprev_block(getheadersのblock locator)
  */
-static int ICACHE_FLASH_ATTR read_tx(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static void ICACHE_FLASH_ATTR hdrchk_reset(struct bc_proto_hdrchk_t *pChk, const uint8_t *pBhash)
 {
-    const uint8_t *p = pData;
-    uint8_t flg_pubkey = 0;
-    uint8_t flg_bcaddr = 0;
-    uint8_t flg_opret = 0;
-    int lp;
-    struct bc_flash_wlt_t wlt;
-    struct bc_proto_tx proto_tx;
-
-    DBG_PRINTF("  [tx]\n");
+    struct bc_flash_hdr_t hdr;
+    struct bc_checkpoint_t cp;
+    uint32_t bits = 0;
+    uint32_t timestamp = 0;
+    int found = 1;
+
+    if (bc_flash_hdr_find(&hdr, pBhash)) {
+        bits = hdr.bits;
+        timestamp = hdr.timestamp;
+    }
+    else if (bc_checkpoint_find(pBhash, &cp)) {
+        bits = cp.bits;
+        timestamp = cp.timestamp;
+    }
+    else {
+        found = 0;
+    }
 
-    bc_flash_get_bcaddr(&wlt);
+    pChk->timeTop = 0;
+    pChk->timeNum = 0;
+    if (timestamp != 0) {
+        pChk->time[0] = timestamp;
+        pChk->timeTop = 1;
+        pChk->timeNum = 1;
+    }
+    if (found) {
+        //最低難易度のblockからは、retargetの間の難易度がわからない
+        pChk->refBits = (bits != BITS_POW_LIMIT) ? bits : 0;
+    }
+    MEMCPY(pChk->prevBhash, pBhash, BC_SZ_HASH256);
+}
 
-    //check size
-    BC_LEN_CHECK(mProto, *pLen);
 
-    proto_tx.pTx = pData;
-    proto_tx.Len = (uint16_t)mProto.length;
+/** headers検査 : 1header
+ *
+ * 以下を検査し、問題なければ検査状態を進める。
+ *      - prev_blockが直前のheaderのBlock Hashと一致する
+ *      - Block Hashがbitsのtarget以下(PoW)で、targetがpowLimit以下
+ *      - 難易度
+ *          - retargetの間はrefBitsと同じ
+ *          - 最低難易度は前のheaderからPOW_LIMIT_SPACINGより後だけ許可する(testnet3)
+ *          - retargetの高さ(高さが不明な場合は全部)は、直近の難易度からRETARGET_FACTOR倍以内
+ *      - timestampが直近BC_PROTO_HDRCHK_TIMES件のmedianより後で、現在時刻+MAX_FUTURE_TIME以前
+ *
+ * 分岐(block locatorの途中から続いている)場合は、呼び出し元で#hdrchk_reset()しておくこと。
+ * Trustedの場合はprev_blockだけを検査する(checkpointで照合するため)。
+ *
+ * @param[in,out]   pChk        検査状態
+ * @param[in]       pHead       header
+ * @param[in]       pBhash      headerのBlock Hash
+ * @param[in]       Height      headerのblock高さ(0:不明)
+ * @param[in]       Trusted     1:checkpoint以下のheader
+ * @retval          1           OK
+ * @retval          0           不正なheader
+ */
+static int ICACHE_FLASH_ATTR hdrchk_verify(struct bc_proto_hdrchk_t *pChk, const struct headers_t *pHead, const uint8_t *pBhash, uint32_t Height, int Trusted)
+{
+    uint8_t target[BC_SZ_HASH256];
+    uint8_t limit[BC_SZ_HASH256];
+    uint32_t bits = pHead->bits;
+    uint32_t timestamp = pHead->timestamp;
+    int retarget = (Height == 0) || (Height % RETARGET_INTERVAL == 0);
+
+    //prev_block
+    if (MEMCMP(pHead->prev_block, pChk->prevBhash, BC_SZ_HASH256) != 0) {
+        DBG_PRINTF("[%s()]prev_block mismatch\n", __func__);
+        return 0;
+    }
 
-    //version
-//int32_t version;
-//get32(p, (uint32_t *)&version);
-//DBG_PRINTF("   version : %d\n", version);
-    p += sizeof(int32_t);
-    //tx_in count
-    int txn_in_count;
-    p += bc_misc_get_varint(p, &txn_in_count);
-
-    for (lp = 0; lp  < txn_in_count; lp++) {
-        //previous_output
-//DBG_PRINTF("     prev_output :");
-//for (int i = 0; i < BC_SZ_HASH256; i++) {
-//    DBG_PRINTF("%02x", *(p + BC_SZ_HASH256 - i -1));
-//}
-//DBG_PRINTF("\n");
-        proto_tx.pPrevOutput = p;
-        p += BC_SZ_HASH256;
-        //  index
-//uint32_t index;
-//get32(p, &index);
-//DBG_PRINTF("       index : %u\n", index);
-        p += sizeof(uint32_t);
-        //script length
-        int scr_len;
-        p += bc_misc_get_varint(p, &scr_len);
-        if (scr_len > 255) {
-            //[len+署名][len+公開鍵]
-            DBG_PRINTF("     script length : %d\n", scr_len);
-            goto func_end;
-        }
-        //signature script
-        //  sign
-        p += 1 + *p;        //1byte長
-        //  pubkey
-        if (*p != BC_SZ_PUBKEY) {
-            //公開鍵長は33byte
-            DBG_PRINTF("     pubkey length : %d\n", *p);
-            goto func_end;
-        }
-        p++;
-        if (MEMCMP(p, wlt.pubkey, BC_SZ_PUBKEY) == 0) {
-            //公開鍵一致
-            DBG_PRINTF("  match pubkey!\n");
-            flg_pubkey = 1;
-        }
-        p += BC_SZ_PUBKEY;
-////sequence
-//uint32_t sequence;
-//get32(p, &sequence);
-//DBG_PRINTF("     sequence : %u\n", sequence);
-        p += sizeof(uint32_t);
-    }
-
-    //tx_out count
-    int txn_out_count;
-    p += bc_misc_get_varint(p, &txn_out_count);
-    if (txn_out_count < 2) {
-        //outputは2以上
-        DBG_PRINTF("    txn_out count : %d\n", txn_out_count);
-        goto func_end;
-    }
-    //tx_out
-    for (lp = 0; lp < txn_out_count; lp++) {
-        //value
-//uint64_t value;
-//get64(p, &value);
-//DBG_PRINTF("     value : %lld\n", value);
-        p += sizeof(uint64_t);
-        //pk_script length
-        int pk_scr_len;
-        p += bc_misc_get_varint(p, &pk_scr_len);
-        if (pk_scr_len > 255) {
-            DBG_PRINTF("     pk_script length : %d\n", pk_scr_len);
-            goto func_end;
-        }
-
-        //signature script
-//DBG_PRINTF("     pk_script[%d] : ", lp);
-//for (int i = 0; i < pk_scr_len; i++) {
-//    DBG_PRINTF("%02x", *(p + i));
-//}
-//DBG_PRINTF("\n");
+    if (!Trusted) {
+        //PoW
+        bits_to_target(limit, BITS_POW_LIMIT);
+        if (!bits_to_target(target, bits) || (cmp_uint256(target, limit) > 0)) {
+            DBG_PRINTF("[%s()]bad bits : %08x\n", __func__, bits);
+            return 0;
+        }
+        if (cmp_uint256(pBhash, target) > 0) {
+            DBG_PRINTF("[%s()]bad PoW\n", __func__);
+            return 0;
+        }
 
-        //OUTPUT1
-        if ((lp == 0) && !flg_pubkey && (pk_scr_len >= 23)) {   //OP_DUP(1) OP_HASH160(1) LEN(1) BCADDR(20) 
-            if ((p[0] != OP_DUP) && (p[1] != OP_HASH160) && (p[2] != (uint8_t)BC_SZ_HASH160)) {
-                DBG_PRINTF("not [OP_DUP][OP_HASH160]\n");
-                goto func_end;
-            }
-            if (MEMCMP(&p[3], wlt.bcaddr, sizeof(wlt.bcaddr)) == 0) {
-                //output1のBitcoinアドレスが一致
-                DBG_PRINTF("  match bcaddr!\n");
-                flg_bcaddr = 1;
-            }
-            else {
-                DBG_PRINTF("not match bcaddr\n");
-                goto func_end;
+        //難易度
+        if (retarget) {
+            //retarget直前が最低難易度のblockだった場合は、最低難易度から計算される(testnet3)
+            if ((bits != BITS_POW_LIMIT) && (pChk->refBits != 0) &&
+                    !bits_in_window(bits, pChk->refBits) && !bits_in_window(bits, BITS_POW_LIMIT)) {
+                DBG_PRINTF("[%s()]bad difficulty : %08x(ref=%08x)\n", __func__, bits, pChk->refBits);
+                return 0;
             }
         }
-        //OUTPUT2
-        else if ((lp == 1) && (pk_scr_len >= 2)) {   //OP_RETURN(1) LEN(1)
-            if (p[0] == OP_RETURN) {
-                DBG_PRINTF("  detect OP_RETURN\n");
-                flg_opret = 1;
-                proto_tx.pOpReturn = p + 1;
+        else if (bits != pChk->refBits) {
+            if (bits == BITS_POW_LIMIT) {
+                //前のheaderのtimestampが不明な場合は検査しない
+                uint32_t prev = (pChk->timeNum > 0) ?
+                        pChk->time[(pChk->timeTop + BC_PROTO_HDRCHK_TIMES - 1) % BC_PROTO_HDRCHK_TIMES] : 0;
+                if ((prev != 0) && (timestamp <= prev + POW_LIMIT_SPACING)) {
+                    DBG_PRINTF("[%s()]too early min difficulty : %u(prev=%u)\n", __func__, timestamp, prev);
+                    return 0;
+                }
+            }
+            else if (pChk->refBits != 0) {
+                DBG_PRINTF("[%s()]bad difficulty : %08x(ref=%08x)\n", __func__, bits, pChk->refBits);
+                return 0;
             }
         }
-        p += pk_scr_len;
-    }
-    //lock_time
-//uint32_t lock_time;
-//get32(p, &lock_time);
-//DBG_PRINTF("    lock_time : %u\n", lock_time);
-    //p += sizeof(uint32_t);
 
-    if (flg_opret) {
-        if (flg_pubkey) {
-            //TX(a)
-            bc_flash_update_txinfo(BC_FLASH_TYPE_TXA, &proto_tx);
-        }
-        else if (flg_bcaddr && (txn_in_count == 1)) {
-            //TX(b)
-            bc_flash_update_txinfo(BC_FLASH_TYPE_TXB, &proto_tx);
+        //timestamp(件数がそろうまでは検査しない)
+        if ((pChk->timeNum == BC_PROTO_HDRCHK_TIMES) && (timestamp <= hdrchk_median_time(pChk))) {
+            DBG_PRINTF("[%s()]bad timestamp : %u\n", __func__, timestamp);
+            return 0;
         }
-        else {
-            DBG_PRINTF("no match flags\n");
+#ifdef __XTENSA__
+        uint32_t now = bc_misc_time_get();
+        if ((now != BC_TIME_INVALID) && (timestamp > now + MAX_FUTURE_TIME)) {
+            DBG_PRINTF("[%s()]future timestamp : %u(now=%u)\n", __func__, timestamp, now);
+            return 0;
         }
+#endif  //__XTENSA__
     }
-    else {
-        DBG_PRINTF("no OP_RETURN\n");
+
+    //検査状態を進める
+    pChk->time[pChk->timeTop] = timestamp;
+    pChk->timeTop = (pChk->timeTop + 1) % BC_PROTO_HDRCHK_TIMES;
+    if (pChk->timeNum < BC_PROTO_HDRCHK_TIMES) {
+        pChk->timeNum++;
+    }
+    if ((Height != 0) && (Height % RETARGET_INTERVAL == 0)) {
+        //retargetの間の難易度
+        pChk->refBits = bits;
     }
+    else if ((bits != BITS_POW_LIMIT) && ((Height == 0) || (pChk->refBits == 0))) {
+        pChk->refBits = bits;
+    }
+    MEMCPY(pChk->prevBhash, pBhash, BC_SZ_HASH256);
 
-func_end:
-    *pLen -= mProto.length;
-    return BC_PROTO_FIN;
+    return 1;
 }
 
 
-/** 受信データ解析(headers)
+/** headers検査 : 直近のtimestampのmedian
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
- * 
- * @note        内部で#read_nbyte()を呼び出す
- */
-static int ICACHE_FLASH_ATTR read_headers(struct espconn *pConn, const uint8_t *pData, int *pLen)
-{
-    static int sCount = 0;                  //全部で回す回数(初回時に設定)
-                                            //最大で2000(bitcoin仕様)
-    static int sGetCnt;                     //続けてgetheadersするときのsCount
-
-    int ret = BC_PROTO_FIN;
-
-    if (*pLen == 0) {
-        DBG_PRINTF("    ... more read headers_t = 0\n");
-        return BC_PROTO_CONT;
-    }
-
-    //count
-    if (sCount == 0) {
-        //初回
-        uint64_t val;
-        int len = *pLen;
-
-        //DBG_PRINTF("  [headers]");
-        ret = read_varint(pData, pLen, &val);
-        if (ret == BC_PROTO_CONT) {
-            *pLen = 0;
-            //DBG_PRINTF("    ... more read headers count\n");
-            return BC_PROTO_CONT;  //countが決まるまでは進まない
-        }
-        pData += len - *pLen;
-        mProto.length -= len - *pLen;
-        sCount = (int)val;
-        //DBG_PRINTF("   count : %d\n", sCount);
-
-        if (sCount > 0) {
-            //次にgetheadersするときのsCountを決める
-            if (sCount >= GETDATA_NUM) {
-                //送信バッファに収まらないため、件数を制限する
-                sGetCnt = sCount - GETDATA_NUM;
-            }
-            else {
-                //それ以外なら、最後のblock
-                sGetCnt = 0;
-            }
-            //DBG_PRINTF("   get count : %d\n", sGetCnt);
-
-            //getdataの準備
-            struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
-            set_header(pProto, kCMD_GETDATA);
-            mMerkleCnt = (uint8_t)(sCount - sGetCnt);
-            mpPayload = pProto->payload;
-            *mpPayload = mMerkleCnt;
-            pProto->length = 1 + sizeof(struct inv_t) * (*mpPayload);
-            mpPayload++;
+ * @param[in]       pChk        検査状態
+ * @return          median
+ */
+static uint32_t ICACHE_FLASH_ATTR hdrchk_median_time(const struct bc_proto_hdrchk_t *pChk)
+{
+    uint32_t sorted[BC_PROTO_HDRCHK_TIMES];
+
+    //件数が少ないので挿入ソート
+    for (int lp = 0; lp < pChk->timeNum; lp++) {
+        uint32_t val = pChk->time[lp];
+        int pos = lp;
+        while ((pos > 0) && (sorted[pos - 1] > val)) {
+            sorted[pos] = sorted[pos - 1];
+            pos--;
         }
+        sorted[pos] = val;
     }
-    if (sCount == 0) {
-        //countが0だった場合はここで終わり
-        sGetCnt = -1;
-
-//        DBG_PRINTF("    LAST HEAD(LE) : ");
-//        for (int i = 0; i < BC_SZ_HASH256; i++) {
-//            DBG_PRINTF("%02x", mLastHeadersBhash[BC_SZ_HASH256 - i - 1]);
-//        }
-//        DBG_PRINTF("\n");
-
-        //最後にheadersで受信したblock hashを保存する
-        if (mLastHeadersBhash[BC_SZ_HASH256 - 1] != 0xff) {
-            //最新のBlock Hashで起動した場合、mLastHeadersBhash[]は未受信
-            bc_flash_save_last_bhash(mLastHeadersBhash);
-        }
+    return sorted[pChk->timeNum / 2];
+}
 
-        CMD_MBED_SEND(BC_MBED_CMD_PREPARED, BC_MBED_CMD_PREPARED_LEN);  //準備完了
 
-        //全headersが終わったので、mempoolを受け付ける
-        send_mempool(pConn);
+/** bitsからtargetに変換
+ *
+ * @param[out]      pTarget     target(32byte, little endian)
+ * @param[in]       Bits        bits(compact形式)
+ * @retval          1           OK
+ * @retval          0           不正なbits(負数, 0, 256bitを超える)
+ */
+static int ICACHE_FLASH_ATTR bits_to_target(uint8_t *pTarget, uint32_t Bits)
+{
+    int exponent = (int)(Bits >> 24);
+    uint32_t mantissa = Bits & 0x007fffff;
+    int ret = 0;
 
-        //2は起動時のgetheadersが終わった意味
-        mStatus = 2;
-        return BC_PROTO_FIN;
+    if (Bits & 0x00800000) {
+        //負数
+        return 0;
     }
-
-    //headers_t
-    uint8_t *pPkt = read_nbyte(pData, pLen, sizeof(struct headers_t));
-    if (pPkt == NULL) {
-        *pLen = 0;
-        //DBG_PRINTF("    ... more read headers_t\n");
-        DBG_PRINTF("_");
-        return BC_PROTO_CONT;  //headers_t不足
-    }
-
-//    bc_misc_hash256(mLastHeadersBhash, pPkt, sizeof(struct headers_t) - 1);
-//    DBG_PRINTF("[sCount=%d, sGetCnt=%d]\n", sCount, sGetCnt);
-//    print_headers((const struct headers_t *)pPkt);
-    sCount--;
-    if (sCount >= sGetCnt) {
-        //getdataにためる
-        bc_misc_hash256(mLastHeadersBhash, pPkt, sizeof(struct headers_t) - 1); //block hash
-
-        //もしBlock#1だったら、途中から開始したい
-        if (MEMCMP(mLastHeadersBhash, kBhash1, BC_SZ_HASH256) == 0) {
-            //Genesis!
-            DBG_PRINTF("get #1 BHash!\n");
-            int erase_ret = bc_flash_erase_last_bhash();
-            if (erase_ret) {
-                //再起動してやり直す
-#ifdef __XTENSA__
-                //FLASHの処理をせずに再起動
-                system_os_post(TASK_PRIOR_MAIN, TASK_REQ_REBOOT, 1);
-#endif  //__XTENSA__
-                *pLen = 0;
-                return BC_PROTO_FIN;
-            }
+    MEMSET(pTarget, 0, BC_SZ_HASH256);
+    for (int lp = 0; lp < 3; lp++) {
+        uint8_t val = (uint8_t)(mantissa >> (8 * lp));
+        int pos = exponent - 3 + lp;
+        if ((pos < 0) || (val == 0)) {
+            continue;
+        }
+        if (pos >= BC_SZ_HASH256) {
+            //256bitを超える
+            return 0;
         }
+        pTarget[pos] = val;
+        ret = 1;
+    }
+    return ret;
+}
 
-        //inv
-        bc_misc_add(&mpPayload,  INV_MSG_FILTERED_BLOCK, sizeof(uint32_t));
-        MEMCPY(mpPayload, mLastHeadersBhash, BC_SZ_HASH256);
-        mpPayload += BC_SZ_HASH256;
 
-        //print_headers((const struct headers_t *)pPkt);
-        DBG_PRINTF("=");        //プログレスバー代わりのログ
+/** bitsが基準のbitsからRETARGET_FACTOR倍以内か
+ *
+ * compact形式の切り捨て分は許容する。
+ *
+ * @param[in]       Bits        検査するbits
+ * @param[in]       Ref         基準のbits
+ * @retval          1           範囲内
+ * @retval          0           範囲外
+ */
+static int ICACHE_FLASH_ATTR bits_in_window(uint32_t Bits, uint32_t Ref)
+{
+    int exp_a = (int)(Bits >> 24);
+    int exp_b = (int)(Ref >> 24);
+    uint32_t mant_a = Bits & 0x007fffff;
+    uint32_t mant_b = Ref & 0x007fffff;
+
+    if ((mant_a == 0) || (mant_b == 0)) {
+        return 0;
     }
-    else {
-        DBG_PRINTF(".");        //プログレスバー代わりのログ
+    //mantissaを16bit以上にそろえる
+    while (mant_a < 0x8000) {
+        mant_a <<= 8;
+        exp_a--;
     }
-
-    FREE(pPkt);
-    mProto.length -= sizeof(struct headers_t);
-    if (mProto.length > 0) {
-        //継続
-        //DBG_PRINTF("    ... more read(rest=%d)(%d) ...\n", sCount, mProto.length);
-        ret = BC_PROTO_CONT;
+    while (mant_b < 0x8000) {
+        mant_b <<= 8;
+        exp_b--;
     }
-    else {
-        //終了
-//        DBG_PRINTF("    ... end headers\n");
-
-        //ここまでをgetdataする
-//        uint8_t *pRead = &mBufferWPnt[4 + 12 + 4 + 4 + 1];
-//        for (int lp = 0; lp < mBufferWPnt[4 + 12 + 4 + 4]; lp++) {
-//            DBG_PRINTF("\ngetdata[%2d]\n", lp);
-//            print_inv((const struct inv_t *)pRead);
-//            pRead += sizeof(struct inv_t);
-//        }
-        DBG_PRINTF("@@@ send getdata[cnt:%d] @@@\n", mBufferWPnt[4 + 12 + 4 + 4]);
-        send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
-        mpPayload = NULL;
 
-        sCount = 0;
-        ret = BC_PROTO_FIN;
+    //exponentが2以上違えば256倍以上違う
+    int diff = exp_a - exp_b;
+    if ((diff > 1) || (diff < -1)) {
+        return 0;
     }
-
-    return ret;
+    //exponentの差(-1～1)を、aを0～2byte, bを1byteずらしてそろえる
+    uint64_t a = (uint64_t)mant_a << (8 * (1 + diff));
+    uint64_t b = (uint64_t)mant_b << 8;
+    return (a <= b * RETARGET_FACTOR) && (b <= a * RETARGET_FACTOR + (b >> 12));
 }
 
 
-/** 受信データ解析(merkleblock)
+/** 256bit整数(little endian)の比較
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
+ * @param[in]       pA          比較元
+ * @param[in]       pB          比較先
+ * @retval          1           pA > pB
+ * @retval          0           pA == pB
+ * @retval          -1          pA < pB
  */
-static int ICACHE_FLASH_ATTR read_merkleblock(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static int ICACHE_FLASH_ATTR cmp_uint256(const uint8_t *pA, const uint8_t *pB)
 {
-    int ret;
+    for (int lp = BC_SZ_HASH256 - 1; lp >= 0; lp--) {
+        if (pA[lp] != pB[lp]) {
+            return (pA[lp] > pB[lp]) ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
 
-    //DBG_PRINTF("  [merkleblock]\n");
+///////////////
+// getdata件数ウィンドウ
+///////////////
 
-    //解析の必要あり？
-    //今のところ感じていないので、ここで直接見てみる。
-    //print_headers((const struct headers_t *)pData);
+/** ウィンドウ評価
+ *
+ * 接続ごとにroundの分を受信し終わったときに呼び出す。
+ * 受信速度が落ちていなければ、TCPのslow startのようにwndを増やす(ssthresh未満は倍、以上はWND_STEPずつ)。
+ * 受信速度がそれまでの平均(rate)の半分未満に落ちたら、wndを縮小する。
+ *
+ * @param[in,out]   pPeer       管理データ
+ */
+static void ICACHE_FLASH_ATTR wnd_update(struct bc_proto_peer_t *pPeer)
+{
+    uint32_t now = bc_misc_tick();
+    uint32_t elapsed = now - pPeer->wndTick;
 
-    if (mProto.length > *pLen) {
-        //まだデータが来る
-        DBG_PRINTF("m");
-        mProto.length -= *pLen;
-        *pLen = 0;
-        ret = BC_PROTO_CONT;
-        //DBG_PRINTF("   rest : %d\n", mProto.length);
+    if (elapsed == 0) {
+        elapsed = 1;
     }
-    else {
-        //もうデータは来ない
-        DBG_PRINTF("M");
-        *pLen -= mProto.length;
-        ret = BC_PROTO_FIN;
-        //DBG_PRINTF("   rest : 0\n");
+    uint32_t rate = (uint32_t)((uint64_t)pPeer->wndRecv * 1000000 / elapsed);
+    pPeer->wndTick = now;
+    pPeer->wndRecv = 0;
+    pPeer->wndCut = 0;
+    if (pPeer->rate == 0) {
+        pPeer->rate = rate;
     }
 
-    if (mMerkleCnt) {
-        mMerkleCnt--;
-        //DBG_PRINTF("  rest merkleblock : %d\n", mMerkleCnt);
-        if (mMerkleCnt == 0) {
-            //全部返ってきた --> 次のgetheaders
-            send_getheaders(pConn, mLastHeadersBhash);
+    if (rate < pPeer->rate / 2) {
+        //受信が滞った
+        wnd_shrink(pPeer);
+    }
+    else {
+        if (pPeer->wnd < pPeer->ssthresh) {
+            pPeer->wnd *= 2;
+        }
+        else {
+            pPeer->wnd += WND_STEP;
+        }
+        if (pPeer->wnd > WND_MAX) {
+            pPeer->wnd = WND_MAX;
         }
     }
-
-    return ret;
+    pPeer->rate = (pPeer->rate * 3 + rate) / 4;
+    DBG_PRINTF("[%s()]wnd=%u, ssthresh=%u, rate=%u\n", __func__, pPeer->wnd, pPeer->ssthresh, pPeer->rate);
 }
 
 
-/** 受信データ解析(未処理)
+/** ウィンドウ縮小
  *
- * @param[in]       pConn       管理データ
- * @param[in]       p           受信データ
- * @param[in,out]   pLen        [in]受信データ長, [out]処理サイズを引いたデータ長
- * @return          処理結果(BC_PROTO_FIN..解析完了, BC_PROTO_CONT..解析継続)
+ * @param[in,out]   pPeer       管理データ
  */
-static int ICACHE_FLASH_ATTR read_unknown(struct espconn *pConn, const uint8_t *pData, int *pLen)
+static void ICACHE_FLASH_ATTR wnd_shrink(struct bc_proto_peer_t *pPeer)
 {
-    int ret;
-
-    DBG_PRINTF("  [%s] read out\n", mProto.command);
-    if (mProto.length > *pLen) {
-        //まだデータが来る
-        mProto.length -= *pLen;
-        *pLen = 0;
-        ret = BC_PROTO_CONT;
-        DBG_PRINTF("   rest : %d\n", mProto.length);
-    }
-    else {
-        //もうデータは来ない
-        *pLen -= mProto.length;
-        ret = BC_PROTO_FIN;
-        DBG_PRINTF("   rest : 0\n");
+    pPeer->ssthresh = pPeer->wnd / 2;
+    if (pPeer->ssthresh < WND_MIN) {
+        pPeer->ssthresh = WND_MIN;
     }
-    return ret;
+    pPeer->wnd = pPeer->ssthresh;
 }
 
 
 /** Bitcoinパケット送信(version)
  *
- * @param[in]       pConn       管理データ
- * @return          送信結果(0..OK)
+ * @param[in]       pPeer       管理データ
+ * @return          送信結果(0..OK, SEND_LATER..送信バッファに空きがない)
  */
-static int ICACHE_FLASH_ATTR send_version(struct espconn *pConn)
+static int ICACHE_FLASH_ATTR send_version(struct bc_proto_peer_t *pPeer)
 {
     DBG_FUNCNAME();
 
     int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t) + SZ_VERSION_PAYLOAD + STRLEN(BC_VER_UA));
+    if (pProto == NULL) {
+        return SEND_LATER;
+    }
     uint8_t *p = pProto->payload;
 
     set_header(pProto, kCMD_VERSION);
@@ -1721,38 +3127,42 @@ static int ICACHE_FLASH_ATTR send_version(struct espconn *pConn)
     bc_misc_add(&p, rnd, sizeof(uint64_t));
     //user_agent
     int ua_len = STRLEN(BC_VER_UA);
-    add_varint(&p, ua_len);
+    bc_misc_add_varint(&p, ua_len);
     MEMCPY(p, BC_VER_UA, ua_len);
     p += ua_len;
-    //start_height(0固定)
-    bc_misc_add(&p, 0, sizeof(int32_t));
+    //start_height(最後に記録したheader)
+    struct bc_flash_hdr_t hdr;
+    bc_misc_add(&p, (bc_flash_hdr_find(&hdr, NULL)) ? hdr.height : 0, sizeof(int32_t));
     //relay
     bc_misc_add(&p, 0, 1);
 
     //payload length
     pProto->length = p - pProto->payload;
 
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+    ret = send_data(pPeer, pProto);
     return ret;
 }
 
 
 /** Bitcoinパケット送信(verack)
  *
- * @param[in]       pConn       管理データ
- * @return          送信結果(0..OK)
+ * @param[in]       pPeer       管理データ
+ * @return          送信結果(0..OK, SEND_LATER..送信バッファに空きがない)
  */
-static int ICACHE_FLASH_ATTR send_verack(struct espconn *pConn)
+static int ICACHE_FLASH_ATTR send_verack(struct bc_proto_peer_t *pPeer)
 {
     DBG_FUNCNAME();
 
     int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t));
+    if (pProto == NULL) {
+        return SEND_LATER;
+    }
 
-    set_header(pProto, kCMD_VERACK);
-    pProto->length = 0;
+    //checksumまで雛形のまま
+    MEMCPY(pProto, &kFrameVerack, sizeof(struct bc_proto_t));
 
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+    ret = send_frame(pPeer, pProto);
     return ret;
 }
 
@@ -1760,15 +3170,18 @@ static int ICACHE_FLASH_ATTR send_verack(struct espconn *pConn)
 #if 0
 /** Bitcoinパケット送信(ping)
  *
- * @param[in]       pConn       管理データ
- * @return          送信結果(0..OK)
+ * @param[in]       pPeer       管理データ
+ * @return          送信結果(0..OK, SEND_LATER..送信バッファに空きがない)
  */
-static int ICACHE_FLASH_ATTR send_ping(struct espconn *pConn)
+static int ICACHE_FLASH_ATTR send_ping(struct bc_proto_peer_t *pPeer)
 {
     DBG_FUNCNAME();
 
     int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t) + sizeof(uint64_t));
+    if (pProto == NULL) {
+        return SEND_LATER;
+    }
     uint8_t *p = pProto->payload;
 
     set_header(pProto, kCMD_PING);
@@ -1779,7 +3192,7 @@ static int ICACHE_FLASH_ATTR send_ping(struct espconn *pConn)
     bc_misc_add(&p, rnd, sizeof(uint64_t));
     pProto->length = sizeof(uint64_t);
 
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+    ret = send_data(pPeer, pProto);
     return ret;
 }
 #endif
@@ -1787,23 +3200,26 @@ static int ICACHE_FLASH_ATTR send_ping(struct espconn *pConn)
 
 /** Bitcoinパケット送信(pong)
  *
- * @param[in]       pConn       管理データ
+ * @param[in]       pPeer       管理データ
  * @param[in]       Nonce       送信するnonce(通常はpingと同じ値)
- * @return          送信結果(0..OK)
+ * @return          送信結果(0..OK, SEND_LATER..送信バッファに空きがない)
  */
-static int ICACHE_FLASH_ATTR send_pong(struct espconn *pConn, uint64_t Nonce)
+static int ICACHE_FLASH_ATTR send_pong(struct bc_proto_peer_t *pPeer, uint64_t Nonce)
 {
     DBG_FUNCNAME();
 
     int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t) + sizeof(uint64_t));
+    if (pProto == NULL) {
+        return SEND_LATER;
+    }
 
     set_header(pProto, kCMD_PONG);
     pProto->length = 8;
     //nonce
     MEMCPY(pProto->payload, &Nonce, pProto->length);
 
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+    ret = send_data(pPeer, pProto);
     return ret;
 }
 
@@ -1811,15 +3227,18 @@ static int ICACHE_FLASH_ATTR send_pong(struct espconn *pConn, uint64_t Nonce)
 #if 0
 /** Bitcoinパケット送信(getblocks)
  *
- * @param[in]       pConn       管理データ
- * @return          送信結果(0..OK)
+ * @param[in]       pPeer       管理データ
+ * @return          送信結果(0..OK, SEND_LATER..送信バッファに空きがない)
  */
-static int ICACHE_FLASH_ATTR send_getblocks(struct espconn *pConn, const uint8_t *pHash)
+static int ICACHE_FLASH_ATTR send_getblocks(struct bc_proto_peer_t *pPeer, const uint8_t *pHash)
 {
     DBG_FUNCNAME();
 
     int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t) + SZ_GETHEADERS_PAYLOAD(1));
+    if (pProto == NULL) {
+        return SEND_LATER;
+    }
     uint8_t *p = pProto->payload;
 
     set_header(pProto, kCMD_GETBLOCKS);
@@ -1838,7 +3257,7 @@ static int ICACHE_FLASH_ATTR send_getblocks(struct espconn *pConn, const uint8_t
     //payload length
     pProto->length = p - pProto->payload;
 
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+    ret = send_data(pPeer, pProto);
     return ret;
 }
 #endif
@@ -1846,29 +3265,58 @@ static int ICACHE_FLASH_ATTR send_getblocks(struct espconn *pConn, const uint8_t
 
 /** Bitcoinパケット送信(getheaders)
  *
- * @param[in]       pConn       管理データ
- * @return          送信結果(0..OK)
+ * block locatorは、pHashの後ろにFLASHに保存したBlock Hashの履歴(#bc_flash_get_locator())を続ける。
+ * pHashがreorgで無効になっていても、peerは履歴から分岐点を見つけられる。
+ *
+ * @param[in]       pPeer       管理データ
+ * @param[in]       pHash       block locatorの先頭
+ * @param[in]       pStop       hash_stop(NULL:最大数)
+ * @return          送信結果(0..OK, SEND_LATER..送信バッファに空きがない)
  */
-static int ICACHE_FLASH_ATTR send_getheaders(struct espconn *pConn, const uint8_t *pHash)
+static int ICACHE_FLASH_ATTR send_getheaders(struct bc_proto_peer_t *pPeer, const uint8_t *pHash, const uint8_t *pStop)
 {
     //DBG_FUNCNAME();
 
     int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t) + SZ_GETHEADERS_PAYLOAD(1 + BC_FLASH_LOCATOR_NUM));
+    if (pProto == NULL) {
+        return SEND_LATER;
+    }
     uint8_t *p = pProto->payload;
 
-    set_header(pProto, kCMD_GETHEADERS);
+    //header
+    MEMCPY(pProto, &kFrameGetheaders, sizeof(struct bc_proto_t));
 
     //version
-    bc_misc_add(&p, BC_PROTOCOL_VERSION, sizeof(int32_t));
-    //hash count
-    bc_misc_add(&p, 1, sizeof(uint8_t));        //varintだが1byte固定なので省略
+    MEMCPY(p, kGetheadersPrefix, sizeof(kGetheadersPrefix));
+    p += sizeof(kGetheadersPrefix);
+    //hash count            : 後で設定(varintだが最大17件なので1byte)
+    uint8_t *p_count = p++;
     //block locator hashes
     MEMCPY(p, pHash, BC_SZ_HASH256);
+    //保存した履歴を続ける(pHashと同じものは除く)
+    int num = 1;
+    int hist = bc_flash_get_locator(p + BC_SZ_HASH256, BC_FLASH_LOCATOR_NUM);
+    for (int lp = 0; lp < hist; lp++) {
+        const uint8_t *p_hist = p + BC_SZ_HASH256 * (1 + lp);
+        if (MEMCMP(p_hist, pHash, BC_SZ_HASH256) != 0) {
+            MEMMOVE(p + BC_SZ_HASH256 * num, p_hist, BC_SZ_HASH256);
+            num++;
+        }
+    }
+    *p_count = (uint8_t)num;
+    p += BC_SZ_HASH256 * num;
+    //hash_stop             : 指定がなければ最大数
+    if (pStop != NULL) {
+        MEMCPY(p, pStop, BC_SZ_HASH256);
+    }
+    else {
+        MEMSET(p, 0, BC_SZ_HASH256);
+    }
     p += BC_SZ_HASH256;
-    //hash_stop             : 最大数
-    MEMSET(p, 0, BC_SZ_HASH256);
-    p += BC_SZ_HASH256;
+
+    //payload length
+    pProto->length = p - pProto->payload;
 
     DBG_PRINTF("    hash(getheaders) : ");
     for (int i = 0; i < BC_SZ_HASH256; i++) {
@@ -1876,66 +3324,94 @@ static int ICACHE_FLASH_ATTR send_getheaders(struct espconn *pConn, const uint8_
     }
     DBG_PRINTF("\n");
 
-    //payload length
-    pProto->length = p - pProto->payload;
-
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+    ret = send_data(pPeer, pProto);
     return ret;
 }
 
 
-#if 0
 /** Bitcoinパケット送信(getdata)
  *
- * @param[in]       pConn       管理データ
- * @param[in]       pInv        取得要求するINV(varint + inv_vect[])
- * @param[in]       Len         pInv長
- * @return          送信結果(0..OK)
+ * pGetdataHashからgetdataRest件のBlock Hashを、MSG_FILTERED_BLOCKでgetdataする。
+ * 1メッセージはGETDATA_CHUNK件までとし、ESP8266では残りを送信完了(#bc_sent())ごとに1メッセージずつ送信する。
+ *
+ * @param[in,out]   pPeer       管理データ
+ * @return          送信結果(0..OK, SEND_LATER..送信バッファに空きがない)
  */
-static int ICACHE_FLASH_ATTR send_getdata(struct espconn *pConn, const uint8_t *pInv, int Len)
+static int ICACHE_FLASH_ATTR send_getdata(struct bc_proto_peer_t *pPeer)
 {
-    DBG_FUNCNAME();
+    int ret = 0;
 
-    int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
+    while (pPeer->getdataRest > 0) {
+        if (pPeer->bufferCnt != 0) {
+            //送信待ちがある --> 送信完了後に送信する
+            break;
+        }
 
-    set_header(pProto, kCMD_GETDATA);
+        int cnt = (pPeer->getdataRest > GETDATA_CHUNK) ? GETDATA_CHUNK : pPeer->getdataRest;
+        struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t) + 1 + cnt * sizeof(struct inv_t));
+        if (pProto == NULL) {
+            //送信完了後に送信する
+            ret = SEND_LATER;
+            break;
+        }
+        uint8_t *p = pProto->payload;
+
+        MEMCPY(pProto, &kFrameGetdata, sizeof(struct bc_proto_t));
+
+        //count
+        *p++ = (uint8_t)cnt;        //varintだが1byte固定なので省略
+        //inventory
+        for (int lp = 0; lp < cnt; lp++) {
+            bc_misc_add(&p, INV_MSG_FILTERED_BLOCK, sizeof(uint32_t));
+            MEMCPY(p, pPeer->pGetdataHash, BC_SZ_HASH256);
+            p += BC_SZ_HASH256;
+            pPeer->pGetdataHash += BC_SZ_HASH256;
+        }
+        pPeer->getdataRest -= cnt;
 
-    //inv
-    pProto->length = Len;
-    MEMCPY(pProto->payload, pInv, pProto->length);
+        //payload length
+        pProto->length = p - pProto->payload;
 
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+        DBG_PRINTF("@@@ send getdata[cnt:%d, rest:%d] @@@\n", cnt, pPeer->getdataRest);
+        ret = send_data(pPeer, pProto);
+        //続きは送信完了後(Linux版も同じ)
+        break;
+    }
     return ret;
 }
-#endif
 
 
 /** Bitcoinパケット送信(filterload)
  *
- * @param[in]       pConn       管理データ
- * @return          送信結果(0..OK)
+ * @param[in]       pPeer       管理データ
+ * @return          送信結果(0..OK, SEND_LATER..送信バッファに空きがない)
  */
-static int ICACHE_FLASH_ATTR send_filterload(struct espconn *pConn)
+static int ICACHE_FLASH_ATTR send_filterload(struct bc_proto_peer_t *pPeer)
 {
     DBG_FUNCNAME();
 
     int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
     struct bc_flash_wlt_t wlt;
 
     bc_flash_get_bcaddr(&wlt);
 
-    set_header(pProto, kCMD_FILTERLOAD);
-
     struct bloom bloom;
     bloom_init(&bloom, BLOOM_ELEMENTS, BLOOM_RATE, BLOOM_TWEAK);
     bloom_insert(&bloom, wlt.pubkey, sizeof(wlt.pubkey));
     bloom_insert(&bloom, wlt.bcaddr, sizeof(wlt.bcaddr));
 
+    //filter(varint最大9byte) + nHashFuncs + nTweak + nFlags
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t) + 9 + bloom.vData->len + 4 + 4 + 1);
+    if (pProto == NULL) {
+        bloom_free(&bloom);
+        return SEND_LATER;
+    }
+
+    set_header(pProto, kCMD_FILTERLOAD);
+
     //filter
     uint8_t *p = pProto->payload;
-    add_varint(&p, bloom.vData->len);
+    bc_misc_add_varint(&p, bloom.vData->len);
     MEMCPY(p, bloom.vData->str, bloom.vData->len);
     p += bloom.vData->len;
     bloom_free(&bloom);
@@ -1952,21 +3428,42 @@ static int ICACHE_FLASH_ATTR send_filterload(struct espconn *pConn)
     //payload length
     pProto->length = p - pProto->payload;
 
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+    ret = send_data(pPeer, pProto);
+    return ret;
+}
+
+
+static int ICACHE_FLASH_ATTR send_mempool(struct bc_proto_peer_t *pPeer)
+{
+    DBG_FUNCNAME();
+
+    int ret;
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t));
+    if (pProto == NULL) {
+        return SEND_LATER;
+    }
+
+    //checksumまで雛形のまま
+    MEMCPY(pProto, &kFrameMempool, sizeof(struct bc_proto_t));
+
+    ret = send_frame(pPeer, pProto);
     return ret;
 }
 
 
-static int ICACHE_FLASH_ATTR send_mempool(struct espconn *pConn)
+static int ICACHE_FLASH_ATTR send_sendheaders(struct bc_proto_peer_t *pPeer)
 {
     DBG_FUNCNAME();
 
     int ret;
-    struct bc_proto_t *pProto = (struct bc_proto_t *)mBufferWPnt;
+    struct bc_proto_t *pProto = send_reserve(pPeer, sizeof(struct bc_proto_t));
+    if (pProto == NULL) {
+        return SEND_LATER;
+    }
 
-    set_header(pProto, kCMD_MEMPOOL);
-    pProto->length = 0;
+    //checksumまで雛形のまま
+    MEMCPY(pProto, &kFrameSendheaders, sizeof(struct bc_proto_t));
 
-    ret = send_data(pConn, (struct bc_proto_t *)mBufferWPnt);
+    ret = send_frame(pPeer, pProto);
     return ret;
 }
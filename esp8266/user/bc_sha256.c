@@ -0,0 +1,564 @@
+/**************************************************************************
+ * @file    bc_sha256.c
+ * @brief   [Linux]HASH256のバックエンド
+ * @note
+ *          - 初回呼び出し時に、CPUが対応しているバックエンドを計測して一番速いものに決める
+ *          - SHA拡張命令とAVX2はx86_64のみ。それ以外はOpenSSLを使う
+ *          - 一括計算はデータ長が同じであることを利用し、paddingを全件共通で作る
+ **************************************************************************/
+#ifndef __XTENSA__
+
+#include <stdlib.h>
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define USE_X86
+#endif
+
+#include "bc_sha256.h"
+
+
+/**************************************************************************
+ * macros
+ **************************************************************************/
+
+#define SZ_BLOCK                (64)            ///< SHA256のブロックサイズ
+#define AVX2_LANES              (8)             ///< AVX2で並列計算するメッセージ数
+#define ENV_BACKEND             "BC_SHA256_BACKEND"     ///< バックエンドを固定する環境変数
+#define MEASURE_NUM             (64)            ///< バックエンド選択で計算するblock header数
+#define MEASURE_TRY             (5)             ///< バックエンド選択で計測する回数(最短を使う)
+
+
+/**************************************************************************
+ * types
+ **************************************************************************/
+
+/** @struct backend_t
+ *
+ * HASH256のバックエンド
+ */
+struct backend_t {
+    const char  *pName;                                 ///< バックエンド名
+    void        (*pHash)(uint8_t *pHash, const uint8_t *pData, size_t Size);    ///< 単発計算
+    void        (*pBatch)(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num);  ///< 一括計算
+};
+
+
+/**************************************************************************
+ * prototypes
+ **************************************************************************/
+
+static const struct backend_t *select_backend(void);
+static uint32_t measure_backend(const struct backend_t *pBackend);
+
+static void openssl_hash(uint8_t *pHash, const uint8_t *pData, size_t Size);
+static void single_batch(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num);
+static int make_tail(uint8_t *pTail, const uint8_t *pData, size_t Size);
+
+#ifdef USE_X86
+static void shani_hash(uint8_t *pHash, const uint8_t *pData, size_t Size);
+static void shani_blocks(uint32_t *pState, const uint8_t *pData, size_t Num);
+static void avx2_batch(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num);
+static void avx2_lanes(uint8_t *pHash, const uint8_t * const *ppData, size_t Size);
+static void avx2_compress(__m256i *pState, __m256i *pW);
+#endif  //USE_X86
+
+
+/**************************************************************************
+ * const variables
+ **************************************************************************/
+
+/** SHA256の定数 */
+static const uint32_t kSha256K[64] __attribute__ ((aligned (16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/** SHA256の初期値 */
+static const uint32_t kSha256H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/** バックエンド(優先順) */
+static const struct backend_t kBackends[] = {
+#ifdef USE_X86
+    {   "shani+avx2",   shani_hash,     avx2_batch      },
+    {   "shani",        shani_hash,     single_batch    },
+    {   "avx2",         openssl_hash,   avx2_batch      },
+#endif  //USE_X86
+    {   "openssl",      openssl_hash,   single_batch    },
+};
+
+
+/**************************************************************************
+ * private variables
+ **************************************************************************/
+
+static const struct backend_t   *mpBackend;     ///< 選択したバックエンド(NULL:未選択)
+
+
+/**************************************************************************
+ * public functions
+ **************************************************************************/
+
+void bc_sha256_hash256(uint8_t *pHash, const uint8_t *pData, size_t Size)
+{
+    if (mpBackend == NULL) {
+        mpBackend = select_backend();
+    }
+    (*mpBackend->pHash)(pHash, pData, Size);
+}
+
+
+void bc_sha256_hash256_batch(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num)
+{
+    if (mpBackend == NULL) {
+        mpBackend = select_backend();
+    }
+    (*mpBackend->pBatch)(pHash, pData, Size, Stride, Num);
+}
+
+
+const char *bc_sha256_backend(void)
+{
+    if (mpBackend == NULL) {
+        mpBackend = select_backend();
+    }
+    return mpBackend->pName;
+}
+
+
+/**************************************************************************
+ * private functions
+ **************************************************************************/
+
+/** バックエンド選択
+ *
+ * 環境変数で指定があればそれを、なければCPUが対応しているバックエンドから
+ * block header(80byte)の単発計算と一括計算を実際に計り、一番速いものを使う。
+ * OpenSSLも内部でSHA拡張命令を使うことがあり、順位はCPUとOpenSSLの版で変わるため。
+ *
+ * @return      バックエンド
+ */
+static const struct backend_t *select_backend(void)
+{
+    const char *p_env = getenv(ENV_BACKEND);
+    int num = sizeof(kBackends) / sizeof(kBackends[0]);
+
+    if ((p_env != NULL) && (*p_env == '\0')) {
+        p_env = NULL;
+    }
+
+#ifdef USE_X86
+    __builtin_cpu_init();
+#endif
+    const struct backend_t *p_best = NULL;
+    uint32_t best = 0;
+    for (int lp = 0; lp < num; lp++) {
+        const struct backend_t *p = &kBackends[lp];
+        if ((p_env != NULL) && (STRCMP(p_env, p->pName) != 0)) {
+            continue;
+        }
+#ifdef USE_X86
+        if ((p->pHash == shani_hash) && !__builtin_cpu_supports("sha")) {
+            continue;
+        }
+        if ((p->pBatch == avx2_batch) && !__builtin_cpu_supports("avx2")) {
+            continue;
+        }
+#endif
+        if (p_env != NULL) {
+            return p;
+        }
+        uint32_t usec = measure_backend(p);
+        DBG_PRINTF("[%s()]%s : %u us\n", __func__, p->pName, usec);
+        if ((p_best == NULL) || (usec < best)) {
+            p_best = p;
+            best = usec;
+        }
+    }
+    if (p_best != NULL) {
+        return p_best;
+    }
+    if (p_env != NULL) {
+        DBG_PRINTF("[%s()]%s=%s not available\n", __func__, ENV_BACKEND, p_env);
+    }
+    return &kBackends[num - 1];
+}
+
+
+/** バックエンドの計測
+ *
+ * MEASURE_NUM件のblock headerを一括計算と単発計算で1回ずつ計算した時間を、MEASURE_TRY回のうち最短で返す。
+ * 1回目は初回呼び出しの準備(OpenSSLの初期化など)を含むので、計測に使わない。
+ * 一括計算が単発計算を呼ぶ(#single_batch())ため、計測中はmpBackendを書き換える。
+ *
+ * @param[in]       pBackend    計測するバックエンド
+ * @return          計算時間(usec)
+ */
+static uint32_t measure_backend(const struct backend_t *pBackend)
+{
+    uint8_t data[BC_SZ_BLOCK_HEADER * MEASURE_NUM];
+    uint8_t hash[BC_SZ_HASH256 * MEASURE_NUM];
+    uint32_t best = UINT32_MAX;
+
+    for (int lp = 0; lp < (int)sizeof(data); lp++) {
+        data[lp] = (uint8_t)lp;
+    }
+    mpBackend = pBackend;
+    for (int lp = 0; lp <= MEASURE_TRY; lp++) {
+        uint32_t start = bc_misc_tick();
+        (*pBackend->pBatch)(hash, data, BC_SZ_BLOCK_HEADER, BC_SZ_BLOCK_HEADER, MEASURE_NUM);
+        for (int cnt = 0; cnt < MEASURE_NUM; cnt++) {
+            (*pBackend->pHash)(hash + BC_SZ_HASH256 * cnt, data + BC_SZ_BLOCK_HEADER * cnt, BC_SZ_BLOCK_HEADER);
+        }
+        uint32_t usec = bc_misc_tick() - start;
+        if ((lp > 0) && (usec < best)) {
+            best = usec;
+        }
+    }
+    mpBackend = NULL;
+
+    return best;
+}
+
+
+/** [openssl]HASH256
+ *
+ * @param[out]      pHash       計算結果(32byte)
+ * @param[in]       pData       計算元データ
+ * @param[in]       Size        データサイズ
+ */
+static void openssl_hash(uint8_t *pHash, const uint8_t *pData, size_t Size)
+{
+    SHA256_CTX ctx;
+    uint8_t hash1[BC_SZ_HASH256];
+
+    //SHA256()はOpenSSL 3でEVP経由になって遅いので、SHA256_Init()系を使う
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, pData, Size);
+    SHA256_Final(hash1, &ctx);
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, hash1, sizeof(hash1));
+    SHA256_Final(pHash, &ctx);
+}
+
+
+/** 単発計算を繰り返す一括計算
+ *
+ * @param[out]      pHash       計算結果(32byte * Num)
+ * @param[in]       pData       計算元データ
+ * @param[in]       Size        1件のデータサイズ
+ * @param[in]       Stride      データの間隔
+ * @param[in]       Num         件数
+ */
+static void single_batch(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num)
+{
+    for (int lp = 0; lp < Num; lp++) {
+        (*mpBackend->pHash)(pHash, pData, Size);
+        pHash += BC_SZ_HASH256;
+        pData += Stride;
+    }
+}
+
+
+/** 最終ブロック作成
+ *
+ * 64byteに満たない残りのデータにpaddingとデータ長(bit, Big Endian)を付ける。
+ *
+ * @param[out]      pTail       最終ブロック(128byte)
+ * @param[in]       pData       計算元データ(先頭。残りのデータがpTailにあってもよい)
+ * @param[in]       Size        データサイズ
+ * @return          最終ブロック数(1 or 2)
+ */
+static int make_tail(uint8_t *pTail, const uint8_t *pData, size_t Size)
+{
+    size_t rest = Size % SZ_BLOCK;
+    int blocks = (rest < SZ_BLOCK - 8) ? 1 : 2;
+    uint64_t bits = (uint64_t)Size << 3;
+    uint8_t *p_len = pTail + blocks * SZ_BLOCK - 8;
+
+    if (pTail != pData + Size - rest) {
+        MEMCPY(pTail, pData + Size - rest, rest);
+    }
+    pTail[rest] = 0x80;
+    MEMSET(pTail + rest + 1, 0, p_len - (pTail + rest + 1));
+    for (int lp = 0; lp < 8; lp++) {
+        p_len[lp] = (uint8_t)(bits >> (56 - lp * 8));
+    }
+    return blocks;
+}
+
+
+#ifdef USE_X86
+
+/** [shani]HASH256
+ *
+ * @param[out]      pHash       計算結果(32byte)
+ * @param[in]       pData       計算元データ
+ * @param[in]       Size        データサイズ
+ */
+__attribute__ ((target ("sha,sse4.1")))
+static void shani_hash(uint8_t *pHash, const uint8_t *pData, size_t Size)
+{
+    uint32_t state[8];
+    uint8_t tail[SZ_BLOCK * 2];
+    int blocks;
+
+    //1回目
+    MEMCPY(state, kSha256H0, sizeof(state));
+    shani_blocks(state, pData, Size / SZ_BLOCK);
+    blocks = make_tail(tail, pData, Size);
+    shani_blocks(state, tail, blocks);
+
+    //2回目
+    for (int lp = 0; lp < 8; lp++) {
+        tail[lp * 4 + 0] = (uint8_t)(state[lp] >> 24);
+        tail[lp * 4 + 1] = (uint8_t)(state[lp] >> 16);
+        tail[lp * 4 + 2] = (uint8_t)(state[lp] >> 8);
+        tail[lp * 4 + 3] = (uint8_t)state[lp];
+    }
+    make_tail(tail, tail, BC_SZ_HASH256);
+    MEMCPY(state, kSha256H0, sizeof(state));
+    shani_blocks(state, tail, 1);
+
+    for (int lp = 0; lp < 8; lp++) {
+        pHash[lp * 4 + 0] = (uint8_t)(state[lp] >> 24);
+        pHash[lp * 4 + 1] = (uint8_t)(state[lp] >> 16);
+        pHash[lp * 4 + 2] = (uint8_t)(state[lp] >> 8);
+        pHash[lp * 4 + 3] = (uint8_t)state[lp];
+    }
+}
+
+
+/** [shani]SHA256 : ブロック処理
+ *
+ * @param[in,out]   pState      中間ハッシュ値
+ * @param[in]       pData       データ(64byte * Num)
+ * @param[in]       Num         ブロック数
+ */
+__attribute__ ((target ("sha,sse4.1")))
+static void shani_blocks(uint32_t *pState, const uint8_t *pData, size_t Num)
+{
+    const __m128i kMask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&pState[0]);
+    __m128i st1 = _mm_loadu_si128((const __m128i *)&pState[4]);
+
+    //ABCD, EFGH --> ABEF, CDGH
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    st1 = _mm_shuffle_epi32(st1, 0x1b);
+    __m128i st0 = _mm_alignr_epi8(tmp, st1, 8);
+    st1 = _mm_blend_epi16(st1, tmp, 0xf0);
+
+    while (Num--) {
+        __m128i save0 = st0;
+        __m128i save1 = st1;
+        __m128i m[4];
+
+        for (int lp = 0; lp < 4; lp++) {
+            m[lp] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + lp * 16)), kMask);
+        }
+        //4ラウンドずつ。m[]は直近4グループのメッセージ
+        for (int grp = 0; grp < 16; grp++) {
+            __m128i w = m[grp & 3];
+            if (grp >= 4) {
+                w = _mm_sha256msg1_epu32(m[grp & 3], m[(grp + 1) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(m[(grp + 3) & 3], m[(grp + 2) & 3], 4));
+                w = _mm_sha256msg2_epu32(w, m[(grp + 3) & 3]);
+                m[grp & 3] = w;
+            }
+            __m128i msg = _mm_add_epi32(w, _mm_load_si128((const __m128i *)&kSha256K[grp * 4]));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, msg);
+        }
+
+        st0 = _mm_add_epi32(st0, save0);
+        st1 = _mm_add_epi32(st1, save1);
+        pData += SZ_BLOCK;
+    }
+
+    //ABEF, CDGH --> ABCD, EFGH
+    tmp = _mm_shuffle_epi32(st0, 0x1b);
+    st1 = _mm_shuffle_epi32(st1, 0xb1);
+    st0 = _mm_blend_epi16(tmp, st1, 0xf0);
+    st1 = _mm_alignr_epi8(st1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&pState[0], st0);
+    _mm_storeu_si128((__m128i *)&pState[4], st1);
+}
+
+
+/** [avx2]一括計算
+ *
+ * 8件ずつ並列計算し、端数は単発計算(openssl)で行う。
+ *
+ * @param[out]      pHash       計算結果(32byte * Num)
+ * @param[in]       pData       計算元データ
+ * @param[in]       Size        1件のデータサイズ
+ * @param[in]       Stride      データの間隔
+ * @param[in]       Num         件数
+ */
+__attribute__ ((target ("avx2")))
+static void avx2_batch(uint8_t *pHash, const uint8_t *pData, size_t Size, size_t Stride, int Num)
+{
+    const uint8_t *p_lanes[AVX2_LANES];
+
+    for (; Num >= AVX2_LANES; Num -= AVX2_LANES) {
+        for (int lp = 0; lp < AVX2_LANES; lp++) {
+            p_lanes[lp] = pData;
+            pData += Stride;
+        }
+        avx2_lanes(pHash, p_lanes, Size);
+        pHash += BC_SZ_HASH256 * AVX2_LANES;
+    }
+    for (; Num > 0; Num--) {
+        openssl_hash(pHash, pData, Size);
+        pHash += BC_SZ_HASH256;
+        pData += Stride;
+    }
+}
+
+
+/** [avx2]8件のHASH256
+ *
+ * @param[out]      pHash       計算結果(32byte * 8)
+ * @param[in]       ppData      計算元データ(8件)
+ * @param[in]       Size        1件のデータサイズ
+ */
+__attribute__ ((target ("avx2")))
+static void avx2_lanes(uint8_t *pHash, const uint8_t * const *ppData, size_t Size)
+{
+#define BE32(p)     ((int)GET_BE32((p)))
+#define LOAD_W(pp, off, i)   _mm256_set_epi32(BE32(pp[7] + (off) + (i) * 4), BE32(pp[6] + (off) + (i) * 4),    \
+                                              BE32(pp[5] + (off) + (i) * 4), BE32(pp[4] + (off) + (i) * 4),    \
+                                              BE32(pp[3] + (off) + (i) * 4), BE32(pp[2] + (off) + (i) * 4),    \
+                                              BE32(pp[1] + (off) + (i) * 4), BE32(pp[0] + (off) + (i) * 4))
+    __m256i state[8];
+    __m256i w[16];
+    uint8_t tail[AVX2_LANES][SZ_BLOCK * 2];
+    const uint8_t *p_tails[AVX2_LANES];
+    size_t full = Size / SZ_BLOCK;
+    int blocks = 0;
+    int lp;
+
+    //1回目
+    for (lp = 0; lp < 8; lp++) {
+        state[lp] = _mm256_set1_epi32((int)kSha256H0[lp]);
+    }
+    for (size_t blk = 0; blk < full; blk++) {
+        for (lp = 0; lp < 16; lp++) {
+            w[lp] = LOAD_W(ppData, blk * SZ_BLOCK, lp);
+        }
+        avx2_compress(state, w);
+    }
+    for (lp = 0; lp < AVX2_LANES; lp++) {
+        blocks = make_tail(tail[lp], ppData[lp], Size);
+        p_tails[lp] = tail[lp];
+    }
+    for (int blk = 0; blk < blocks; blk++) {
+        for (lp = 0; lp < 16; lp++) {
+            w[lp] = LOAD_W(p_tails, blk * SZ_BLOCK, lp);
+        }
+        avx2_compress(state, w);
+    }
+
+    //2回目 : 1回目の結果はそのままメッセージとして使える
+    for (lp = 0; lp < 8; lp++) {
+        w[lp] = state[lp];
+        state[lp] = _mm256_set1_epi32((int)kSha256H0[lp]);
+    }
+    w[8] = _mm256_set1_epi32((int)0x80000000);
+    for (lp = 9; lp < 15; lp++) {
+        w[lp] = _mm256_setzero_si256();
+    }
+    w[15] = _mm256_set1_epi32(BC_SZ_HASH256 * 8);
+    avx2_compress(state, w);
+
+    uint32_t out[8][AVX2_LANES];
+    for (lp = 0; lp < 8; lp++) {
+        _mm256_storeu_si256((__m256i *)out[lp], state[lp]);
+    }
+    for (int lane = 0; lane < AVX2_LANES; lane++) {
+        for (lp = 0; lp < 8; lp++) {
+            *pHash++ = (uint8_t)(out[lp][lane] >> 24);
+            *pHash++ = (uint8_t)(out[lp][lane] >> 16);
+            *pHash++ = (uint8_t)(out[lp][lane] >> 8);
+            *pHash++ = (uint8_t)out[lp][lane];
+        }
+    }
+#undef LOAD_W
+#undef BE32
+}
+
+
+/** [avx2]SHA256 : 8件分の圧縮関数
+ *
+ * @param[in,out]   pState      中間ハッシュ値(word単位で8件)
+ * @param[in,out]   pW          メッセージ(16word, 計算で壊れる)
+ */
+__attribute__ ((target ("avx2")))
+static void avx2_compress(__m256i *pState, __m256i *pW)
+{
+#define ROTR(x,n)   _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define ADD(x,y)    _mm256_add_epi32((x), (y))
+#define XOR3(x,y,z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+    __m256i a = pState[0];
+    __m256i b = pState[1];
+    __m256i c = pState[2];
+    __m256i d = pState[3];
+    __m256i e = pState[4];
+    __m256i f = pState[5];
+    __m256i g = pState[6];
+    __m256i h = pState[7];
+
+    for (int lp = 0; lp < 64; lp++) {
+        __m256i x;
+        if (lp < 16) {
+            x = pW[lp];
+        }
+        else {
+            __m256i w15 = pW[(lp - 15) & 15];
+            __m256i w2 = pW[(lp - 2) & 15];
+            __m256i s0 = XOR3(ROTR(w15, 7), ROTR(w15, 18), _mm256_srli_epi32(w15, 3));
+            __m256i s1 = XOR3(ROTR(w2, 17), ROTR(w2, 19), _mm256_srli_epi32(w2, 10));
+            x = ADD(ADD(pW[lp & 15], s0), ADD(pW[(lp - 7) & 15], s1));
+            pW[lp & 15] = x;
+        }
+        __m256i ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t1 = ADD(ADD(h, XOR3(ROTR(e, 6), ROTR(e, 11), ROTR(e, 25))),
+                         ADD(ADD(ch, _mm256_set1_epi32((int)kSha256K[lp])), x));
+        __m256i t2 = ADD(XOR3(ROTR(a, 2), ROTR(a, 13), ROTR(a, 22)), maj);
+        h = g;
+        g = f;
+        f = e;
+        e = ADD(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = ADD(t1, t2);
+    }
+
+    pState[0] = ADD(pState[0], a);
+    pState[1] = ADD(pState[1], b);
+    pState[2] = ADD(pState[2], c);
+    pState[3] = ADD(pState[3], d);
+    pState[4] = ADD(pState[4], e);
+    pState[5] = ADD(pState[5], f);
+    pState[6] = ADD(pState[6], g);
+    pState[7] = ADD(pState[7], h);
+#undef XOR3
+#undef ADD
+#undef ROTR
+}
+
+#endif  //USE_X86
+
+#endif  //__XTENSA__
@@ -22,6 +22,13 @@
 
 #define PORT            (18333)         //bitcoin testnet3
 
+//並列同期する接続先(最大BC_PROTO_PEER_MAX)
+static const uint8_t kPeerIp[][4] = {
+    { MY_HOST1, MY_HOST2, MY_HOST3, MY_HOST4 },
+};
+#define M_PEER_NUM      ARRAY_SIZE(kPeerIp)
+#define M_PEER_ALL      (0xff)          ///< TASK_REQ_TCP_RECONNECTで全接続を対象にする
+
 enum Status_t {
     ST_INIT,                ///< 初期状態
     ST_WIFI_CONNECTING,     ///< WiFi接続要求中
@@ -39,14 +46,17 @@ enum Status_t {
 static const char M_SSID[] = MY_SSID;
 static const char M_PASSWD[] = MY_PASSWD;
 
-#define M_SZ_QUEUE      (3)
+#define M_SZ_QUEUE      (3 + M_PEER_NUM)
 static os_event_t queue[M_SZ_QUEUE];
 static void ICACHE_FLASH_ATTR event_handler(os_event_t *pEvent);
 
 
-static struct espconn mConn;
+static struct espconn mConn[M_PEER_NUM];
+static struct bc_proto_peer_t mPeer[M_PEER_NUM];
+static uint8_t mPeerStarted[M_PEER_NUM];        ///< 1:bc_start()済み
+static struct bc_proto_sync_t mSync;
 static ip_addr_t mDnsIp;
-static esp_tcp mTcp;
+static esp_tcp mTcp[M_PEER_NUM];
 static enum Status_t mStatus = ST_INIT;
 
 //////////////////////////////////////
@@ -59,6 +69,7 @@ static void ICACHE_FLASH_ATTR data_sentcb(void *pArg);
 static void ICACHE_FLASH_ATTR data_receivedcb(void *pArg, char *pData, unsigned short Len);
 
 static void ICACHE_FLASH_ATTR event_handler(os_event_t *pEvent);
+static int ICACHE_FLASH_ATTR conn_index(const struct espconn *pConn);
 
 
 ////////////////////////////////////////////////////////////////
@@ -217,7 +228,8 @@ static void ICACHE_FLASH_ATTR wifi_eventcb(System_Event_t *evt)
                 REASON_CIPHER_SUITE_REJECTED    = 24
          */
         DBG_PRINTF("[DISC] SSID[%s] REASON[%d]\n", evt->event_info.disconnected.ssid, evt->event_info.disconnected.reason);
-        req = TASK_REQ_TCP_RECONNECT;
+        system_os_post(TASK_PRIOR_MAIN, TASK_REQ_TCP_RECONNECT, M_PEER_ALL);
+        req = TASK_REQ_IGNORE;
         mStatus = ST_INIT;
         break;
     case EVENT_STAMODE_AUTHMODE_CHANGE:
@@ -283,9 +295,15 @@ static void ICACHE_FLASH_ATTR tcp_connectedcb(void *pArg)
 
     espconn_set_opt(pConn, (enum espconn_option)(ESPCONN_REUSEADDR | ESPCONN_NODELAY));
 
-    mStatus = ST_TCP_CONNECTED;
-
-    system_os_post(TASK_PRIOR_MAIN, TASK_REQ_MBED_HANDSHAKE, 0);
+    if (mStatus == ST_BITCOIN) {
+        //後から接続した --> 同期に参加させる
+        system_os_post(TASK_PRIOR_MAIN, TASK_REQ_BC_START, 0);
+    }
+    else if (mStatus != ST_MBED_HANDSHAKING) {
+        //最初の接続でmbedと通信開始
+        mStatus = ST_TCP_CONNECTED;
+        system_os_post(TASK_PRIOR_MAIN, TASK_REQ_MBED_HANDSHAKE, conn_index(pConn));
+    }
 }
 
 
@@ -295,11 +313,15 @@ static void ICACHE_FLASH_ATTR tcp_connectedcb(void *pArg)
  */
 static void ICACHE_FLASH_ATTR tcp_disconnectedcb(void *pArg)
 {
+    struct espconn *pConn = (struct espconn *)pArg;
+
     DBG_FUNCNAME();
 
-    mStatus = ST_TCP_DISCONNECT;
+    if (mStatus != ST_BITCOIN) {
+        mStatus = ST_TCP_DISCONNECT;
+    }
 
-    system_os_post(TASK_PRIOR_MAIN, TASK_REQ_TCP_RECONNECT, 0);
+    system_os_post(TASK_PRIOR_MAIN, TASK_REQ_TCP_RECONNECT, conn_index(pConn));
 }
 
 
@@ -316,7 +338,7 @@ static void ICACHE_FLASH_ATTR data_sentcb(void *pArg)
 
     espconn_get_packet_info(pConn, &infoarg);
     //DBG_PRINTF("[%s()] sent_length=%d\n", __func__, infoarg.sent_length);
-    bc_sent(pConn, infoarg.sent_length);
+    bc_sent(&mPeer[conn_index(pConn)], infoarg.sent_length);
 }
 
 
@@ -331,6 +353,8 @@ static void ICACHE_FLASH_ATTR data_receivedcb(void *pArg, char *pData, unsigned
 //    DBG_PRINTF("[[ data_receivedcb : Len=%d ]]\n", Len);
     DBG_PRINTF("%%");
 
+    struct bc_proto_peer_t *pPeer = &mPeer[conn_index((struct espconn *)pArg)];
+
 //    DBG_PRINTF("----------\n");
     int lp;
 //    for (lp = 0; lp < Len; lp++) {
@@ -340,7 +364,7 @@ static void ICACHE_FLASH_ATTR data_receivedcb(void *pArg, char *pData, unsigned
     while (sz > 0) {
 //        DBG_PRINTF("------ sz : %d\n", sz);
         int prev_sz = sz;
-        bc_read_message(&mConn, (uint8_t *)pData, &sz);
+        bc_read_message(pPeer, (uint8_t *)pData, &sz);
         pData += prev_sz - sz;
     }
 //    DBG_PRINTF("-------data_receivedcb fin---\n");
@@ -348,6 +372,22 @@ static void ICACHE_FLASH_ATTR data_receivedcb(void *pArg, char *pData, unsigned
 }
 
 
+/** 接続の番号
+ *
+ * @param[in]   pConn           struct espconn
+ * @return      mConn[]の番号
+ */
+static int ICACHE_FLASH_ATTR conn_index(const struct espconn *pConn)
+{
+    int idx = pConn - mConn;
+    if ((idx < 0) || (idx >= (int)M_PEER_NUM)) {
+        DBG_PRINTF("unknown conn\n");
+        HALT();
+    }
+    return idx;
+}
+
+
 /** NTP完了コールバック
  *
  * @param[in]   epoch       取得時間(Epoch Time)
@@ -388,40 +428,48 @@ static void ICACHE_FLASH_ATTR event_handler(os_event_t *pEvent)
 
     case TASK_REQ_DNS_RESOLVE:
 #if 0
-        err = espconn_gethostbyname(&mConn, MY_HOST, &mDnsIp, dns_donecb);
+        err = espconn_gethostbyname(&mConn[0], MY_HOST, &mDnsIp, dns_donecb);
         if ((err != ESPCONN_OK) && (err != ESPCONN_INPROGRESS)) {
             DBG_PRINTF("espconn_gethostbyname fail : %d\n", err);
         }
         mStatus = ST_DNS_RESOLVING;
 #else
         //IP直接
-        IP4_ADDR(&mDnsIp, MY_HOST1, MY_HOST2, MY_HOST3, MY_HOST4);
         mStatus = ST_DNS_RESOLVED;
-        system_os_post(TASK_PRIOR_MAIN, TASK_REQ_TCP_CONNECT, 0);
+        for (int lp = 0; lp < (int)M_PEER_NUM; lp++) {
+            system_os_post(TASK_PRIOR_MAIN, TASK_REQ_TCP_CONNECT, lp);
+        }
 #endif
         break;
 
     case TASK_REQ_TCP_CONNECT:
-        mConn.type = ESPCONN_TCP;
-        mConn.state = ESPCONN_NONE;
-        mConn.proto.tcp = &mTcp;
-        mConn.proto.tcp->local_port = espconn_port();
-        mConn.proto.tcp->remote_port = PORT;
-        os_memcpy(mConn.proto.tcp->remote_ip, &mDnsIp.addr, 4);
-
-        espconn_regist_connectcb(&mConn, tcp_connectedcb);
-        espconn_regist_disconcb(&mConn, tcp_disconnectedcb);
-        espconn_connect(&mConn);
-        mStatus = ST_TCP_CONNECTING;
+        {
+            struct espconn *pConn = &mConn[pEvent->par];
+
+            IP4_ADDR(&mDnsIp, kPeerIp[pEvent->par][0], kPeerIp[pEvent->par][1], kPeerIp[pEvent->par][2], kPeerIp[pEvent->par][3]);
+            pConn->type = ESPCONN_TCP;
+            pConn->state = ESPCONN_NONE;
+            pConn->proto.tcp = &mTcp[pEvent->par];
+            pConn->proto.tcp->local_port = espconn_port();
+            pConn->proto.tcp->remote_port = PORT;
+            os_memcpy(pConn->proto.tcp->remote_ip, &mDnsIp.addr, 4);
+
+            espconn_regist_connectcb(pConn, tcp_connectedcb);
+            espconn_regist_disconcb(pConn, tcp_disconnectedcb);
+            espconn_connect(pConn);
+        }
+        if (mStatus != ST_BITCOIN) {
+            mStatus = ST_TCP_CONNECTING;
+        }
         break;
 
     case TASK_REQ_MBED_HANDSHAKE:
-        DBG_PRINTF("connected IP[" IPSTR "]\n", IP2STR(mConn.proto.tcp->remote_ip));
+        DBG_PRINTF("connected IP[" IPSTR "]\n", IP2STR(mConn[pEvent->par].proto.tcp->remote_ip));
 
         //TODO:バッファ確認用
         {
             struct espconn_packet infoarg;
-            espconn_get_packet_info(&mConn, &infoarg);
+            espconn_get_packet_info(&mConn[pEvent->par], &infoarg);
             DBG_PRINTF("@@@ info @@@\n");
             DBG_PRINTF("sent_length : %u\n", infoarg.sent_length);
             DBG_PRINTF("snd_buf_size : %u\n", infoarg.snd_buf_size);
@@ -473,16 +521,24 @@ static void ICACHE_FLASH_ATTR event_handler(os_event_t *pEvent)
             break;
         }
 
-        espconn_regist_recvcb(&mConn, data_receivedcb);
-        espconn_regist_sentcb(&mConn, data_sentcb);
+        //接続済みで未開始の接続を、すべて同期に参加させる
+        for (int lp = 0; lp < (int)M_PEER_NUM; lp++) {
+            if (mPeerStarted[lp] || (mConn[lp].state != ESPCONN_CONNECT)) {
+                continue;
+            }
+            espconn_regist_recvcb(&mConn[lp], data_receivedcb);
+            espconn_regist_sentcb(&mConn[lp], data_sentcb);
 
-        err_t err = bc_start(&mConn);
-        if (err == 0) {
-            mStatus = ST_BITCOIN;
-        }
-        else {
-            DBG_PRINTF("bc_start fail: %d\n", err);
-            system_os_post(TASK_PRIOR_MAIN, TASK_REQ_REBOOT, 0);
+            err_t err = bc_start(&mPeer[lp], &mConn[lp], &mSync);
+            if (err == 0) {
+                mPeerStarted[lp] = 1;
+                mStatus = ST_BITCOIN;
+            }
+            else {
+                DBG_PRINTF("bc_start fail: %d\n", err);
+                system_os_post(TASK_PRIOR_MAIN, TASK_REQ_REBOOT, 0);
+                break;
+            }
         }
         break;
 
@@ -494,11 +550,20 @@ static void ICACHE_FLASH_ATTR event_handler(os_event_t *pEvent)
 #else
         //TODO: 1秒待って接続
         DBG_PRINTF("recoonect --> CONNECT\n");
-        bc_finish();
+        for (int lp = 0; lp < (int)M_PEER_NUM; lp++) {
+            if ((pEvent->par == M_PEER_ALL) || (pEvent->par == lp)) {
+                bc_finish(&mPeer[lp]);
+                mPeerStarted[lp] = 0;
+            }
+        }
         for (int lp = 0; lp < 100; lp++) {
             os_delay_us(10000);     //10msec
         }
-        system_os_post(TASK_PRIOR_MAIN, TASK_REQ_TCP_CONNECT, 0);
+        for (int lp = 0; lp < (int)M_PEER_NUM; lp++) {
+            if ((pEvent->par == M_PEER_ALL) || (pEvent->par == lp)) {
+                system_os_post(TASK_PRIOR_MAIN, TASK_REQ_TCP_CONNECT, lp);
+            }
+        }
 #endif
         break;
 
@@ -510,7 +575,9 @@ static void ICACHE_FLASH_ATTR event_handler(os_event_t *pEvent)
         //再起動
         DBG_PRINTF("*** RESATART ***\n");
         if (pEvent->par == 0) {
-            bc_finish();
+            for (int lp = 0; lp < (int)M_PEER_NUM; lp++) {
+                bc_finish(&mPeer[lp]);
+            }
         }
         CMD_MBED_SEND(BC_MBED_CMD_REBOOT, BC_MBED_CMD_REBOOT_LEN);  //reboot
         os_delay_us(10000);